@@ -2,6 +2,7 @@
  */
 #include <sds.h>
 
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,7 +26,8 @@ enum OutputType {
     LIST_ATTS,
     LIST_DIM_SIZES,
     PRINT_ATTS,
-    PRINT_VAR
+    PRINT_VAR,
+    PRINT_STATS
 };
 
 enum DimStyle {
@@ -43,12 +45,15 @@ struct OutOpts {
     char *name; // dim, var, etc. to narrow output to
     const char *att;
     int ranges[MAX_DIMS][2], n_ranges;
+    int every; // print every Nth value along each dimension
+    int fortran_order; // print values with the first dimension fastest
 };
 
 static struct OutOpts opts = {
     .infile = NULL, .color = 0, .single_column = 0, .separator = " ",
     .dim_style = FORTRAN_DIM_STYLE, .out_type = FULL_SUMMARY,
-    .name = NULL, .att = NULL, .n_ranges = -1
+    .name = NULL, .att = NULL, .n_ranges = -1, .every = 1,
+    .fortran_order = 0
 };
 
 #ifndef S_ISLNK
@@ -193,11 +198,12 @@ static void print_string_value(const char *s)
 
 static void print_att_values(SDSAttInfo *att)
 {
+    void *data = sds_att_data(att);
     if (att->type == SDS_STRING) {
-        print_string_value(att->data.v);
+        print_string_value(data);
     } else { // all other value types
         for (int i = 0;;) {
-            print_value(att->type, att->data.v, i);
+            print_value(att->type, data, i);
             if (++i >= att->count)
                 break;
             fputs(opts.separator, stdout);
@@ -328,7 +334,7 @@ static void print_full_summary(SDSInfo *sds)
 
 static SDSVarInfo *var_or_die(SDSInfo *sds, const char *varname)
 {
-    SDSVarInfo *var = sds_var_by_name(sds->vars, varname);
+    SDSVarInfo *var = sds_find_var(sds, varname);
     if (!var) {
         fesc_bold(stderr);
         fputs(opts.infile, stderr);
@@ -424,12 +430,14 @@ static void print_var_dim_sizes(SDSInfo *sds)
 static void print_atts_values(SDSInfo *sds)
 {
     SDSAttInfo *atts = sds->gatts;
+    SDSVarInfo *var = NULL;
     if (opts.name) { // narrow to a var
-        atts = var_or_die(sds, opts.name)->atts;
+        var = var_or_die(sds, opts.name);
+        atts = var->atts;
     }
 
     if (opts.att) { // narrow to an attribute
-        SDSAttInfo *att = sds_att_by_name(atts, opts.att);
+        SDSAttInfo *att = sds_find_att(sds, var, opts.att);
         if (!att) {
             fesc_bold(stderr);
             fputs(opts.infile, stderr);
@@ -552,7 +560,6 @@ static void parse_c_range(char *s)
         } else {
             parse_error(s, "expected ']'");
         }
-        fprintf(stderr, "got c range [%i:%i]\n", opts.ranges[opts.n_ranges-1][0], opts.ranges[opts.n_ranges-1][1]);
 
         if (*s == '\0') { // end of string
             return;
@@ -572,7 +579,6 @@ static void parse_fortran_range(char *s)
 {
     for (opts.n_ranges = 0; opts.n_ranges < MAX_DIMS;) {
         s = parse_one_range(s);
-        fprintf(stderr, "got fortran range (%i:%i)\n", opts.ranges[opts.n_ranges-1][0], opts.ranges[opts.n_ranges-1][1]);
         if (*s == ',') {
             s = skip_ws(s + 1);
             // and continue looping to next dim
@@ -648,18 +654,20 @@ static void validate_ranges(SDSVarInfo *var)
     if (var->ndims != opts.n_ranges) {
         fprintf(stderr, "Variable %s has %i dimensions, but got %i in the range\n",
                 var->name, var->ndims, opts.n_ranges);
-        invalid = -1;
+        exit(-1);
     }
 
+    // range ends are inclusive; -1 means "from the start" or "to the end"
     for (int i = 0; i < var->ndims; i++) {
-        if (opts.ranges[i][0] > var->dims[i]->size) {
-            fprintf(stderr, "Variable %s dimension %i range starts too high (%i > %u)\n",
-                    var->name, i+1, opts.ranges[i][0], (unsigned)var->dims[i]->size);
+        int size = (int)var->dims[i]->size;
+        if (opts.ranges[i][0] >= size) {
+            fprintf(stderr, "Variable %s dimension %i range starts too high (%i >= %i)\n",
+                    var->name, i+1, opts.ranges[i][0], size);
             invalid = -1;
         }
-        if (opts.ranges[i][1] > var->dims[i]->size) {
-            fprintf(stderr, "Variable %s dimension %i range ends past actual end (%i > %u)\n",
-                    var->name, i+1, opts.ranges[i][1], (unsigned)var->dims[i]->size);
+        if (opts.ranges[i][1] >= size) {
+            fprintf(stderr, "Variable %s dimension %i range ends past actual end (%i >= %i)\n",
+                    var->name, i+1, opts.ranges[i][1], size);
             invalid = -1;
         }
     }
@@ -668,52 +676,160 @@ static void validate_ranges(SDSVarInfo *var)
         exit(-1);
 }
 
+// upper bound on the bytes read per sds_readv() call when printing values
+#define MAX_READ_BYTES (64 * 1024 * 1024)
+
 static void print_var_values(SDSInfo *sds)
 {
     parse_var_range();
     SDSVarInfo *var = var_or_die(sds, opts.name);
 
+    if (var->ndims > MAX_DIMS) {
+        fprintf(stderr, "too many dims! (%i %s)\n", var->ndims, var->name);
+        abort();
+    }
+
     if (opts.n_ranges > 0) {
         validate_ranges(var);
     } else {
-        if (var->ndims > MAX_DIMS) {
-            fprintf(stderr, "too many dims! (%i %s)\n", var->ndims, var->name);
-            abort();
-        }
         // fill out ranges so they match the full variable
-        for (size_t u = 0; u < var->ndims; u++) {
-            opts.ranges[u][0] = 0;
-            opts.ranges[u][1] = (int)var->dims[u]->size;
+        for (int i = 0; i < var->ndims; i++) {
+            opts.ranges[i][0] = 0;
+            opts.ranges[i][1] = (int)var->dims[i]->size - 1;
         }
     }
 
-    // XXX use opts.ranges to subset var (or not)
-
-    size_t count_per_tstep = 1;
-    for (int i = 1; i < var->ndims; i++)
-        count_per_tstep *= var->dims[i]->size;
+    // translate the ranges into a start/count/stride hyperslab
+    int start[MAX_DIMS], count[MAX_DIMS], stride[MAX_DIMS];
+    size_t n_values = 1;
+    for (int i = 0; i < var->ndims; i++) {
+        int end = opts.ranges[i][1];
+        start[i] = (opts.ranges[i][0] < 0) ? 0 : opts.ranges[i][0];
+        if (end < 0)
+            end = (int)var->dims[i]->size - 1;
+        stride[i] = opts.every;
+        // an empty dimension (end -1) has nothing to read whatever the stride
+        count[i] = (end < start[i]) ? 0 : (end - start[i]) / stride[i] + 1;
+        n_values *= (size_t)count[i];
+    }
 
-    void *buf = NULL;
-    if (var->ndims > 1) {
-        for (int tstep = 0; tstep < var->dims[0]->size; tstep++) {
-            void *values = sds_timestep(var, &buf, tstep);
-            print_some_values(var->type, values, count_per_tstep);
-            fputs(opts.separator, stdout);
-        }
-    } else {
-        void *values = sds_read(var, &buf);
-        if (var->ndims == 0) {
-            print_value(var->type, values, 0);
-        } else {
-            print_some_values(var->type, values, var->dims[0]->size);
+    // values are printed in storage order unless asked for in Fortran
+    // order, with the dimensions reversed
+    int ndims = var->ndims;
+    int fortran = (opts.fortran_order && ndims > 1);
+    int perm[MAX_DIMS];
+    for (int i = 0; i < ndims; i++)
+        perm[i] = ndims - 1 - i;
+
+    size_t elsize = sds_type_size(var->type);
+    if (ndims == 0) {
+        void *values = NEWA(char, elsize);
+        sds_readv_into(var, NULL, NULL, values, NULL);
+        print_value(var->type, values, 0);
+        free(values);
+    } else if (n_values > 0) {
+        // read the slab in pieces along its slowest dimension in the output
+        // order, so that huge slices don't have to fit in memory all at once
+        int p = fortran ? ndims - 1 : 0;
+        size_t row_values = n_values / (size_t)count[p];
+        size_t row_bytes = row_values * elsize;
+        int rows = (int)(MAX_READ_BYTES / (row_bytes ? row_bytes : 1));
+        if (rows < 1)
+            rows = 1;
+        if (rows > count[p])
+            rows = count[p];
+        // decimated and permuted values come back in the library's buffer;
+        // decimated ones are then permuted into one of our own
+        void *values = NULL, *own = NULL, *buf = NULL;
+        if (opts.every == 1 ? !fortran : fortran)
+            own = NEWA(char, (size_t)rows * row_bytes);
+
+        int first = start[p], nrows = count[p];
+        for (int row = 0; row < nrows; row += rows) {
+            start[p] = first + row * stride[p];
+            count[p] = (row + rows > nrows) ? nrows - row : rows;
+            if (opts.every == 1 && !fortran) {
+                values = sds_readv_into(var, start, count, own, NULL);
+            } else if (opts.every == 1) {
+                values = sds_readv_perm(var, &buf, start, count, perm);
+            } else {
+                values = sds_readvs(var, &buf, start, count, stride);
+                if (fortran) {
+                    size_t cnt[MAX_DIMS];
+                    for (int i = 0; i < ndims; i++)
+                        cnt[i] = (size_t)count[i];
+                    sds_transpose(own, values, ndims, cnt, perm, elsize);
+                    values = own;
+                }
+            }
+            print_some_values(var->type, values, row_values * count[p]);
+            if (row + count[p] < nrows)
+                fputs(opts.separator, stdout);
         }
+        if (buf)
+            sds_buffer_free(buf);
+        free(own);
     }
-    sds_buffer_free(buf);
 
     if (!opts.single_column)
         puts("");
 }
 
+static void print_stat(const char *label, double value, int integer)
+{
+    fputs(label, stdout);
+    putc('=', stdout);
+    esc_color(VALUE_COLOR);
+    if (integer)
+        printf("%.0f", value);
+    else
+        printf("%g", value);
+    esc_stop();
+}
+
+/* Prints the count of values, the number of fill and NaN values left out
+ * of it, and the minimum, maximum, mean and standard deviation of the
+ * rest, as stored in the file (not unpacked).  The variable is streamed
+ * through sds_reduce() a tile at a time, never read in all at once.
+ */
+static void print_var_stats(SDSVarInfo *var)
+{
+    esc_color(VARNAME_COLOR);
+    fputs(var->name, stdout);
+    esc_stop();
+    fputs(opts.separator, stdout);
+    if (var->type == SDS_STRING) {
+        fputs("(string)", stdout);
+    } else {
+        SDSReduction *r = sds_reduce(var, NULL, 0, 0, 0);
+        print_stat("count", (double)r->count[0], 1);
+        fputs(opts.separator, stdout);
+        print_stat("fill", (double)r->nfill, 1);
+        fputs(opts.separator, stdout);
+        print_stat("nan", (double)r->nnan, 1);
+        fputs(opts.separator, stdout);
+        print_stat("min", r->min[0], 0);
+        fputs(opts.separator, stdout);
+        print_stat("max", r->max[0], 0);
+        fputs(opts.separator, stdout);
+        print_stat("mean", r->mean[0], 0);
+        fputs(opts.separator, stdout);
+        print_stat("stddev", sqrt(r->variance[0]), 0);
+        sds_reduction_free(r);
+    }
+    puts("");
+}
+
+static void print_stats(SDSInfo *sds)
+{
+    if (opts.name) {
+        print_var_stats(var_or_die(sds, opts.name));
+    } else {
+        for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next)
+            print_var_stats(var);
+    }
+}
+
 static const char *USAGE =
     "Usage: %s [OPTION]... INFILE\n"
     "Dumps part or all of INFILE, producing a colorful summary of its contents\n"
@@ -728,8 +844,12 @@ static const char *USAGE =
     "  -c             print variable dimensions in C order and format\n"
     "  -d [VAR]       print dimension sizes for the whole file or the specified\n"
     "                 variable, if given\n"
+    "  -e N           with -v, print only every Nth value along each dimension,\n"
+    "                 starting from the first in the range\n"
     "  -f             print variable dimensions in Fortran order and format\n"
     "                 (default)\n"
+    "  -F             with -v, print values in Fortran order, the first\n"
+    "                 dimension varying fastest, instead of as stored\n"
     "  -g             never color the output\n"
     "  -G             always color the output\n"
     "  -h             print this help and exit\n"
@@ -738,6 +858,9 @@ static const char *USAGE =
     "  -ld [VAR]      list the dimensions in the file or for the specified\n"
     "                 variable if given\n"
     "  -lv            list the variables in the file\n"
+    "  -s [VAR]       print the count, fill and NaN counts, min, max, mean and\n"
+    "                 standard deviation of the values of each variable, or just\n"
+    "                 the specified one\n"
     "  -v VAR         print the specified variable's values\n"
     "  -v VAR[RANGE]\n"
     "  -v VAR(RANGE)  print a subset of the specified variable's values\n"
@@ -807,8 +930,14 @@ static void parse_arg(int argc, char **argv, int *ip)
     } else if (!strcmp(opt, "d")) { // list dim sizes (for var)
         opts.out_type = LIST_DIM_SIZES;
         opts.name = get_optional_arg(argc, argv, ip);
+    } else if (!strcmp(opt, "e")) { // decimate printed values
+        if (*ip + 1 >= argc || (opts.every = atoi(argv[*ip + 1])) < 1)
+            usage(argv[0], "-e needs a positive number");
+        (*ip)++;
     } else if (!strcmp(opt, "f")) { // Fortran-style var dimensions
         opts.dim_style = FORTRAN_DIM_STYLE;
+    } else if (!strcmp(opt, "F")) { // Fortran-order var values
+        opts.fortran_order = 1;
     } else if (!strcmp(opt, "g")) { // force color off
         opts.color = 0;
     } else if (!strcmp(opt, "G")) { // force color on
@@ -824,6 +953,9 @@ static void parse_arg(int argc, char **argv, int *ip)
         opts.name = get_optional_arg(argc, argv, ip);
     } else if (!strcmp(opt, "lv")) { // list vars
         opts.out_type = LIST_VARS;
+    } else if (!strcmp(opt, "s")) { // print value statistics (for var)
+        opts.out_type = PRINT_STATS;
+        opts.name = get_optional_arg(argc, argv, ip);
     } else if (!strcmp(opt, "v")) { // print var's values
         opts.out_type = PRINT_VAR;
         opts.name = get_optional_arg(argc, argv, ip);
@@ -859,7 +991,7 @@ int main(int argc, char **argv)
 {
     parse_args(argc, argv);
 
-    SDSInfo *sds = sds_open(opts.infile);
+    SDSInfo *sds = sds_open_lazy(opts.infile);
     if (!sds) {
         fesc_bold(stderr);
         fputs(opts.infile, stderr);
@@ -893,6 +1025,9 @@ int main(int argc, char **argv)
     case PRINT_VAR:
         print_var_values(sds);
         break;
+    case PRINT_STATS:
+        print_stats(sds);
+        break;
     default:
         abort();
     }
@@ -42,11 +42,107 @@ char *sds_strdup(const char *s)
     return t;
 }
 
-static SDSList *list_r(SDSList *prev, SDSList *l)
+/* Arenas hand out memory carved from a few large blocks, all of which are
+ * released at once by sds_arena_free().  An SDSInfo opened from a file
+ * allocates all of its metadata this way.
+ */
+#define ARENA_MIN_BLOCK (64 * 1024)
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, size;
+    // data follows, ARENA_ALIGN-aligned
+} ArenaBlock;
+
+#define BLOCK_HEADER \
+    ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct SDSArena {
+    ArenaBlock *blocks; // current block first
+    size_t next_size;   // size of the next block to allocate
+};
+
+SDSArena *sds_arena_create(void)
+{
+    SDSArena *arena = NEW(SDSArena);
+    arena->blocks = NULL;
+    arena->next_size = ARENA_MIN_BLOCK;
+    return arena;
+}
+
+static ArenaBlock *arena_new_block(size_t size)
 {
-    SDSList *next = l->next;
-    l->next = prev;
-    return next ? list_r(l, next) : l;
+    ArenaBlock *block = sds_alloc(BLOCK_HEADER + size);
+    block->used = 0;
+    block->size = size;
+    return block;
+}
+
+/* Allocates from the arena, or with sds_alloc() if the arena is NULL.
+ */
+void *sds_arena_alloc(SDSArena *arena, size_t bytes)
+{
+    if (!arena)
+        return sds_alloc(bytes);
+
+    bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->size - block->used < bytes) {
+        if (bytes > arena->next_size / 4) {
+            // big allocations get their own block behind the current one
+            // so the current block's free space isn't wasted
+            block = arena_new_block(bytes);
+            if (arena->blocks) {
+                block->next = arena->blocks->next;
+                arena->blocks->next = block;
+            } else {
+                block->next = NULL;
+                arena->blocks = block;
+            }
+            block->used = bytes;
+            return (char *)block + BLOCK_HEADER;
+        }
+        block = arena_new_block(arena->next_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        if (arena->next_size < ARENA_MAX_BLOCK)
+            arena->next_size *= 2;
+    }
+
+    void *p = (char *)block + BLOCK_HEADER + block->used;
+    block->used += bytes;
+    return p;
+}
+
+void *sds_arena_alloc0(SDSArena *arena, size_t bytes)
+{
+    void *p = sds_arena_alloc(arena, bytes);
+    memset(p, 0, bytes);
+    return p;
+}
+
+char *sds_arena_strdup(SDSArena *arena, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *t = sds_arena_alloc(arena, n);
+    memcpy(t, s, n);
+    return t;
+}
+
+void sds_arena_free(SDSArena *arena)
+{
+    if (!arena)
+        return;
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
 }
 
 size_t sds_list_count(SDSList *l)
@@ -61,8 +157,14 @@ size_t sds_list_count(SDSList *l)
 
 SDSList *sds_list_reverse(SDSList *l)
 {
-    if (!l) return NULL;
-    return list_r(NULL, l);
+    SDSList *prev = NULL;
+    while (l) {
+        SDSList *next = l->next;
+        l->next = prev;
+        prev = l;
+        l = next;
+    }
+    return prev;
 }
 
 SDSList *sds_list_find(SDSList *l, char *key)
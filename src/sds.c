@@ -1,8 +1,32 @@
 #include "sds.h"
+#include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
+// private index functions from sds_index.c
+SDSIndex *sds_index_create(SDSAttInfo *gatts, SDSDimInfo *dims,
+                           SDSVarInfo *vars);
+void sds_index_free(SDSIndex *idx);
+size_t sds_index_heap_members(SDSInfo *sds);
+SDSDimInfo *sds_index_dim(SDSIndex *idx, const char *name);
+
+// private block cache functions from sds_cache.c
+int sds_cache_enabled(void);
+int sds_cache_can_read(SDSVarInfo *var, const int *start, const int *count);
+void *sds_cache_readv(SDSVarInfo *var, void *dst, const int *start,
+                      const int *count, void **rawp);
+
+// private conversion from the classic NetCDF mapping in sds_cdf.c
+void *sds_cdf_readv(SDSVarInfo *var, void *dst, const int *start,
+                    const int *count, SDSType want, const SDSPacking *pack);
+
+// private strided and permuted copies from sds_transpose.c
+void sds_scatter(void *dst, const ptrdiff_t *strides, const void *src,
+                 int ndims, const size_t *cnt, size_t elsize);
+void sds_perm_strides(ptrdiff_t *strides, int ndims, const size_t *count,
+                      const int *perm);
+
 const char *sds_file_types[] = {
     "unknown", "NetCDF3", "NetCDF4", "HDF4", "HDF5"
 };
@@ -13,22 +37,119 @@ const char *sds_type_names[] = {
     "float", "double", "string"
 };
 
+static SDSInfo *new_sds(SDSArena *arena, SDSAttInfo *gatts, SDSDimInfo *dims,
+                        SDSVarInfo *vars);
+static SDSAttInfo *new_att(SDSArena *arena, SDSAttInfo *next, const char *name,
+                           SDSType type, size_t count, const void *data);
+static SDSDimInfo *new_dim(SDSArena *arena, SDSDimInfo *next, const char *name,
+                           size_t size, int isunlim);
+static SDSVarInfo *new_var(SDSArena *arena, SDSVarInfo *next, const char *name,
+                           SDSType type, int iscoord, SDSAttInfo *atts,
+                           int ndims, const SDSDimInfo **dims);
+
+/* Metadata members are either carved out of their SDSInfo's arena, or
+ * malloc()ed one at a time by sds_create_*() and the *_generic_copy()
+ * functions, which set their private heap flag; the sds_free_*() functions
+ * free() only those.  Each file's name index counts the malloc()ed members
+ * in its lists, so sds_close() needn't walk an opened file's lists at all
+ * unless some were added to it.
+ */
+
+/* Marks the name index of the file a member belongs to out of date, when
+ * the member's about to be freed or a new one is put in front of it.
+ */
+#define DROP_INDEX(member) \
+    do { \
+        if ((member)->owner) \
+            SDS_STORE_INT(&(member)->owner->index_stale, 1); \
+    } while (0)
+
+/* The list copies below are built front to back with a tail pointer rather
+ * than recursively, so that lists with huge numbers of members (HDF-EOS
+ * files can have tens of thousands of attributes) don't exhaust the stack.
+ */
+
+static SDSAttInfo *atts_copy(SDSArena *arena, SDSAttInfo *att)
+{
+    SDSAttInfo *head = NULL, **tail = &head;
+    for (; att != NULL; att = att->next) {
+        *tail = new_att(arena, NULL, att->name, att->type, att->count,
+                        sds_att_data(att));
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static SDSDimInfo *dims_copy(SDSArena *arena, SDSDimInfo *dim)
+{
+    SDSDimInfo *head = NULL, **tail = &head;
+    for (; dim != NULL; dim = dim->next) {
+        *tail = new_dim(arena, NULL, dim->name, dim->size, dim->isunlim);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static SDSVarInfo *vars_copy(SDSArena *arena, SDSVarInfo *var,
+                             SDSDimInfo *newdims)
+{
+    SDSIndex *dim_index = sds_index_create(NULL, newdims, NULL);
+    SDSVarInfo *head = NULL, **tail = &head;
+    const SDSDimInfo **dims = NULL;
+    int dims_cap = 0;
+
+    for (; var != NULL; var = var->next) {
+        // match up var->dims to those in the new dimension list, re-using
+        // one scratch array for all variables
+        if (var->ndims > dims_cap) {
+            dims_cap = var->ndims;
+            dims = sds_realloc(dims, sizeof(SDSDimInfo *) * dims_cap);
+        }
+        for (int i = 0; i < var->ndims; i++) {
+            dims[i] = sds_index_dim(dim_index, var->dims[i]->name);
+            if (!dims[i]) {
+                fprintf(stderr, "could not find new dimension named '%s' when copying var '%s'\n",
+                        var->dims[i]->name, var->name);
+                abort();
+            }
+        }
+        SDSAttInfo *atts = atts_copy(arena, var->atts);
+        *tail = new_var(arena, NULL, var->name, var->type, var->iscoord,
+                        atts, var->ndims, dims);
+        tail = &(*tail)->next;
+    }
+
+    free(dims);
+    sds_index_free(dim_index);
+    return head;
+}
+
 /* Copies an SDSInfo struct, its attributes, dimensions and variables. The copy
  * is deep and typeless (i.e. not tied to  NetCDF, HDF, etc.), so a new SDS
  * file of any type can be created from it.
  *
+ * All of the copy's metadata is allocated from one arena owned by the new
+ * SDSInfo, like that of an opened file, rather than malloc()ed member by
+ * member.  So members of the copy belong to it for good: the sds_free_*(),
+ * sds_keep_*() and sds_delete_*() functions unlink them but leave their
+ * memory to sds_close(), and they mustn't be moved to another SDSInfo or
+ * used after the copy is closed (copy them with the *_generic_copy()
+ * functions instead).  Members you add with sds_create_*() are still
+ * freed one by one as before; sds_close() notices those put in front of a
+ * list or given to a variable as its attributes, but after linking them
+ * in anywhere else (at the tail of a list, say), call sds_reindex() so it
+ * knows to free them.
+ *
  * The returned data structure still needs to be freed with sds_close() even
  * if you don't write it to a file.
  */
 SDSInfo *sds_generic_copy(SDSInfo *sds)
 {
-    SDSAttInfo *gatts = (sds->gatts == NULL) ? NULL :
-        sds_atts_generic_copy(sds->gatts);
-    SDSDimInfo *dims = (sds->dims == NULL) ? NULL :
-        sds_dims_generic_copy(sds->dims);
-    SDSVarInfo *vars = (sds->vars == NULL) ? NULL :
-        sds_vars_generic_copy(sds->vars, dims);
-    return create_sds(gatts, dims, vars);
+    SDSArena *arena = sds_arena_create();
+    SDSAttInfo *gatts = atts_copy(arena, sds->gatts);
+    SDSDimInfo *dims = dims_copy(arena, sds->dims);
+    SDSVarInfo *vars = vars_copy(arena, sds->vars, dims);
+    return new_sds(arena, gatts, dims, vars);
 }
 
 /* Copies a list of attributes, usually useful for converting from one
@@ -36,8 +157,7 @@ SDSInfo *sds_generic_copy(SDSInfo *sds)
  */
 SDSAttInfo *sds_atts_generic_copy(SDSAttInfo *att)
 {
-    SDSAttInfo *next = (att->next == NULL) ? NULL : sds_atts_generic_copy(att->next);
-    return sds_create_att(next, att->name, att->type, att->count, att->data.v);
+    return atts_copy(NULL, att);
 }
 
 /* Copies a list of dimensions, usually useful for converting from one
@@ -45,8 +165,7 @@ SDSAttInfo *sds_atts_generic_copy(SDSAttInfo *att)
  */
 SDSDimInfo *sds_dims_generic_copy(SDSDimInfo *dim)
 {
-    SDSDimInfo *next = (dim->next == NULL) ? NULL : sds_dims_generic_copy(dim->next);
-    return sds_create_dim(next, dim->name, dim->size, dim->isunlim);
+    return dims_copy(NULL, dim);
 }
 
 /* Copies a list of variables, usually useful for converting from one SDS
@@ -60,31 +179,13 @@ SDSDimInfo *sds_dims_generic_copy(SDSDimInfo *dim)
  */
 SDSVarInfo *sds_vars_generic_copy(SDSVarInfo *var, SDSDimInfo *newdims)
 {
-    SDSVarInfo *next = (var->next == NULL) ? NULL : sds_vars_generic_copy(var->next, newdims);
-    // match up var->dims to those in newdims
-    int n = (var->ndims < 1) ? 1 : var->ndims;
-    const SDSDimInfo **dims = alloca(sizeof(SDSDimInfo *) * n);
-    for (int i = 0; i < n; i++) {
-        dims[i] = sds_dim_by_name(newdims, var->dims[i]->name);
-        if (!dims[i]) {
-            fprintf(stderr, "could not find new dimension named '%s' when copying var '%s'\n",
-                    var->dims[i]->name, var->name);
-            abort();
-        }
-    }
-    SDSAttInfo *atts = (var->atts == NULL) ? NULL : sds_atts_generic_copy(var->atts);
-    return sds_create_var(next, var->name, var->type, var->iscoord,
-                          atts, var->ndims, dims);
+    return vars_copy(NULL, var, newdims);
 }
 
-/* Create a new SDSInfo with the given global attributes, dimensions and
- * variables.  These members should be created for this SDSInfo and not
- * belong to another one since they will be freed in the call to sds_close()
- * (which you should use whether you write to a file or not).
- */
-SDSInfo *create_sds(SDSAttInfo *gatts, SDSDimInfo *dims, SDSVarInfo *vars)
+static SDSInfo *new_sds(SDSArena *arena, SDSAttInfo *gatts, SDSDimInfo *dims,
+                        SDSVarInfo *vars)
 {
-    SDSInfo *sds = NEW(SDSInfo);
+    SDSInfo *sds = ANEW(arena, SDSInfo);
     sds->path = NULL;
     sds->type = SDS_UNKNOWN_FILE;
     sds->gatts = gatts;
@@ -111,9 +212,46 @@ SDSInfo *create_sds(SDSAttInfo *gatts, SDSDimInfo *dims, SDSVarInfo *vars)
 
     sds->id = -1;
     sds->funcs = NULL;
+    sds->arena = arena;
+    sds->cdf = NULL;
+    sds->backend = NULL;
+    sds->max_open = 0;
+    sds->nprefetch = 0;
+    sds->own_lock = 0;
+    sds->index = NULL;
+    sds_reindex(sds);
     return sds;
 }
 
+/* Create a new SDSInfo with the given global attributes, dimensions and
+ * variables.  These members should be created for this SDSInfo and not
+ * belong to another one since they will be freed in the call to sds_close()
+ * (which you should use whether you write to a file or not).
+ */
+SDSInfo *create_sds(SDSAttInfo *gatts, SDSDimInfo *dims, SDSVarInfo *vars)
+{
+    return new_sds(NULL, gatts, dims, vars);
+}
+
+static SDSAttInfo *new_att(SDSArena *arena, SDSAttInfo *next, const char *name,
+                           SDSType type, size_t count, const void *data)
+{
+    SDSAttInfo *att = ANEW(arena, SDSAttInfo);
+    att->next = next;
+    att->name = sds_arena_strdup(arena, name);
+    att->type = type;
+    att->count = count;
+    att->bytes = sds_type_size(type);
+    att->data.v = sds_arena_alloc(arena, att->bytes * count);
+    memcpy(att->data.v, data, att->bytes * count);
+    att->sds = NULL;
+    att->owner = NULL;
+    att->heap = (arena == NULL);
+    if (next)
+        DROP_INDEX(next);
+    return att;
+}
+
 /* Creates a new SDSAttInfo with the given values.  These values are copied
  * (where applicable), so you are responsible for freeing any dynamically-
  * allocated memory passed in.  In turn, the returned struct should be freed
@@ -125,15 +263,7 @@ SDSInfo *create_sds(SDSAttInfo *gatts, SDSDimInfo *dims, SDSVarInfo *vars)
 SDSAttInfo *sds_create_att(SDSAttInfo *next, const char *name, SDSType type,
                            size_t count, const void *data)
 {
-    SDSAttInfo *att = NEW(SDSAttInfo);
-    att->next = next;
-    att->name = sds_strdup(name);
-    att->type = type;
-    att->count = count;
-    att->bytes = sds_type_size(type);
-    att->data.v = malloc(att->bytes * count);
-    memcpy(att->data.v, data, att->bytes * count);
-    return att;
+    return new_att(NULL, next, name, type, count, data);
 }
 
 /* Creates a new string attribute.  This helper function makes it easier to
@@ -146,6 +276,22 @@ SDSAttInfo *sds_create_stratt(SDSAttInfo *next, const char *name,
     return sds_create_att(next, name, SDS_STRING, strlen(str) + 1, str);
 }
 
+static SDSDimInfo *new_dim(SDSArena *arena, SDSDimInfo *next, const char *name,
+                           size_t size, int isunlim)
+{
+    SDSDimInfo *dim = ANEW(arena, SDSDimInfo);
+    dim->next = next;
+    dim->name = sds_arena_strdup(arena, name);
+    dim->size = size;
+    dim->isunlim = isunlim;
+    dim->id = -1;
+    dim->owner = NULL;
+    dim->heap = (arena == NULL);
+    if (next)
+        DROP_INDEX(next);
+    return dim;
+}
+
 /* Creates a new SDSDimInfo.  The name argument is copied, so you are
  * responsible for freeing its memory (if applicable).
  *
@@ -155,13 +301,7 @@ SDSAttInfo *sds_create_stratt(SDSAttInfo *next, const char *name,
 SDSDimInfo *sds_create_dim(SDSDimInfo *next, const char *name, size_t size,
                            int isunlim)
 {
-    SDSDimInfo *dim = NEW(SDSDimInfo);
-    dim->next = next;
-    dim->name = sds_strdup(name);
-    dim->size = size;
-    dim->isunlim = isunlim;
-    dim->id = -1;
-    return dim;
+    return new_dim(NULL, next, name, size, isunlim);
 }
 
 /* Creates a new SDSVarInfo like sds_create_var(), but takes the dimensions
@@ -184,6 +324,34 @@ SDSVarInfo *sds_create_varv(SDSVarInfo *next, const char *name, SDSType type,
                           ndims, dims);
 }
 
+static SDSVarInfo *new_var(SDSArena *arena, SDSVarInfo *next, const char *name,
+                           SDSType type, int iscoord, SDSAttInfo *atts,
+                           int ndims, const SDSDimInfo **dims)
+{
+    SDSVarInfo *var = ANEW(arena, SDSVarInfo);
+    var->next = next;
+    var->name = sds_arena_strdup(arena, name);
+    var->type = type;
+    var->compress = 0;
+    var->iscoord = iscoord;
+    var->ndims = ndims;
+    var->dims = NULL;
+    if (ndims > 0) {
+        var->dims = ANEWA(arena, SDSDimInfo *, ndims);
+        memcpy(var->dims, dims, sizeof(SDSDimInfo *) * ndims);
+    }
+    var->atts = atts;
+    var->id = -1;
+    var->sds = NULL;
+    var->packing = NULL;
+    var->prefetch = NULL;
+    var->owner = NULL;
+    var->heap = (arena == NULL);
+    if (next)
+        DROP_INDEX(next);
+    return var;
+}
+
 /* Creates a new SDSVarInfo with the given arguments.  The name is copied,
  * so you do not give ownership of that argument.  The atts ownership is
  * taken by the new SDSVarInfo though, so they need to be separately
@@ -200,17 +368,7 @@ SDSVarInfo *sds_create_var(SDSVarInfo *next, const char *name, SDSType type,
                            int iscoord, SDSAttInfo *atts,
                            int ndims, const SDSDimInfo **dims)
 {
-    SDSVarInfo *var = NEW(SDSVarInfo);
-    var->next = next;
-    var->name = sds_strdup(name);
-    var->type = type;
-    var->iscoord = iscoord;
-    var->ndims = ndims;
-    var->dims = malloc(sizeof(SDSDimInfo *) * ndims);
-    memcpy(var->dims, dims, sizeof(SDSDimInfo *) * ndims);
-    var->atts = atts;
-    var->id = -1;
-    return var;
+    return new_var(NULL, next, name, type, iscoord, atts, ndims, dims);
 }
 
 static int sds_magic(const char *path)
@@ -260,11 +418,58 @@ SDSFileType sds_file_type(const char *path)
     return SDS_UNKNOWN_FILE;
 }
 
-SDSInfo *sds_nc_open(const char *path);
-SDSInfo *sds_h4_open(const char *path);
+SDSInfo *sds_nc_open(const char *path, int lazy);
+SDSInfo *sds_h4_open(const char *path, int lazy);
+SDSInfo *sds_h5_open(const char *path);
+int sds_nc_attach(SDSInfo *sds);
+int sds_h4_attach(SDSInfo *sds);
+int sds_h5_attach(SDSInfo *sds);
 
-SDSInfo *sds_open(const char *path)
+// metadata sidecars from sds_meta.c
+SDSInfo *sds_meta_load(const char *path);
+void sds_meta_save(SDSInfo *sds);
+
+/* Opens the file behind metadata rebuilt from a sidecar with the right
+ * backend.  Returns -1 if this build can't read files of its type.
+ */
+static int attach_file(SDSInfo *sds)
+{
+    switch (sds->type) {
+    case SDS_NC4_FILE:
+#ifndef HAVE_NETCDF4
+        break;
+#endif
+        // fall through from NC4 -> NC3
+    case SDS_NC3_FILE:
+        return sds_nc_attach(sds);
+#ifdef HAVE_HDF4
+    case SDS_HDF4_FILE:
+        return sds_h4_attach(sds);
+#endif
+#ifdef HAVE_HDF5
+    case SDS_HDF5_FILE:
+        return sds_h5_attach(sds);
+#endif
+    default:
+        break;
+    }
+    return -1;
+}
+
+/* Opens a file with the I/O lock held, from its metadata sidecar if the
+ * cache has a current one (setting *cached) or else through its backend.
+ */
+static SDSInfo *open_locked(const char *path, int lazy, int *cached)
 {
+    SDSInfo *sds = sds_meta_load(path);
+    *cached = (sds != NULL);
+    if (sds) {
+        if (attach_file(sds) == 0)
+            return sds;
+        sds_arena_free(sds->arena);
+        *cached = 0;
+    }
+
     switch (sds_file_type(path)) {
 
     case SDS_NC4_FILE:
@@ -275,23 +480,125 @@ SDSInfo *sds_open(const char *path)
 #endif
         // fall through from NC4 -> NC3
     case SDS_NC3_FILE:
-        return sds_nc_open(path);
+        return sds_nc_open(path, lazy);
 
     case SDS_HDF4_FILE:
 #ifdef HAVE_HDF4
-        return sds_h4_open(path);
+        return sds_h4_open(path, lazy);
 #else
         fprintf(stderr, "not compiled with HDF4 support (%s)\n",
                 path);
         return NULL;
 #endif
 
+    case SDS_HDF5_FILE:
+#ifdef HAVE_HDF5
+        return sds_h5_open(path);
+#else
+        fprintf(stderr, "not compiled with HDF5 support (%s)\n",
+                path);
+        return NULL;
+#endif
+
     default:
         break;
     }
     return NULL;
 }
 
+static SDSInfo *open_file(const char *path, int lazy)
+{
+    int cached;
+    sds_io_lock();
+    SDSInfo *sds = open_locked(path, lazy, &cached);
+    sds_io_unlock();
+
+    if (sds) {
+        sds_reindex(sds);
+        if (!cached)
+            sds_meta_save(sds);
+    }
+    return sds;
+}
+
+/* Opens a file fully like sds_open() for a caller already holding the I/O
+ * lock, such as a backend opening files of its own.  Close it with
+ * sds_close_locked().
+ */
+SDSInfo *sds_open_locked(const char *path)
+{
+    int cached;
+    SDSInfo *sds = open_locked(path, 0, &cached);
+    if (sds) {
+        // the caller reads it with the I/O lock already held
+        sds->own_lock = 0;
+        sds_reindex(sds);
+        if (!cached)
+            sds_meta_save(sds); // everything's read, so this won't lock
+    }
+    return sds;
+}
+
+/* Opens an existing SDS file, reading all of its metadata.  If the metadata
+ * cache is on (see sds_set_meta_cache()) and holds the file's metadata,
+ * that's used instead of asking the format library for it.
+ */
+SDSInfo *sds_open(const char *path)
+{
+    return open_file(path, 0);
+}
+
+/* Opens an existing SDS file like sds_open(), but only reads the names,
+ * types and shapes of its attributes, dimensions and variables up front.
+ * Attribute values and compression levels are read when first asked for
+ * through sds_att_data() and sds_var_compress(), so opening files with huge
+ * metadata blocks is quick when only a little of it is used.  Until then
+ * att->data.v is NULL and var->compress is -1.  HDF5 files are always read
+ * in full, and so are files the metadata cache holds or is about to save.
+ */
+SDSInfo *sds_open_lazy(const char *path)
+{
+    return open_file(path, 1);
+}
+
+/* Returns the attribute's values (att->data), reading them from the file
+ * first if it was opened with sds_open_lazy().
+ */
+void *sds_att_data(SDSAttInfo *att)
+{
+    void *data = SDS_LOAD_PTR(&att->data.v);
+    if (data || !att->sds)
+        return data;
+
+    sds_io_lock();
+    data = att->data.v; // another thread may have read it meanwhile
+    if (!data) {
+        data = (att->sds->funcs->load_att)(att->sds, att);
+        SDS_STORE_PTR(&att->data.v, data);
+    }
+    sds_io_unlock();
+    return data;
+}
+
+/* Returns the variable's compression level (var->compress), reading it from
+ * the file first if it was opened with sds_open_lazy().
+ */
+int sds_var_compress(SDSVarInfo *var)
+{
+    int level = SDS_LOAD_INT(&var->compress);
+    if (level >= 0 || !var->sds || !var->sds->funcs->load_compress)
+        return (level < 0) ? 0 : level;
+
+    sds_io_lock();
+    level = var->compress;
+    if (level < 0) {
+        level = (var->sds->funcs->load_compress)(var);
+        SDS_STORE_INT(&var->compress, level);
+    }
+    sds_io_unlock();
+    return level;
+}
+
 size_t sds_type_size(SDSType t)
 {
     switch (t) {
@@ -303,6 +610,8 @@ size_t sds_type_size(SDSType t)
     case SDS_I32:
     case SDS_U32:
     case SDS_FLOAT:  return 4;
+    case SDS_I64:
+    case SDS_U64:
     case SDS_DOUBLE: return 8;
     case SDS_STRING: return 1;
     default: break;
@@ -493,12 +802,25 @@ size_t sds_var_count(SDSVarInfo *var)
  */
 void *sds_read_var_by_name(SDSInfo *sds, const char *name, void **bufp)
 {
-    SDSVarInfo *var = sds_var_by_name(sds->vars, name);
+    SDSVarInfo *var = sds_find_var(sds, name);
     if (!var)
         return NULL;
     return sds_read(var, bufp);
 }
 
+/* Calls the backend's var_readv while holding the file's lock (see
+ * sds_file_lock()), since the format libraries aren't thread safe and
+ * reads may happen on background threads (see sds_prefetch_start()).
+ */
+void *sds_backend_readv(SDSVarInfo *var, void **bufp,
+                        const int *start, const int *count)
+{
+    sds_file_lock(var->sds);
+    void *data = (var->sds->funcs->var_readv)(var, bufp, start, count);
+    sds_file_unlock(var->sds);
+    return data;
+}
+
 /* Reads all of the given variable.
  * bufp: an opaque pointer to a buffer structure used to manage memory to be
  *       read into and other housekeeping.  In your code, create a void pointer
@@ -508,7 +830,7 @@ void *sds_read_var_by_name(SDSInfo *sds, const char *name, void **bufp)
  */
 void *sds_read(SDSVarInfo *var, void **bufp)
 {
-    return (var->sds->funcs->var_readv)(var, bufp, NULL, NULL);
+    return sds_readv(var, bufp, NULL, NULL);
 }
 
 /* Read all of one timestep (i.e. the first dimension) from the given variable.
@@ -518,16 +840,151 @@ void *sds_read(SDSVarInfo *var, void **bufp)
  *       set to NULL, then pass in the address of that variable.  Keep passing
  *       in that same void-pointer-pointer to re-use the buffer.  When you are
  *       done with the buffer, use sds_buffer_free to free it from memory.
+ *
+ * To walk through every timestep of a variable, sds_timestep_iter_create()
+ * reads several timesteps per call and is usually faster.
  */
 void *sds_timestep(SDSVarInfo *var, void **bufp, int tstep)
 {
     int n = (var->ndims < 1) ? 1 : var->ndims;
+    int *start = ALLOCA(int, n);
     int *count = ALLOCA(int, n);
-    count[0] = tstep;
+    if (var->prefetch)
+        return sds_prefetch_get(var->prefetch, tstep);
+
+    start[0] = tstep;
+    count[0] = 1;
     for (int i = 1; i < n; i++) {
+        start[i] = 0;
         count[i] = -1; // read all of this dimension
     }
-    return (var->sds->funcs->var_readv)(var, bufp, NULL, count);
+    return sds_readv(var, bufp, start, count);
+}
+
+/* Creates an iterator over the timesteps (i.e. the first dimension) of the
+ * given variable.  Timesteps are read batch at a time into one re-used
+ * buffer, so walking a whole variable does one backend read per batch
+ * instead of one per timestep.
+ *
+ * batch: the number of timesteps read per backend call; values < 1 mean 1.
+ *
+ * Free the iterator with sds_timestep_iter_free() before closing the file.
+ */
+SDSTimestepIter *sds_timestep_iter_create(SDSVarInfo *var, int batch)
+{
+    if (var->ndims < 1) {
+        fprintf(stderr, "can't iterate over timesteps of scalar variable %s\n",
+                var->name);
+        abort();
+    }
+
+    SDSTimestepIter *it = NEW(SDSTimestepIter);
+    it->var = var;
+    it->tstep = -1;
+    it->ntsteps = (int)var->dims[0]->size;
+    it->batch = (batch < 1) ? 1 : batch;
+    it->tstep_bytes = sds_var_size(var) / (it->ntsteps ? it->ntsteps : 1);
+    it->buf = NULL;
+    it->data = NULL;
+    it->first = 0;
+    it->nheld = 0;
+    return it;
+}
+
+/* Advances the iterator to the next timestep and returns a pointer to its
+ * data, or NULL once all the timesteps have been returned.  The pointer
+ * is valid until the next call to sds_timestep_iter_next() or
+ * sds_timestep_iter_free().  it->tstep holds the returned timestep's index.
+ */
+void *sds_timestep_iter_next(SDSTimestepIter *it)
+{
+    SDSVarInfo *var = it->var;
+
+    if (it->tstep + 1 >= it->ntsteps)
+        return NULL;
+    it->tstep++;
+
+    if (it->tstep >= it->first + it->nheld) { // read the next batch
+        int *start = ALLOCA(int, var->ndims);
+        int *count = ALLOCA(int, var->ndims);
+        start[0] = it->tstep;
+        count[0] = it->batch;
+        if (start[0] + count[0] > it->ntsteps)
+            count[0] = it->ntsteps - start[0];
+        for (int i = 1; i < var->ndims; i++) {
+            start[i] = 0;
+            count[i] = -1;
+        }
+        it->data = sds_backend_readv(var, &it->buf, start, count);
+        it->first = start[0];
+        it->nheld = count[0];
+    }
+
+    return it->data + (size_t)(it->tstep - it->first) * it->tstep_bytes;
+}
+
+void sds_timestep_iter_free(SDSTimestepIter *it)
+{
+    if (it->buf)
+        sds_buffer_free(it->buf);
+    free(it);
+}
+
+/* Buffer for sds_readv_as() and cached sds_readv() calls: the raw data is
+ * read through the backend's own buffer and converted or copied into this
+ * one.
+ */
+typedef struct {
+    void (*free)(void *);
+    void *raw; // backend buffer, or NULL
+    void *data;
+    size_t size;
+} ConvertBuffer;
+
+static void convert_buffer_free(ConvertBuffer *buf)
+{
+    if (buf->raw)
+        sds_buffer_free(buf->raw);
+    sds_pool_put(buf->data, buf->size);
+    free(buf);
+}
+
+// the convert buffer at *bufp, made if it's NULL, without sizing its data
+static ConvertBuffer *get_convert_buffer(void **bufp)
+{
+    ConvertBuffer *buf = (ConvertBuffer *)*bufp;
+    if (buf) {
+        assert(buf->free == (void (*)(void *))convert_buffer_free);
+    } else {
+        buf = NEW(ConvertBuffer);
+        buf->free = (void (*)(void *))convert_buffer_free;
+        buf->raw = NULL;
+        buf->data = NULL;
+        buf->size = 0;
+        *bufp = buf;
+    }
+    return buf;
+}
+
+static ConvertBuffer *prep_convert_buffer(void **bufp, size_t bytes)
+{
+    ConvertBuffer *buf = get_convert_buffer(bufp);
+    sds_pool_ensure(&buf->data, &buf->size, bytes);
+    return buf;
+}
+
+/* Number of elements in the start/count hyperslab of var (see sds_readv()).
+ */
+static size_t hyperslab_count(SDSVarInfo *var, const int *start,
+                              const int *count)
+{
+    size_t n = 1;
+    for (int i = 0; i < var->ndims; i++) {
+        size_t st = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        n *= (!count || count[i] < 0) ? var->dims[i]->size - st :
+            (size_t)count[i];
+    }
+    return n;
 }
 
 /* Read from the given variable, subsetting based on the index array.
@@ -545,7 +1002,471 @@ void *sds_timestep(SDSVarInfo *var, void **bufp, int tstep)
  */
 void *sds_readv(SDSVarInfo *var, void **bufp, const int *start, const int *count)
 {
-    return (var->sds->funcs->var_readv)(var, bufp, start, count);
+    // go through the block cache if it can serve the read, unless bufp
+    // already holds a backend buffer from a read that didn't use it
+    ConvertBuffer *buf = (ConvertBuffer *)*bufp;
+    int convert = buf && buf->free == (void (*)(void *))convert_buffer_free;
+    if ((!buf || convert) && sds_cache_can_read(var, start, count)) {
+        size_t n = hyperslab_count(var, start, count);
+        buf = prep_convert_buffer(bufp, n * sds_type_size(var->type));
+        if (sds_cache_readv(var, buf->data, start, count, &buf->raw))
+            return buf->data;
+    }
+
+    // a buffer a cached read used holds the backend's
+    if (buf && buf->free == (void (*)(void *))convert_buffer_free)
+        bufp = &buf->raw;
+    return sds_backend_readv(var, bufp, start, count);
+}
+
+/* Reads every stride[i]'th element along each dimension of the variable,
+ * such as every 4th grid point for a quick look at a big field, without
+ * reading the ones in between: count[i] elements from start[i] on, the
+ * last at start[i] + (count[i] - 1) * stride[i].  start and count work as
+ * for sds_readv(), except a count of -1 means as many as fit.  A NULL
+ * stride, or strides < 1, mean 1.  The block cache isn't used.
+ */
+void *sds_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                 const int *count, const int *stride)
+{
+    if (var->ndims < 1)
+        return sds_readv(var, bufp, NULL, NULL);
+
+    int ndims = var->ndims;
+    int *st = ALLOCA(int, ndims);
+    int *cnt = ALLOCA(int, ndims);
+    int *str = ALLOCA(int, ndims);
+    for (int i = 0; i < ndims; i++) {
+        int size = (int)var->dims[i]->size;
+        st[i] = (!start || start[i] < 0) ? 0 : start[i];
+        str[i] = (!stride || stride[i] < 1) ? 1 : stride[i];
+        if (count && count[i] >= 0)
+            cnt[i] = count[i];
+        else
+            cnt[i] = (size > st[i]) ? (size - st[i] + str[i] - 1) / str[i] : 0;
+    }
+
+    // a buffer sds_readv() used with the cache on holds the backend's
+    ConvertBuffer *buf = (ConvertBuffer *)*bufp;
+    if (buf && buf->free == (void (*)(void *))convert_buffer_free)
+        bufp = &buf->raw;
+
+    sds_file_lock(var->sds);
+    void *data = (var->sds->funcs->var_readvs)(var, bufp, st, cnt, str);
+    sds_file_unlock(var->sds);
+    return data;
+}
+
+// smallest packed piece of a strided destination worth a backend read of
+// its own; with smaller pieces the slab is read whole and scattered
+#define INTO_PIECE_BYTES (64 * 1024)
+
+/* Calls the backend's var_readv_into while holding the file's lock.  Returns
+ * -1 if the backend can't fill the strided destination.
+ */
+static int backend_readv_into(SDSVarInfo *var, void *dst, const int *start,
+                              const int *count, const ptrdiff_t *strides)
+{
+    struct SDS_Funcs *funcs = var->sds->funcs;
+    if (!funcs->var_readv_into) {
+        if (strides)
+            return -1;
+        void *buf = NULL;
+        void *data = sds_backend_readv(var, &buf, start, count);
+        memcpy(dst, data, hyperslab_count(var, start, count) *
+               sds_type_size(var->type));
+        sds_buffer_free(buf);
+        return 0;
+    }
+
+    sds_file_lock(var->sds);
+    int status = (funcs->var_readv_into)(var, dst, start, count, strides);
+    sds_file_unlock(var->sds);
+    return status;
+}
+
+/* Reads the start/count hyperslab of var (see sds_readv()) straight into
+ * the caller's own array dst, in the variable's type, skipping the copy
+ * through a library-owned buffer.  Returns dst.
+ *
+ * dst_strides: distance in elements between consecutive indexes of each
+ *              dimension in dst, for writing into a sub-region of a larger
+ *              array.  For example, to read an ny x nx slab into columns
+ *              x0.. of a [NY][NX] array, pass &array[y0][x0] and strides
+ *              {NX, 1}.  If NULL, dst is packed, in the same order as the
+ *              variable.
+ */
+void *sds_readv_into(SDSVarInfo *var, const int *start, const int *count,
+                     void *dst, const ptrdiff_t *dst_strides)
+{
+    int ndims = var->ndims;
+    size_t elsize = sds_type_size(var->type);
+    size_t *st = ALLOCA(size_t, ndims + 1);
+    size_t *cnt = ALLOCA(size_t, ndims + 1);
+    for (int i = 0; i < ndims; i++) {
+        st[i] = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        cnt[i] = (!count || count[i] < 0) ? var->dims[i]->size - st[i] :
+            (size_t)count[i];
+        if (cnt[i] == 0)
+            return dst;
+    }
+
+    // strides that describe a packed array don't need special handling
+    if (ndims < 1) {
+        dst_strides = NULL;
+    } else if (dst_strides) {
+        int packed = (dst_strides[ndims - 1] == 1);
+        for (int i = ndims - 2; packed && i >= 0; i--)
+            packed = (dst_strides[i] == dst_strides[i + 1] * (ptrdiff_t)cnt[i + 1]);
+        if (packed)
+            dst_strides = NULL;
+    }
+
+    if (!dst_strides) {
+        if (sds_cache_enabled() && ndims > 0) {
+            void *raw = NULL;
+            void *got = sds_cache_readv(var, dst, start, count, &raw);
+            if (raw)
+                sds_buffer_free(raw);
+            if (got)
+                return dst;
+        }
+        backend_readv_into(var, dst, start, count, NULL);
+        return dst;
+    }
+    if (backend_readv_into(var, dst, start, count, dst_strides) == 0)
+        return dst;
+
+    // the backend only fills packed arrays: find the trailing dimensions
+    // k.. that are packed in dst, and read each such piece in place if
+    // they're big enough to be worth a read of their own
+    int k = ndims - 1;
+    size_t piece = 0;
+    if (dst_strides[k] == 1) {
+        piece = cnt[k];
+        while (k > 0 && dst_strides[k - 1] == dst_strides[k] * (ptrdiff_t)cnt[k]) {
+            k--;
+            piece *= cnt[k];
+        }
+    }
+    if (piece * elsize >= INTO_PIECE_BYTES) {
+        int *pstart = ALLOCA(int, ndims);
+        int *pcount = ALLOCA(int, ndims);
+        size_t *idx = ALLOCA(size_t, k);
+        for (int i = 0; i < ndims; i++) {
+            pstart[i] = (int)st[i];
+            pcount[i] = (i < k) ? 1 : (int)cnt[i];
+        }
+        memset(idx, 0, sizeof(size_t) * k);
+        for (;;) {
+            char *out = dst;
+            for (int i = 0; i < k; i++) {
+                pstart[i] = (int)(st[i] + idx[i]);
+                out += (ptrdiff_t)idx[i] * dst_strides[i] * (ptrdiff_t)elsize;
+            }
+            backend_readv_into(var, out, pstart, pcount, NULL);
+
+            int i = k - 1;
+            for (; i >= 0; i--) {
+                if (++idx[i] < cnt[i])
+                    break;
+                idx[i] = 0;
+            }
+            if (i < 0)
+                break;
+        }
+        return dst;
+    }
+
+    void *buf = NULL;
+    void *data = sds_backend_readv(var, &buf, start, count);
+    sds_scatter(dst, dst_strides, data, ndims, cnt, elsize);
+    sds_buffer_free(buf);
+    return dst;
+}
+
+/* Like sds_readv(), but converts the values to the wanted type.  For
+ * classic NetCDF files the values are byte swapped and converted straight
+ * out of the file mapping in one pass.  bufp works as in sds_readv(), but
+ * don't share a buffer between this and other read functions.
+ *
+ * want: the type of the returned values; SDS_NO_TYPE or the variable's own
+ *       type means no conversion.
+ */
+void *sds_readv_as(SDSVarInfo *var, void **bufp,
+                   const int *start, const int *count, SDSType want)
+{
+    if (want == SDS_NO_TYPE || want == var->type)
+        return sds_readv(var, bufp, start, count);
+
+    size_t n = hyperslab_count(var, start, count);
+    ConvertBuffer *buf = prep_convert_buffer(bufp, n * sds_type_size(want));
+
+    if (var->sds->cdf &&
+        sds_cdf_readv(var, buf->data, start, count, want, NULL))
+        return buf->data;
+
+    void *raw = sds_backend_readv(var, &buf->raw, start, count);
+    sds_convert(buf->data, want, raw, var->type, n, 0);
+    return buf->data;
+}
+
+/* Like sds_readv(), but returns the hyperslab with its axes permuted:
+ * dimension i of the result is dimension perm[i] of the variable.  For a
+ * [time][lat][lon] variable, perm {2, 1, 0} delivers [lon][lat][time],
+ * which is the variable in Fortran (column-major) order.  The slab is read
+ * through sds_readv_into() with the strides of the new order: while the
+ * last dimension stays last, values go straight into place, out of the
+ * mapping for classic NetCDF files; when it moves, the slab is read once
+ * and copied into the new order a cache-sized block at a time (see
+ * sds_transpose()), which is faster than scattering it an element at a
+ * time.  bufp works as in sds_readv_as().  Aborts, after printing why, if
+ * perm isn't a permutation of the variable's dimensions.
+ */
+void *sds_readv_perm(SDSVarInfo *var, void **bufp, const int *start,
+                     const int *count, const int *perm)
+{
+    // the identity gives packed strides, which read as a plain slab
+    int ndims = var->ndims;
+    ptrdiff_t *strides = NULL;
+    if (perm) {
+        size_t *cnt = ALLOCA(size_t, ndims + 1);
+        for (int i = 0; i < ndims; i++) {
+            size_t st = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+            cnt[i] = (!count || count[i] < 0) ? var->dims[i]->size - st :
+                (size_t)count[i];
+        }
+        strides = ALLOCA(ptrdiff_t, ndims + 1);
+        sds_perm_strides(strides, ndims, cnt, perm);
+    }
+
+    size_t n = hyperslab_count(var, start, count);
+    ConvertBuffer *buf = prep_convert_buffer(bufp,
+                                             n * sds_type_size(var->type));
+    return sds_readv_into(var, start, count, buf->data, strides);
+}
+
+// first value of the named attribute of var as a double, if it has one
+static int packing_att(SDSVarInfo *var, const char *name, double *value)
+{
+    SDSAttInfo *att = var->sds ? sds_find_att(var->sds, var, name) :
+        sds_att_by_name(var->atts, name);
+    if (!att || att->count < 1 || att->type == SDS_STRING)
+        return 0;
+    sds_convert(value, SDS_DOUBLE, sds_att_data(att), att->type, 1, 0);
+    return 1;
+}
+
+/* Returns the packing parameters of var from its scale_factor, add_offset,
+ * _FillValue and missing_value attributes.  They're looked up on the first
+ * call and cached in the variable after that.
+ *
+ * HDF4 files store calibrations written by SDsetcal() as
+ * value = scale_factor * (packed - add_offset), so the offset from those is
+ * converted to the value * scale + offset form.
+ */
+const SDSPacking *sds_var_packing(SDSVarInfo *var)
+{
+    if (var->packing)
+        return var->packing;
+
+    SDSArena *arena = (var->sds && !var->heap) ? var->sds->arena : NULL;
+    sds_io_lock(); // lazy attribute loads allocate from the arena too
+    SDSPacking *pack = ANEW(arena, SDSPacking);
+    sds_io_unlock();
+    if (!packing_att(var, "scale_factor", &pack->scale))
+        pack->scale = 1.0;
+    if (!packing_att(var, "add_offset", &pack->offset))
+        pack->offset = 0.0;
+    else if (var->sds && var->sds->type == SDS_HDF4_FILE)
+        pack->offset *= -pack->scale;
+    pack->has_fill = packing_att(var, "_FillValue", &pack->fill);
+    pack->has_missing = packing_att(var, "missing_value", &pack->missing);
+
+    var->packing = pack;
+    return pack;
+}
+
+/* Like sds_readv_as(), but unpacks the values as it converts them: each
+ * value becomes value * scale_factor + add_offset, and fill and missing
+ * values become NaN (see sds_var_packing()).  For classic NetCDF files this
+ * happens straight out of the file mapping; otherwise the raw values are
+ * unpacked in a single pass after the read.  bufp works as in sds_readv_as().
+ *
+ * want: SDS_FLOAT or SDS_DOUBLE.
+ */
+void *sds_readv_unpacked(SDSVarInfo *var, void **bufp,
+                         const int *start, const int *count, SDSType want)
+{
+    if (want != SDS_FLOAT && want != SDS_DOUBLE) {
+        fprintf(stderr, "can't unpack %s to type %s\n", var->name,
+                sds_type_names[want]);
+        abort();
+    }
+    const SDSPacking *pack = sds_var_packing(var);
+
+    size_t n = hyperslab_count(var, start, count);
+    ConvertBuffer *buf = prep_convert_buffer(bufp, n * sds_type_size(want));
+
+    if (var->sds->cdf &&
+        sds_cdf_readv(var, buf->data, start, count, want, pack))
+        return buf->data;
+
+    void *raw = sds_backend_readv(var, &buf->raw, start, count);
+    sds_unpack(buf->data, want, raw, var->type, n, 0, pack);
+    return buf->data;
+}
+
+// bytes of output per task when a mapped variable is split up
+#define READ_PIECE_BYTES (4 << 20)
+
+typedef struct {
+    SDSVarInfo *var;
+    int var_index;
+    int row0, nrows; // rows of dim 0 covered; nrows < 0 for all of them
+} ReadTask;
+
+typedef struct {
+    SDSVarInfo **vars;
+    void **bufs;
+    void **data;
+    SDSType want;
+    ReadTask *tasks;
+} ReadMany;
+
+static SDSType read_type(SDSVarInfo *var, SDSType want)
+{
+    return (want == SDS_NO_TYPE) ? var->type : want;
+}
+
+// bytes of output per row of dim 0
+static size_t row_bytes(SDSVarInfo *var, SDSType want)
+{
+    return sds_var_count(var) / var->dims[0]->size *
+        sds_type_size(read_type(var, want));
+}
+
+// rows of dim 0 per task if var can be read from its file mapping in
+// pieces, else 0
+static size_t piece_rows(SDSVarInfo *var, SDSType want)
+{
+    SDSView view;
+    if (var->ndims < 1 || var->dims[0]->size == 0 || sds_var_view(var, &view))
+        return 0;
+    size_t rowbytes = row_bytes(var, want);
+    if (rowbytes == 0 || rowbytes >= READ_PIECE_BYTES)
+        return 1;
+    return READ_PIECE_BYTES / rowbytes;
+}
+
+static void read_many_task(void *arg, size_t task, int worker)
+{
+    ReadMany *rm = arg;
+    ReadTask *t = rm->tasks + task;
+    SDSVarInfo *var = t->var;
+    ConvertBuffer *buf = rm->bufs[t->var_index];
+    SDSType want = read_type(var, rm->want);
+
+    if (t->nrows >= 0) {
+        // a piece of a mapped variable: copy it straight from the mapping
+        int *start = ALLOCA(int, var->ndims);
+        int *count = ALLOCA(int, var->ndims);
+        start[0] = t->row0;
+        count[0] = t->nrows;
+        for (int i = 1; i < var->ndims; i++) {
+            start[i] = 0;
+            count[i] = -1;
+        }
+        char *dst = (char *)buf->data + (size_t)t->row0 * row_bytes(var, want);
+        if (sds_cdf_readv(var, dst, start, count, want, NULL))
+            return;
+        fprintf(stderr, "%s: mapped read of %s failed\n", var->sds->path,
+                var->name);
+        abort();
+    }
+
+    // reads are serialized by the file's lock; conversion runs in parallel
+    void *raw = sds_backend_readv(var, &buf->raw, NULL, NULL);
+
+    if (want == var->type) {
+        rm->data[t->var_index] = raw;
+    } else {
+        sds_convert(buf->data, want, raw, var->type, sds_var_count(var), 0);
+        rm->data[t->var_index] = buf->data;
+    }
+}
+
+/* Reads all of each of the given variables, which may belong to different
+ * files, spreading the work over nthreads threads.  Reads through the
+ * format libraries are serialized (see sds_file_lock()) but the type
+ * conversion after each one runs in parallel with the others, and
+ * variables in classic NetCDF files are copied out of the file mapping in
+ * pieces entirely in parallel.
+ *
+ * bufs  - n buffer pointers, each NULL or a buffer from a previous
+ *         sds_read_many() or sds_readv_as() call; free them with
+ *         sds_buffer_free().
+ * data  - receives the n pointers to each variable's values.
+ * want  - the type to convert values to, or SDS_NO_TYPE to return each
+ *         variable's values in its own type.
+ * nthreads - <= 0 for one per CPU.
+ * stats - if not NULL, receives the total bytes read and throughput.
+ */
+void sds_read_many(SDSVarInfo **vars, int n, void **bufs, void **data,
+                   SDSType want, int nthreads, SDSReadStats *stats)
+{
+    double t0 = sds_seconds();
+    size_t total = 0, ntasks = 0;
+
+    // count the tasks: mapped variables are split into pieces along dim 0
+    for (int i = 0; i < n; i++) {
+        SDSVarInfo *var = vars[i];
+        size_t bytes = sds_var_count(var) * sds_type_size(read_type(var, want));
+        size_t rows = piece_rows(var, want);
+        total += bytes;
+
+        // unmapped variables read in their own type are returned in the
+        // backend's buffer, so only the others need room for their values
+        ConvertBuffer *buf = get_convert_buffer(bufs + i);
+        if (rows != 0 || read_type(var, want) != var->type)
+            sds_pool_ensure(&buf->data, &buf->size, bytes);
+        data[i] = buf->data;
+
+        ntasks += rows ? (var->dims[0]->size + rows - 1) / rows : 1;
+    }
+
+    ReadTask *tasks = NEWA(ReadTask, ntasks ? ntasks : 1);
+    size_t k = 0;
+    for (int i = 0; i < n; i++) {
+        SDSVarInfo *var = vars[i];
+        size_t rows = piece_rows(var, want);
+        if (rows) {
+            size_t nrows = var->dims[0]->size;
+            for (size_t r = 0; r < nrows; r += rows, k++) {
+                tasks[k].var = var;
+                tasks[k].var_index = i;
+                tasks[k].row0 = (int)r;
+                tasks[k].nrows = (int)((nrows - r < rows) ? nrows - r : rows);
+            }
+        } else {
+            tasks[k].var = var;
+            tasks[k].var_index = i;
+            tasks[k].row0 = 0;
+            tasks[k].nrows = -1;
+            k++;
+        }
+    }
+
+    ReadMany rm = { vars, bufs, data, want, tasks };
+    sds_run_tasks(read_many_task, &rm, ntasks, nthreads);
+    free(tasks);
+
+    if (stats) {
+        stats->bytes = total;
+        stats->seconds = sds_seconds() - t0;
+        stats->mbps = (stats->seconds > 0) ?
+            total / stats->seconds / 1e6 : 0.0;
+    }
 }
 
 /* Writes all of a given variable.
@@ -558,12 +1479,16 @@ void sds_write(SDSVarInfo *var, void *buf)
     for (int i = 0; i < n; i++) {
         index[i] = -1; // read all of this dimension
     }
+    sds_io_lock();
     (var->sds->funcs->var_writev)(var, buf, index);
+    sds_io_unlock();
 }
 
 void sds_writev(SDSVarInfo *var, void *buf, int *idx)
 {
+    sds_io_lock();
     (var->sds->funcs->var_writev)(var, buf, idx);
+    sds_io_unlock();
 }
 
 struct GenericBuffer {
@@ -576,48 +1501,112 @@ void sds_buffer_free(void *buf)
     (gb->free_func)(buf);
 }
 
+/* The sds_free_*() functions leave members allocated from an SDSInfo's
+ * arena alone; those are released all at once by sds_close().
+ */
 void sds_free_atts(SDSAttInfo *att)
 {
-    if (att) {
+    while (att) {
         SDSAttInfo *next = att->next;
-        free(att->name);
-        free(att->data.v);
-        free(att);
-        sds_free_atts(next);
+        DROP_INDEX(att);
+        if (att->heap) {
+            free(att->name);
+            free(att->data.v);
+            free(att);
+        }
+        att = next;
     }
 }
 
 void sds_free_dims(SDSDimInfo *dim)
 {
-    if (dim) {
+    while (dim) {
         SDSDimInfo *next = dim->next;
-        free(dim->name);
-        free(dim);
-        sds_free_dims(next);
+        DROP_INDEX(dim);
+        if (dim->heap) {
+            free(dim->name);
+            free(dim);
+        }
+        dim = next;
     }
 }
 
 void sds_free_vars(SDSVarInfo *var)
 {
-    if (var) {
+    while (var) {
         SDSVarInfo *next = var->next;
-        free(var->name);
+        DROP_INDEX(var);
+        if (var->prefetch)
+            sds_prefetch_stop(var);
         sds_free_atts(var->atts);
-        free(var->dims);
-        free(var);
-        sds_free_vars(next);
+        if (var->heap) {
+            if (var->sds) // its address may be reused by another variable
+                sds_cache_drop(var->sds, var);
+            free(var->name);
+            free(var->dims);
+            free(var->packing);
+            free(var);
+        }
+        var = next;
+    }
+}
+
+/* Sets the most variables the file's backend keeps open for reading at
+ * once (HDF4 access ids), closing the least recently read beyond that, so
+ * interleaved reads of a few variables don't reopen them on every call.
+ * For files from sds_open_agg() it's the most member files kept open.
+ * n < 1 means the default of 16.
+ */
+void sds_set_max_open(SDSInfo *sds, int n)
+{
+    sds_file_lock(sds); // backends read this while holding the lock
+    sds->max_open = n;
+    sds_file_unlock(sds);
+}
+
+// frees everything but the backend's hold on the file
+static void free_sds(SDSInfo *sds)
+{
+    // only members made with sds_create_*() or copied into the heap need
+    // freeing one by one; with none in the lists, the arena holds everything
+    if (!sds->arena || sds_index_heap_members(sds) > 0) {
+        sds_free_atts(sds->gatts);
+        sds_free_dims(sds->dims);
+        sds_free_vars(sds->vars);
+    }
+    sds_index_free(sds->index);
+
+    SDSArena *arena = sds->arena;
+    if (arena) { // path and sds itself came from the arena too
+        sds_arena_free(arena);
+    } else {
+        free(sds->path);
+        free(sds);
     }
 }
 
 void sds_close(SDSInfo *sds)
 {
-    if (sds->funcs)
+    sds_cache_drop(sds, NULL);
+    if (sds->nprefetch > 0)
+        for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next)
+            if (var->prefetch)
+                sds_prefetch_stop(var);
+    if (sds->funcs) {
+        sds_io_lock();
         sds->funcs->close(sds);
+        sds_io_unlock();
+    }
+    free_sds(sds);
+}
 
-    sds_free_atts(sds->gatts);
-    sds_free_dims(sds->dims);
-    sds_free_vars(sds->vars);
-
-    free(sds->path);
-    free(sds);
+/* Closes a file from sds_open_locked(), with the I/O lock held.  It must
+ * not have read-ahead on.
+ */
+void sds_close_locked(SDSInfo *sds)
+{
+    sds_cache_drop(sds, NULL);
+    if (sds->funcs)
+        sds->funcs->close(sds);
+    free_sds(sds);
 }
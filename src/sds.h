@@ -2,6 +2,7 @@
 #define SDS_H
 
 #include <alloca.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -63,6 +64,21 @@ void *sds_realloc(void *ptr, size_t bytes);
 
 char *sds_strdup(const char *);
 
+/* Arena allocator for metadata that lives exactly as long as its SDSInfo.
+ * A NULL arena falls back to plain sds_alloc().
+ */
+typedef struct SDSArena SDSArena;
+
+SDSArena *sds_arena_create(void);
+void *sds_arena_alloc(SDSArena *arena, size_t bytes);
+void *sds_arena_alloc0(SDSArena *arena, size_t bytes);
+char *sds_arena_strdup(SDSArena *arena, const char *s);
+void sds_arena_free(SDSArena *arena);
+
+#define ANEW(arena,type) (type *)sds_arena_alloc(arena, sizeof(type))
+#define ANEW0(arena,type) (type *)sds_arena_alloc0(arena, sizeof(type))
+#define ANEWA(arena,type,n) (type *)sds_arena_alloc(arena, sizeof(type) * (n))
+
 /* Generic list type for list handling functions.
  */
 typedef struct SDSList {
@@ -98,6 +114,13 @@ typedef struct SDSAttInfo {
         char     *str;
         void     *v;
     } data;
+
+    // private
+    struct SDSInfo *sds; // file to read data from on first use, if lazy
+    int objid; // backend id of the owning variable or file, for lazy loads
+    int index; // backend index of the attribute, for lazy loads
+    struct SDSInfo *owner; // file whose name index points here, if any
+    int heap; // malloc()ed on its own rather than carved from an arena
 } SDSAttInfo;
 
 typedef struct SDSDimInfo {
@@ -106,15 +129,34 @@ typedef struct SDSDimInfo {
     size_t size;
     int isunlim; // unlimited dimension?
     int id; /* private */
+    struct SDSInfo *owner; /* private: file whose name index points here */
+    int heap; /* private: malloc()ed on its own, not from an arena */
 } SDSDimInfo;
 
 typedef struct SDSInfo SDSInfo;
+typedef struct SDSPrefetch SDSPrefetch;
+typedef struct SDSIndex SDSIndex;
+typedef struct CDFMap CDFMap;
+
+/* Packing parameters of a variable, from its scale_factor, add_offset,
+ * _FillValue and missing_value attributes; see sds_var_packing().  Packed
+ * values unpack to value * scale + offset.
+ */
+typedef struct SDSPacking {
+    double scale;   // 1 if there's no scale_factor
+    double offset;  // 0 if there's no add_offset
+    int has_fill;
+    double fill;    // _FillValue, in packed units
+    int has_missing;
+    double missing; // missing_value, in packed units
+} SDSPacking;
 
 typedef struct SDSVarInfo {
     struct SDSVarInfo *next;
     char *name;
     SDSType type;
     int compress; // 0 - no compression; 1 - lowest, 9 - best compression
+                  // -1 - not read yet (lazy open); see sds_var_compress()
     int iscoord; // coordinate variable?
     int ndims;
     SDSDimInfo **dims;
@@ -123,6 +165,10 @@ typedef struct SDSVarInfo {
     // private
     int id;
     SDSInfo *sds;
+    SDSPacking *packing; // cached by sds_var_packing()
+    SDSPrefetch *prefetch; // see sds_prefetch_start()
+    SDSInfo *owner; // file whose name index points here, if any
+    int heap; // malloc()ed on its own rather than carved from an arena
 } SDSVarInfo;
 
 struct SDSInfo {
@@ -137,18 +183,146 @@ struct SDSInfo {
     // private
     int id;
     struct SDS_Funcs *funcs;
+    SDSIndex *index; // name lookups; see sds_find_var()
+    int index_stale; // members the index points at have been freed
+    SDSArena *arena; // owns the metadata of files opened with sds_open()
+    CDFMap *cdf; // mmap()ed classic NetCDF file, if any
+    void *backend; // backend state that doesn't fit in id
+    int max_open; // most variables or files the backend keeps open; see sds_set_max_open()
+    int nprefetch; // variables with read-ahead on
+    int own_lock; // backend takes the I/O lock itself; see sds_file_lock()
 };
 
+/* A variable's data as it lies in a memory-mapped file; see sds_var_view().
+ * Record i of the variable starts at data + i * recstride.
+ */
+typedef struct SDSView {
+    const void *data; // first element, in file byte order
+    size_t nrecs;     // number of records; 1 for non-record variables
+    size_t recbytes;  // bytes of data in each record
+    size_t recstride; // bytes from one record to the next; 0 if not a record var
+    size_t elsize;    // bytes per element
+    int needswap;     // data is big-endian and this host isn't
+} SDSView;
+
+/* Totals for one sds_read_many() call.
+ */
+typedef struct SDSReadStats {
+    size_t bytes;   // bytes of data returned
+    double seconds; // wall clock time taken
+    double mbps;    // throughput in MB (10^6 bytes) per second
+} SDSReadStats;
+
+/* Totals for one sds_read_points() call.
+ */
+typedef struct SDSGatherStats {
+    size_t reads;    // hyperslabs read; 0 if copied from the file mapping
+    size_t elements; // values read, including those not asked for
+} SDSGatherStats;
+
+/* Result of sds_reduce(): statistics of the values of a variable over some
+ * of its dimensions, one cell for each combination of indices of the
+ * others.  The arrays have n elements each, in C order over dims.
+ */
+typedef struct SDSReduction {
+    int ndims;        // dimensions not reduced over
+    int *dims;        // ...as indexes into the variable's dims
+    size_t n;         // number of cells
+    size_t *count;    // values that went into each cell
+    double *min;      // NaN for cells without values
+    double *max;
+    double *sum;
+    double *mean;
+    double *variance; // population variance
+    size_t nfill;     // values left out as _FillValue or missing_value
+    size_t nnan;      // NaN values left out
+} SDSReduction;
+
+/* Counters for the block cache; see sds_cache_stats().
+ */
+typedef struct SDSCacheStats {
+    size_t hits;      // block lookups found in the cache
+    size_t misses;    // block lookups read from the file
+    size_t evictions; // blocks dropped to stay within the budget
+    size_t bytes;     // bytes of data held
+    size_t budget;    // most bytes to hold; 0 if the cache is off
+    size_t nblocks;   // blocks held
+} SDSCacheStats;
+
+typedef struct SDSBlock SDSBlock;
+
+/* Counters for the read buffer pool; see sds_pool_stats().
+ */
+typedef struct SDSPoolStats {
+    size_t gets;        // buffers asked for
+    size_t hits;        // ...that reused an idle buffer
+    size_t idle_bytes;  // bytes of buffers held for reuse
+    size_t inuse_bytes; // bytes of buffers given out
+    size_t peak_bytes;  // most inuse_bytes so far
+    size_t trimmed;     // bytes of idle buffers freed to stay under the limit
+} SDSPoolStats;
+
+/* Counters for a variable's read-ahead; see sds_prefetch_stats().
+ */
+typedef struct SDSPrefetchStats {
+    size_t requests; // timesteps asked for
+    size_t hits;     // ...that were already read ahead
+    size_t waits;    // ...that were being read ahead, so partly overlapped
+    size_t misses;   // ...that had to be read on demand
+    size_t wasted;   // timesteps read ahead but never asked for
+} SDSPrefetchStats;
+
+typedef struct SDSAsync SDSAsync;
+
+// flags for sds_async_create()
+enum {
+    SDS_ASYNC_DIRECT = 1, // read with O_DIRECT, bypassing the page cache
+    SDS_ASYNC_THREADS = 2 // use threads calling pread() even if io_uring works
+};
+
+// a task run by sds_run_tasks(); see there
+typedef void (*SDSTaskFunc)(void *arg, size_t task, int worker);
+
+/* Iterator returned by sds_timestep_iter_create().
+ */
+typedef struct SDSTimestepIter {
+    SDSVarInfo *var;
+    int tstep;   // index of the timestep last returned
+    int ntsteps; // number of timesteps in the variable
+    int batch;   // number of timesteps read per backend call
+
+    // private
+    size_t tstep_bytes;
+    void *buf;
+    char *data;
+    int first; // index of the first timestep held in data
+    int nheld; // number of timesteps held in data
+} SDSTimestepIter;
+
 struct SDS_Funcs {
     void *(*var_readv)(SDSVarInfo *, void **, const int *, const int *);
+    // returns -1 if it can't do strided destinations; see sds_readv_into()
+    int (*var_readv_into)(SDSVarInfo *, void *, const int *, const int *,
+                          const ptrdiff_t *);
+    // start, count and stride always given; see sds_readvs()
+    void *(*var_readvs)(SDSVarInfo *, void **, const int *, const int *,
+                        const int *);
     void (*var_writev)(SDSVarInfo *, void *, const int *);
     void (*close)(SDSInfo *);
+    // read metadata left out by sds_open_lazy()
+    void *(*load_att)(SDSInfo *, SDSAttInfo *);
+    int (*load_compress)(SDSVarInfo *);
 };
 
 SDSFileType sds_file_type(const char *path);
 
 // open existing SDS files
 SDSInfo *sds_open(const char *path);
+SDSInfo *sds_open_lazy(const char *path);
+SDSInfo *sds_open_agg(const char **paths, int n);
+
+// on-disk cache of parsed metadata that sds_open() checks first
+void sds_set_meta_cache(const char *dir);
 
 // XXX show these only if we have NC, HDF4 support config'd
 //SDSInfo *sds_nc_open(const char *path);
@@ -156,23 +330,84 @@ SDSInfo *sds_open(const char *path);
 
 // write new SDS file
 void write_as_nc_sds(const char *path, SDSInfo *sds);
+void write_as_h4_sds(const char *path, SDSInfo *sds);
 
 // read variable data
 void *sds_read_var_by_name(SDSInfo *sds, const char *name, void **bufp);
 
 void *sds_read(SDSVarInfo *var, void **bufp);
 void *sds_timestep(SDSVarInfo *var, void **buf, int tstep);
+int sds_prefetch_start(SDSVarInfo *var, int depth);
+void *sds_prefetch_get(SDSPrefetch *pf, int tstep);
+void sds_prefetch_stats(SDSVarInfo *var, SDSPrefetchStats *stats);
+void sds_prefetch_stop(SDSVarInfo *var);
+SDSTimestepIter *sds_timestep_iter_create(SDSVarInfo *var, int batch);
+void *sds_timestep_iter_next(SDSTimestepIter *it);
+void sds_timestep_iter_free(SDSTimestepIter *it);
 void *sds_readv(SDSVarInfo *var, void **bufp,
                 const int *start, const int *count);
+void *sds_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                 const int *count, const int *stride);
+void *sds_readv_into(SDSVarInfo *var, const int *start, const int *count,
+                     void *dst, const ptrdiff_t *dst_strides);
+void *sds_read_points(SDSVarInfo *var, const int *points, size_t npoints,
+                      void *dst, double waste, SDSGatherStats *stats);
+void *sds_readv_perm(SDSVarInfo *var, void **bufp, const int *start,
+                     const int *count, const int *perm);
+void *sds_readv_as(SDSVarInfo *var, void **bufp,
+                   const int *start, const int *count, SDSType want);
+void *sds_readv_unpacked(SDSVarInfo *var, void **bufp,
+                         const int *start, const int *count, SDSType want);
+const SDSPacking *sds_var_packing(SDSVarInfo *var);
+void sds_read_many(SDSVarInfo **vars, int n, void **bufs, void **data,
+                   SDSType want, int nthreads, SDSReadStats *stats);
+
+// statistics over dimensions of a variable, read a tile at a time
+SDSReduction *sds_reduce(SDSVarInfo *var, const int *reduce, int unpack,
+                         size_t budget, int nthreads);
+void sds_reduction_free(SDSReduction *res);
 
 void sds_buffer_free(void *buf);
 
+// process-wide LRU cache of variable data underneath sds_readv()
+void sds_cache_set_budget(size_t bytes);
+void sds_cache_stats(SDSCacheStats *stats);
+void sds_cache_drop(SDSInfo *sds, SDSVarInfo *var);
+const void *sds_cache_borrow(SDSVarInfo *var, const int *start,
+                             const int *count, void **rawp,
+                             SDSBlock **blockp);
+void sds_cache_release(SDSBlock *block);
+
+// process-wide pool of aligned buffers that read buffers draw from
+void *sds_pool_get(size_t bytes, size_t *capacity);
+void sds_pool_put(void *data, size_t capacity);
+void sds_pool_ensure(void **datap, size_t *capacity, size_t bytes);
+void sds_pool_set_limit(size_t bytes);
+void sds_pool_set_huge_pages(int on);
+void sds_pool_trim(void);
+void sds_pool_stats(SDSPoolStats *stats);
+
+// zero-copy access to classic (CDF1/CDF2) NetCDF variables
+int sds_var_view(SDSVarInfo *var, SDSView *view);
+void *sds_readv_view(SDSVarInfo *var, void *dst,
+                     const int *start, const int *count);
+
+// asynchronous reads of classic NetCDF variables
+SDSAsync *sds_async_create(int depth, int flags);
+int sds_async_uses_uring(SDSAsync *q);
+int sds_readv_async(SDSAsync *q, SDSVarInfo *var, void *dst,
+                    const int *start, const int *count, void *user);
+int sds_async_poll(SDSAsync *q, void **user);
+int sds_async_wait(SDSAsync *q, void **user);
+void sds_async_free(SDSAsync *q);
+
 // write variable data
 void sds_write(SDSVarInfo *var, void *buf);
 void sds_writev(SDSVarInfo *var, void *buf, int *idx);
 
 // close any open SDS file
 void sds_close(SDSInfo *sds);
+void sds_set_max_open(SDSInfo *sds, int n);
 
 // free lists of various things
 void sds_free_atts(SDSAttInfo *atts);
@@ -203,13 +438,68 @@ SDSDimInfo *sds_dims_generic_copy(SDSDimInfo *dim);
 SDSVarInfo *sds_vars_generic_copy(SDSVarInfo *var, SDSDimInfo *newdims);
 
 size_t sds_type_size(SDSType t);
+
+// bulk conversion between types, byte orders and axis orders
+void sds_convert(void *dst, SDSType to, const void *src, SDSType from,
+                 size_t n, int swap);
+void sds_byteswap(void *data, size_t n, size_t elsize);
+void sds_unpack(void *dst, SDSType to, const void *src, SDSType from,
+                size_t n, int swap, const SDSPacking *pack);
+void sds_transpose(void *dst, const void *src, int ndims, const size_t *count,
+                   const int *perm, size_t elsize);
+// worker threads; calls into the format libraries must hold the I/O lock
+void sds_run_tasks(SDSTaskFunc func, void *arg, size_t ntasks, int nthreads);
+int sds_default_threads(void);
+void sds_io_lock(void);
+void sds_io_unlock(void);
+void sds_file_lock(SDSInfo *sds);
+void sds_file_unlock(SDSInfo *sds);
+
+/* Acquire loads and release stores of values shared between threads: the
+ * GCC/clang builtins where the compiler has them, else calls that go
+ * through a mutex in sds_threads.c, whose lock and unlock order memory as
+ * well.
+ */
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define SDS_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SDS_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SDS_LOAD_INT(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SDS_STORE_INT(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SDS_LOAD_UINT(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SDS_STORE_UINT(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define SDS_LOAD_PTR(p) sds_load_ptr(p)
+#define SDS_STORE_PTR(p, v) sds_store_ptr((p), (v))
+#define SDS_LOAD_INT(p) sds_load_int(p)
+#define SDS_STORE_INT(p, v) sds_store_int((p), (v))
+#define SDS_LOAD_UINT(p) sds_load_uint(p)
+#define SDS_STORE_UINT(p, v) sds_store_uint((p), (v))
+#endif
+void *sds_load_ptr(void *const *p);
+void sds_store_ptr(void **p, void *v);
+int sds_load_int(const int *p);
+void sds_store_int(int *p, int v);
+unsigned sds_load_uint(const unsigned *p);
+void sds_store_uint(unsigned *p, unsigned v);
+double sds_seconds(void);
+
 size_t sds_var_size(SDSVarInfo *var);
 size_t sds_var_count(SDSVarInfo *var);
 
+// metadata that files opened with sds_open_lazy() read on first use
+void *sds_att_data(SDSAttInfo *att);
+int sds_var_compress(SDSVarInfo *var);
+
 SDSAttInfo *sds_att_by_name(SDSAttInfo *atts, const char *name);
 SDSDimInfo *sds_dim_by_name(SDSDimInfo *dims, const char *name);
 SDSVarInfo *sds_var_by_name(SDSVarInfo *vars, const char *name);
 
+// constant-time lookups through the SDSInfo's name index
+SDSVarInfo *sds_find_var(SDSInfo *sds, const char *name);
+SDSDimInfo *sds_find_dim(SDSInfo *sds, const char *name);
+SDSAttInfo *sds_find_att(SDSInfo *sds, SDSVarInfo *var, const char *name);
+void sds_reindex(SDSInfo *sds);
+
 SDSAttInfo *sds_keep_atts(SDSAttInfo *atts, const char **names, int n_names);
 SDSDimInfo *sds_keep_dims(SDSDimInfo *dims, const char **names, int n_names);
 SDSVarInfo *sds_keep_vars(SDSVarInfo *vars, const char **names, int n_names);
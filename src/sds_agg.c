@@ -0,0 +1,396 @@
+/* sds_agg.c - Many files with the same variables presented as one, joined
+ *             along their unlimited dimension.
+ *
+ * Data often arrive as one file per day or hour.  sds_open_agg() checks the
+ * files match and returns an SDSInfo like that of the first, except that
+ * its unlimited dimension is as long as all of theirs put together.  Reads
+ * of record variables are split at file boundaries and each piece is read
+ * from its file; other variables are read from the first file.  Only a few
+ * of the files are kept open at once, least recently read closed first, so
+ * scanning thousands of them neither runs out of file descriptors nor
+ * reopens a file for every read.
+ */
+#include "sds.h"
+#include <stdio.h>
+#include <string.h>
+
+// private helpers from sds.c for opening files under the I/O lock
+SDSInfo *sds_open_locked(const char *path);
+void sds_close_locked(SDSInfo *sds);
+
+// files kept open unless sds_set_max_open() says otherwise
+#define DEFAULT_MAX_OPEN 16
+
+typedef struct AggMember {
+    struct AggMember *prev, *next; // open files, most recently used first
+    char *path;
+    size_t first; // index of the file's first record in the aggregation
+    size_t nrecs;
+    SDSInfo *sds; // NULL while closed
+} AggMember;
+
+typedef struct {
+    AggMember *members; // in record order
+    int nmembers;
+    AggMember *head, *tail;
+    int nopen;
+} AggFile;
+
+typedef struct {
+    void (*free)(void *);
+    void *data;
+    size_t capacity;
+} AggBuffer;
+
+static void agg_buffer_free(AggBuffer *buf)
+{
+    if (buf) {
+        sds_pool_put(buf->data, buf->capacity);
+        free(buf);
+    }
+}
+
+static void unlink_member(AggFile *agg, AggMember *m)
+{
+    if (m->prev)
+        m->prev->next = m->next;
+    else
+        agg->head = m->next;
+    if (m->next)
+        m->next->prev = m->prev;
+    else
+        agg->tail = m->prev;
+}
+
+static void close_member(AggFile *agg, AggMember *m)
+{
+    unlink_member(agg, m);
+    agg->nopen--;
+    sds_close_locked(m->sds);
+    m->sds = NULL;
+}
+
+// puts an open member at the front, closing the least recently used files
+// beyond the limit
+static void use_member(SDSInfo *sds, AggMember *m)
+{
+    AggFile *agg = sds->backend;
+    m->prev = NULL;
+    m->next = agg->head;
+    if (agg->head)
+        agg->head->prev = m;
+    else
+        agg->tail = m;
+    agg->head = m;
+
+    int max_open = (sds->max_open > 0) ? sds->max_open : DEFAULT_MAX_OPEN;
+    while (agg->nopen > max_open && agg->tail != m)
+        close_member(agg, agg->tail);
+}
+
+/* Returns the member's open file, opening it again if it was closed.  Must
+ * be called with the I/O lock held.
+ */
+static SDSInfo *member_sds(SDSInfo *sds, AggMember *m)
+{
+    AggFile *agg = sds->backend;
+    if (m->sds) {
+        unlink_member(agg, m);
+        use_member(sds, m);
+        return m->sds;
+    }
+
+    m->sds = sds_open_locked(m->path);
+    if (!m->sds) {
+        fprintf(stderr, "Failed to reopen aggregated file %s\n", m->path);
+        abort();
+    }
+    if (!m->sds->unlimdim || m->sds->unlimdim->size != m->nrecs) {
+        fprintf(stderr, "Aggregated file %s changed since it was opened\n",
+                m->path);
+        abort();
+    }
+    agg->nopen++;
+    use_member(sds, m);
+    return m->sds;
+}
+
+// the member holding record rec, or the last one if rec is past the end
+static AggMember *find_member(AggFile *agg, size_t rec)
+{
+    int lo = 0, hi = agg->nmembers - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (agg->members[mid].first <= rec)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return agg->members + lo;
+}
+
+/* Reads a packed hyperslab into dst, a piece per file it spans.
+ */
+static void read_slab(SDSVarInfo *var, void *dst, const int *start,
+                      const int *count)
+{
+    SDSInfo *sds = var->sds;
+    AggFile *agg = sds->backend;
+
+    if (var->ndims < 1 || var->dims[0] != sds->unlimdim) {
+        // not a record variable, so the same in every file
+        SDSInfo *m = member_sds(sds, agg->members);
+        SDSVarInfo *mvar = sds_find_var(m, var->name);
+        (m->funcs->var_readv_into)(mvar, dst, start, count, NULL);
+        return;
+    }
+
+    int ndims = var->ndims;
+    int *mstart = ALLOCA(int, ndims);
+    int *mcount = ALLOCA(int, ndims);
+    size_t recbytes = sds_type_size(var->type);
+    for (int i = 1; i < ndims; i++) {
+        mstart[i] = (!start || start[i] < 0) ? 0 : start[i];
+        mcount[i] = (!count || count[i] < 0) ?
+            (int)var->dims[i]->size - mstart[i] : count[i];
+        recbytes *= mcount[i];
+    }
+
+    size_t rec = (!start || start[0] < 0) ? 0 : (size_t)start[0];
+    size_t end = (!count || count[0] < 0) ? var->dims[0]->size :
+        rec + (size_t)count[0];
+    char *out = dst;
+    AggMember *mem = find_member(agg, rec);
+    AggMember *last = agg->members + agg->nmembers - 1;
+    for (; rec < end && mem <= last; mem++) {
+        size_t mend = mem->first + mem->nrecs;
+        if (mend <= rec)
+            continue; // no records in this file
+        size_t n = (end < mend ? end : mend) - rec;
+
+        SDSInfo *m = member_sds(sds, mem);
+        SDSVarInfo *mvar = sds_find_var(m, var->name);
+        mstart[0] = (int)(rec - mem->first);
+        mcount[0] = (int)n;
+        (m->funcs->var_readv_into)(mvar, out, mstart, mcount, NULL);
+        out += n * recbytes;
+        rec += n;
+    }
+}
+
+static size_t slab_bytes(SDSVarInfo *var, const int *start, const int *count)
+{
+    size_t n = sds_type_size(var->type);
+    for (int i = 0; i < var->ndims; i++) {
+        size_t st = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        n *= (!count || count[i] < 0) ? var->dims[i]->size - st :
+            (size_t)count[i];
+    }
+    return n;
+}
+
+static AggBuffer *agg_buffer(void **bufp, size_t bytes)
+{
+    AggBuffer *buf = (AggBuffer *)*bufp;
+    if (!buf) {
+        *((AggBuffer **)bufp) = buf = NEW(AggBuffer);
+        buf->free = (void (*)(void *))agg_buffer_free;
+        buf->data = NULL;
+        buf->capacity = 0;
+    }
+    sds_pool_ensure(&buf->data, &buf->capacity, bytes);
+    return buf;
+}
+
+static void *var_readv(SDSVarInfo *var, void **bufp, const int *start,
+                       const int *count)
+{
+    AggBuffer *buf = agg_buffer(bufp, slab_bytes(var, start, count));
+    read_slab(var, buf->data, start, count);
+    return buf->data;
+}
+
+// strided destinations are left to sds_readv_into()
+static int var_readv_into(SDSVarInfo *var, void *dst, const int *start,
+                          const int *count, const ptrdiff_t *strides)
+{
+    if (strides)
+        return -1;
+    read_slab(var, dst, start, count);
+    return 0;
+}
+
+// copies a member's var_readvs() result to out, returning its size
+static size_t read_piece(SDSInfo *m, SDSVarInfo *var, void *out,
+                         const int *start, const int *count, const int *stride)
+{
+    SDSVarInfo *mvar = sds_find_var(m, var->name);
+    void *tmp = NULL;
+    void *data = (m->funcs->var_readvs)(mvar, &tmp, start, count, stride);
+    size_t bytes = slab_bytes(var, start, count);
+    if (bytes > 0)
+        memcpy(out, data, bytes);
+    sds_buffer_free(tmp);
+    return bytes;
+}
+
+/* Reads every stride[i]'th element, a piece per file.  The records picked
+ * out of each file carry on the stride from the file before.
+ */
+static void *var_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                        const int *count, const int *stride)
+{
+    SDSInfo *sds = var->sds;
+    AggFile *agg = sds->backend;
+    AggBuffer *buf = agg_buffer(bufp, slab_bytes(var, start, count));
+
+    if (var->dims[0] != sds->unlimdim) {
+        SDSInfo *m = member_sds(sds, agg->members);
+        read_piece(m, var, buf->data, start, count, stride);
+        return buf->data;
+    }
+
+    int *mstart = ALLOCA(int, var->ndims);
+    int *mcount = ALLOCA(int, var->ndims);
+    memcpy(mstart, start, sizeof(int) * var->ndims);
+    memcpy(mcount, count, sizeof(int) * var->ndims);
+
+    size_t rec = (size_t)start[0], step = (size_t)stride[0];
+    size_t left = (size_t)count[0];
+    char *out = buf->data;
+    AggMember *mem = find_member(agg, rec);
+    AggMember *last = agg->members + agg->nmembers - 1;
+    for (; left > 0 && mem <= last; mem++) {
+        size_t mend = mem->first + mem->nrecs;
+        if (mend <= rec)
+            continue; // no records picked from this file
+        size_t n = (mend - 1 - rec) / step + 1;
+        if (n > left)
+            n = left;
+
+        mstart[0] = (int)(rec - mem->first);
+        mcount[0] = (int)n;
+        out += read_piece(member_sds(sds, mem), var, out, mstart, mcount,
+                          stride);
+        rec += n * step;
+        left -= n;
+    }
+    return buf->data;
+}
+
+static void var_writev(SDSVarInfo *var, void *data, const int *index)
+{
+    fprintf(stderr, "aggregated files are read-only (%s)\n", var->name);
+    abort();
+}
+
+static void close_agg(SDSInfo *sds)
+{
+    AggFile *agg = sds->backend;
+    while (agg->head)
+        close_member(agg, agg->head);
+}
+
+static struct SDS_Funcs agg_funcs = {
+    var_readv,
+    var_readv_into,
+    var_readvs,
+    var_writev,
+    close_agg,
+    NULL,
+    NULL
+};
+
+/* Checks a file has every variable of the aggregation, with the same type
+ * and shape apart from the length of the unlimited dimension, and that
+ * record variables run along the unlimited dimension first.
+ */
+static int check_member(SDSInfo *sds, SDSInfo *m)
+{
+    if (!m->unlimdim) {
+        fprintf(stderr, "%s has no unlimited dimension to aggregate along\n",
+                m->path);
+        return -1;
+    }
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next) {
+        SDSVarInfo *mvar = sds_find_var(m, var->name);
+        int ok = mvar && mvar->type == var->type && mvar->ndims == var->ndims;
+        for (int i = 0; ok && i < var->ndims; i++) {
+            int isrec = (var->dims[i] == sds->unlimdim);
+            ok = (isrec == (mvar->dims[i] == m->unlimdim)) &&
+                (!isrec || i == 0) &&
+                (isrec || mvar->dims[i]->size == var->dims[i]->size);
+        }
+        if (!ok) {
+            fprintf(stderr, "variable %s in %s doesn't match %s\n",
+                    var->name, m->path, sds->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Opens n files with the same variables as one SDSInfo whose unlimited
+ * dimension is the concatenation of theirs, in the order given.  Attributes
+ * and other dimensions are those of the first file, and variables not
+ * along the unlimited dimension are read from it.  The files are kept open
+ * only while recently read; see sds_set_max_open() to change how many.
+ * Returns NULL, after printing why, if a file can't be opened or doesn't
+ * match the first.  The result is read-only; close it with sds_close().
+ */
+SDSInfo *sds_open_agg(const char **paths, int n)
+{
+    if (n < 1)
+        return NULL;
+
+    sds_io_lock();
+    SDSInfo *first = sds_open_locked(paths[0]);
+    if (!first) {
+        sds_io_unlock();
+        return NULL;
+    }
+    if (!first->unlimdim) {
+        fprintf(stderr, "%s has no unlimited dimension to aggregate along\n",
+                paths[0]);
+        sds_close_locked(first);
+        sds_io_unlock();
+        return NULL;
+    }
+
+    SDSInfo *sds = sds_generic_copy(first);
+    SDSArena *arena = sds->arena;
+    sds->path = sds_arena_strdup(arena, paths[0]);
+    sds->type = first->type;
+    sds->unlimdim = sds_find_dim(sds, first->unlimdim->name);
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next)
+        var->compress = sds_var_compress(sds_find_var(first, var->name));
+
+    AggFile *agg = ANEW0(arena, AggFile);
+    agg->members = ANEWA(arena, AggMember, n);
+    sds->backend = agg;
+    sds->funcs = &agg_funcs;
+
+    size_t nrecs = 0;
+    for (int i = 0; i < n; i++) {
+        SDSInfo *m = i ? sds_open_locked(paths[i]) : first;
+        if (!m || check_member(sds, m)) {
+            if (m)
+                sds_close_locked(m);
+            sds_io_unlock();
+            sds_close(sds);
+            return NULL;
+        }
+
+        AggMember *mem = agg->members + agg->nmembers++;
+        mem->path = sds_arena_strdup(arena, paths[i]);
+        mem->first = nrecs;
+        mem->nrecs = m->unlimdim->size;
+        mem->sds = m;
+        agg->nopen++;
+        use_member(sds, mem);
+        nrecs += mem->nrecs;
+    }
+    sds->unlimdim->size = nrecs;
+    sds_io_unlock();
+    return sds;
+}
@@ -0,0 +1,631 @@
+/* sds_async.c - Asynchronous hyperslab reads from classic NetCDF files.
+ *
+ * Classic (CDF1/CDF2) files lay their data out at offsets computable from
+ * the header (see sds_cdf.c), so a hyperslab read is just a list of byte
+ * ranges.  sds_readv_async() queues those ranges as separate reads and
+ * returns at once; many can then be in flight, which is what fast storage
+ * needs to get anywhere near its bandwidth.  Reads are issued through
+ * io_uring when built with HAVE_IO_URING and the kernel allows it, and
+ * otherwise through a pool of threads calling pread().
+ */
+#define _GNU_SOURCE // O_DIRECT, syscall()
+#include "sds.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// biggest single read; larger runs are split so more can be in flight
+#define ASYNC_OP_BYTES (1 << 20)
+// alignment of O_DIRECT offsets, lengths and buffers
+#define DIRECT_ALIGN 4096
+#define DEFAULT_DEPTH 64
+
+typedef void (*CDFRunFunc)(void *arg, size_t offset, size_t n, size_t index);
+
+// private from sds_cdf.c
+int sds_cdf_runs(SDSVarInfo *var, const int *start, const int *count,
+                 CDFRunFunc func, void *arg);
+
+typedef struct AsyncReq {
+    struct AsyncReq *next; // in the done list
+    void *user;
+    void *dst;
+    size_t nelems, elsize;
+    int swap;
+    size_t pending; // ops not yet complete
+    int error;      // errno of the first failed op
+} AsyncReq;
+
+typedef struct AsyncOp {
+    struct AsyncOp *next; // in the queue
+    AsyncReq *req;
+    int fd;
+    size_t offset, len;
+    char *dst;
+    char *bounce; // aligned buffer for O_DIRECT reads, else NULL
+    size_t skip;  // bytes at the start of bounce before the data wanted
+    size_t done;  // bytes read so far (of bounce, if any, else of dst)
+#ifdef HAVE_IO_URING
+    struct iovec iov;
+#endif
+} AsyncOp;
+
+// an open file, known by its device and inode rather than its SDSInfo,
+// whose address may be reused by another file once it's closed
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+} AsyncFile;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} Ring;
+#endif
+
+struct SDSAsync {
+    int flags;
+    int depth;    // most ops in flight at once
+    int inflight; // ops submitted and not reaped
+    size_t outstanding; // requests not yet returned by poll/wait
+
+    AsyncOp *queue, *queue_tail; // ops waiting to be issued
+    AsyncReq *done;              // completed requests
+
+    AsyncFile *files;
+    int nfiles;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // queue grew, an op finished, or quitting
+
+#ifdef HAVE_IO_URING
+    Ring *ring; // NULL when using threads
+#endif
+    pthread_t *threads;
+    int nthreads;
+    int quit;
+};
+
+/* --- common bookkeeping, with the mutex held --- */
+
+static void enqueue(SDSAsync *q, AsyncOp *op)
+{
+    op->next = NULL;
+    if (q->queue_tail)
+        q->queue_tail->next = op;
+    else
+        q->queue = op;
+    q->queue_tail = op;
+}
+
+static AsyncOp *dequeue(SDSAsync *q)
+{
+    AsyncOp *op = q->queue;
+    if (op) {
+        q->queue = op->next;
+        if (!q->queue)
+            q->queue_tail = NULL;
+    }
+    return op;
+}
+
+// where the next part of the op should be read to, and how much of it
+static char *op_target(AsyncOp *op, size_t *len, size_t *offset)
+{
+    if (op->bounce) {
+        size_t start = op->offset - op->skip;
+        size_t total = (op->skip + op->len + DIRECT_ALIGN - 1) &
+            ~(size_t)(DIRECT_ALIGN - 1);
+        *len = total - op->done;
+        *offset = start + op->done;
+        return op->bounce + op->done;
+    }
+    *len = op->len - op->done;
+    *offset = op->offset + op->done;
+    return op->dst + op->done;
+}
+
+/* Accounts for res bytes read (or -errno) by the op.  Returns 1 if the op
+ * needs reading again to get the rest, else 0 after finishing it.
+ */
+static int op_finished(SDSAsync *q, AsyncOp *op, ssize_t res)
+{
+    AsyncReq *req = op->req;
+    if (res < 0 && (res == -EINTR || res == -EAGAIN))
+        return 1;
+    if (res < 0) {
+        if (!req->error)
+            req->error = (int)-res;
+    } else if (res > 0) {
+        op->done += (size_t)res;
+        size_t need = op->bounce ? op->skip + op->len : op->len;
+        if (op->done < need)
+            return 1; // short read; O_DIRECT reads stop short at EOF too
+    } else if (op->done < (op->bounce ? op->skip + op->len : op->len)) {
+        if (!req->error)
+            req->error = EIO; // unexpected end of file
+    }
+
+    if (op->bounce) {
+        if (!req->error)
+            memcpy(op->dst, op->bounce + op->skip, op->len);
+        free(op->bounce);
+    }
+    free(op);
+
+    if (--req->pending == 0) {
+        req->next = q->done;
+        q->done = req;
+    }
+    return 0;
+}
+
+/* --- thread pool backend --- */
+
+static void *worker_main(void *arg)
+{
+    SDSAsync *q = arg;
+    pthread_mutex_lock(&q->mutex);
+    for (;;) {
+        AsyncOp *op;
+        while (!q->quit && !(op = dequeue(q)))
+            pthread_cond_wait(&q->cond, &q->mutex);
+        if (q->quit)
+            break;
+
+        int again;
+        do {
+            size_t len, offset;
+            char *target = op_target(op, &len, &offset);
+            pthread_mutex_unlock(&q->mutex);
+            ssize_t res = pread(op->fd, target, len, (off_t)offset);
+            if (res < 0)
+                res = -errno;
+            pthread_mutex_lock(&q->mutex);
+            again = op_finished(q, op, res);
+        } while (again);
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+static void start_threads(SDSAsync *q)
+{
+    q->nthreads = q->depth < 16 ? q->depth : 16;
+    q->threads = NEWA(pthread_t, q->nthreads);
+    for (int i = 0; i < q->nthreads; i++) {
+        if (pthread_create(q->threads + i, NULL, worker_main, q)) {
+            fprintf(stderr, "Failed to create async read thread\n");
+            abort();
+        }
+    }
+}
+
+/* --- io_uring backend --- */
+
+#ifdef HAVE_IO_URING
+static Ring *ring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return NULL; // old kernel, or forbidden by a seccomp filter
+
+    Ring *r = NEW(Ring);
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+        r->sqes == MAP_FAILED) {
+        if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+        if (r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_ring_size);
+        if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+static void ring_free(Ring *r)
+{
+    munmap(r->sq_ring, r->sq_ring_size);
+    munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sqes, r->sqes_size);
+    close(r->fd);
+    free(r);
+}
+
+static void ring_push(Ring *r, AsyncOp *op)
+{
+    size_t len, offset;
+    op->iov.iov_base = op_target(op, &len, &offset);
+    op->iov.iov_len = len;
+
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = r->sqes + i;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV; // READV goes back to the first io_uring
+    sqe->fd = op->fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long)&op->iov;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)op;
+    r->sq_array[i] = i;
+    SDS_STORE_UINT(r->sq_tail, tail + 1);
+}
+
+// issues queued ops up to the depth limit, and reaps completions, waiting
+// for at least one if wait is set
+static void ring_pump(SDSAsync *q, int wait)
+{
+    Ring *r = q->ring;
+    unsigned submit = 0;
+    AsyncOp *op;
+    while (q->inflight < q->depth && (op = dequeue(q))) {
+        ring_push(r, op);
+        q->inflight++;
+        submit++;
+    }
+
+    unsigned flags = (wait && q->inflight > 0) ? IORING_ENTER_GETEVENTS : 0;
+    if (submit > 0 || flags) {
+        int res;
+        do {
+            res = (int)syscall(__NR_io_uring_enter, r->fd, submit,
+                               flags ? 1 : 0, flags, NULL, 0);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0) {
+            perror("io_uring_enter");
+            abort();
+        }
+    }
+
+    unsigned head = *r->cq_head;
+    unsigned tail = SDS_LOAD_UINT(r->cq_tail);
+    int requeued = 0;
+    while (head != tail) {
+        struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+        AsyncOp *done = (AsyncOp *)(unsigned long)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        q->inflight--;
+        if (op_finished(q, done, res)) {
+            enqueue(q, done); // read the rest
+            requeued = 1;
+        }
+    }
+    SDS_STORE_UINT(r->cq_head, head);
+
+    if (requeued)
+        ring_pump(q, 0);
+}
+#endif
+
+/* --- public interface --- */
+
+/* Creates a queue for asynchronous reads.
+ *
+ * depth - most reads in flight at once; <= 0 for a default of 64.
+ * flags - SDS_ASYNC_DIRECT to read with O_DIRECT, bypassing the page cache
+ *         (for data read once, where caching it only evicts other data);
+ *         SDS_ASYNC_THREADS to use the thread pool even if io_uring is
+ *         available.
+ */
+SDSAsync *sds_async_create(int depth, int flags)
+{
+    SDSAsync *q = NEW(SDSAsync);
+    memset(q, 0, sizeof(*q));
+    q->flags = flags;
+    q->depth = (depth > 0) ? depth : DEFAULT_DEPTH;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+#ifdef HAVE_IO_URING
+    if (!(flags & SDS_ASYNC_THREADS))
+        q->ring = ring_create((unsigned)q->depth);
+    if (!q->ring)
+        start_threads(q);
+#else
+    start_threads(q);
+#endif
+    return q;
+}
+
+/* Whether the queue is using io_uring (1) or its thread pool (0).
+ */
+int sds_async_uses_uring(SDSAsync *q)
+{
+#ifdef HAVE_IO_URING
+    return q->ring != NULL;
+#else
+    return 0;
+#endif
+}
+
+// returns the queue's descriptor for the file at path, opening it the
+// first time, or -1 if it can't be opened
+static int file_fd(SDSAsync *q, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+    for (int i = 0; i < q->nfiles; i++)
+        if (q->files[i].dev == st.st_dev && q->files[i].ino == st.st_ino)
+            return q->files[i].fd;
+
+    int oflags = O_RDONLY;
+    if (q->flags & SDS_ASYNC_DIRECT)
+        oflags |= O_DIRECT;
+    int fd = open(path, oflags);
+    if (fd < 0 && (q->flags & SDS_ASYNC_DIRECT))
+        fd = open(path, O_RDONLY); // e.g. tmpfs doesn't do O_DIRECT
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st)) { // the path may have changed since the stat()
+        close(fd);
+        return -1;
+    }
+
+    q->files = sds_realloc(q->files, sizeof(AsyncFile) * (q->nfiles + 1));
+    q->files[q->nfiles].dev = st.st_dev;
+    q->files[q->nfiles].ino = st.st_ino;
+    q->files[q->nfiles].fd = fd;
+    q->nfiles++;
+    return fd;
+}
+
+typedef struct {
+    SDSAsync *q;
+    AsyncReq *req;
+    int fd;
+    int direct;
+    AsyncOp *ops, *ops_tail;
+} OpBuilder;
+
+static void add_ops(void *arg, size_t offset, size_t n, size_t index)
+{
+    OpBuilder *b = arg;
+    size_t len = n * b->req->elsize;
+    char *dst = (char *)b->req->dst + index * b->req->elsize;
+
+    while (len > 0) {
+        size_t piece = (len < ASYNC_OP_BYTES) ? len : ASYNC_OP_BYTES;
+        AsyncOp *op = NEW(AsyncOp);
+        op->next = NULL;
+        op->req = b->req;
+        op->fd = b->fd;
+        op->offset = offset;
+        op->len = piece;
+        op->dst = dst;
+        op->bounce = NULL;
+        op->skip = 0;
+        op->done = 0;
+        if (b->direct) {
+            op->skip = offset & (DIRECT_ALIGN - 1);
+            size_t total = (op->skip + piece + DIRECT_ALIGN - 1) &
+                ~(size_t)(DIRECT_ALIGN - 1);
+            void *p;
+            if (posix_memalign(&p, DIRECT_ALIGN, total)) {
+                fprintf(stderr, "Failed to allocate %u byte read buffer\n",
+                        (unsigned)total);
+                abort();
+            }
+            op->bounce = p;
+        }
+
+        if (b->ops_tail)
+            b->ops_tail->next = op;
+        else
+            b->ops = op;
+        b->ops_tail = op;
+        b->req->pending++;
+
+        offset += piece;
+        dst += piece;
+        len -= piece;
+    }
+}
+
+/* Starts reading the start/count hyperslab of var (see sds_readv()) into
+ * dst, in the variable's own type, and returns without waiting for it.
+ * Get the finished reads from sds_async_poll() or sds_async_wait(), which
+ * hand back the user pointer given here.  dst must stay valid until then.
+ * Returns 0, or -1 if the read can't be done asynchronously (the variable
+ * isn't in a classic NetCDF file, or the hyperslab is out of bounds), in
+ * which case nothing is queued and you should use sds_readv().
+ */
+int sds_readv_async(SDSAsync *q, SDSVarInfo *var, void *dst,
+                    const int *start, const int *count, void *user)
+{
+    if (!var->sds->cdf)
+        return -1;
+
+    pthread_mutex_lock(&q->mutex);
+    int fd = file_fd(q, var->sds->path);
+    pthread_mutex_unlock(&q->mutex);
+    if (fd < 0)
+        return -1;
+
+    SDSView view;
+    if (sds_var_view(var, &view))
+        return -1;
+
+    AsyncReq *req = NEW(AsyncReq);
+    req->next = NULL;
+    req->user = user;
+    req->dst = dst;
+    req->elsize = sds_type_size(var->type);
+    req->swap = view.needswap;
+    req->pending = 0;
+    req->error = 0;
+    req->nelems = 1;
+    for (int i = 0; i < var->ndims; i++) {
+        size_t size = (i == 0 && view.recstride) ?
+            view.nrecs : var->dims[i]->size;
+        size_t st = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        req->nelems *= (!count || count[i] < 0) ? size - st : (size_t)count[i];
+    }
+
+    OpBuilder b = { q, req, fd, (q->flags & SDS_ASYNC_DIRECT) != 0,
+                    NULL, NULL };
+    if (sds_cdf_runs(var, start, count, add_ops, &b)) {
+        while (b.ops) {
+            AsyncOp *next = b.ops->next;
+            free(b.ops->bounce);
+            free(b.ops);
+            b.ops = next;
+        }
+        free(req);
+        return -1;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    q->outstanding++;
+    if (req->pending == 0) { // empty hyperslab
+        req->next = q->done;
+        q->done = req;
+    }
+    while (b.ops) {
+        AsyncOp *next = b.ops->next;
+        enqueue(q, b.ops);
+        b.ops = next;
+    }
+#ifdef HAVE_IO_URING
+    if (q->ring)
+        ring_pump(q, 0);
+#endif
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+/* Pops a finished request, with the mutex held, and byte swaps it.  Returns
+ * 1, or -1 with errno set if the read failed, or 0 if none have finished.
+ */
+static int take_done(SDSAsync *q, void **user)
+{
+    AsyncReq *req = q->done;
+    if (!req)
+        return 0;
+    q->done = req->next;
+    q->outstanding--;
+
+    int got = 1;
+    if (req->error) {
+        errno = req->error;
+        got = -1;
+    } else if (req->swap) {
+        sds_byteswap(req->dst, req->nelems, req->elsize);
+    }
+    if (user)
+        *user = req->user;
+    free(req);
+    return got;
+}
+
+/* Returns 1 and sets *user to the user pointer of a finished read if there
+ * is one, else returns 0 without waiting.  If the read failed, this
+ * returns -1 instead, with *user set and errno saying why, and what ended
+ * up in its dst is undefined.
+ */
+int sds_async_poll(SDSAsync *q, void **user)
+{
+    pthread_mutex_lock(&q->mutex);
+#ifdef HAVE_IO_URING
+    if (q->ring)
+        ring_pump(q, 0);
+#endif
+    int got = take_done(q, user);
+    pthread_mutex_unlock(&q->mutex);
+    return got;
+}
+
+/* Waits for a read to finish, returning 1 (or -1 if it failed; see
+ * sds_async_poll()) and setting *user to its user pointer, or returns 0 if
+ * no reads are outstanding.
+ */
+int sds_async_wait(SDSAsync *q, void **user)
+{
+    pthread_mutex_lock(&q->mutex);
+    int got;
+    while (!(got = take_done(q, user)) && q->outstanding > 0) {
+#ifdef HAVE_IO_URING
+        if (q->ring) {
+            ring_pump(q, 1);
+            continue;
+        }
+#endif
+        pthread_cond_wait(&q->cond, &q->mutex);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return got;
+}
+
+/* Waits for any outstanding reads and frees the queue.
+ */
+void sds_async_free(SDSAsync *q)
+{
+    while (sds_async_wait(q, NULL))
+        ;
+
+    if (q->threads) {
+        pthread_mutex_lock(&q->mutex);
+        q->quit = 1;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+        for (int i = 0; i < q->nthreads; i++)
+            pthread_join(q->threads[i], NULL);
+        free(q->threads);
+    }
+#ifdef HAVE_IO_URING
+    if (q->ring)
+        ring_free(q->ring);
+#endif
+    for (int i = 0; i < q->nfiles; i++)
+        close(q->files[i].fd);
+    free(q->files);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
+    free(q);
+}
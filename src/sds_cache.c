@@ -0,0 +1,504 @@
+/* sds_cache.c - Process-wide LRU cache of variable data blocks.
+ *
+ * A block is a contiguous run of a variable of at most CACHE_BLOCK_BYTES:
+ * whole rows along its first dimension, or where even one of those is
+ * bigger, part of a row along the first dimension that doesn't fit whole
+ * (see block_shape()), so small reads never pull in much more than they
+ * ask for.  sds_readv() assembles reads out of cached
+ * blocks when the cache has a budget (see sds_cache_set_budget()), so
+ * overlapping and repeated reads only go to the file once.  The cache is
+ * off (a budget of 0) until a program turns it on.
+ */
+#include "sds.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// private locked backend read from sds.c
+void *sds_backend_readv(SDSVarInfo *var, void **bufp,
+                        const int *start, const int *count);
+
+#define CACHE_BLOCK_BYTES (1 << 20)
+#define MIN_BUCKETS 256
+
+struct SDSBlock {
+    struct SDSBlock *hnext;     // hash chain
+    struct SDSBlock *prev, *next; // LRU list, most recently used first
+    SDSInfo *sds;
+    SDSVarInfo *var;
+    size_t index; // block number, row-major over the grid of blocks
+    size_t *start, *count; // the hyperslab of the variable the block holds
+    size_t bytes;
+    int refs;   // borrowed views still out
+    int cached; // still findable; dropped blocks wait for refs to reach 0
+    void *data;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    SDSBlock **buckets;
+    size_t nbuckets; // a power of 2
+    SDSBlock *head, *tail;
+    SDSCacheStats stats;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, NULL, { 0 } };
+
+static size_t block_hash(const SDSVarInfo *var, size_t index)
+{
+    size_t h = (size_t)(uintptr_t)var;
+    h ^= h >> 17;
+    h += index * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 29)) & (cache.nbuckets - 1);
+}
+
+static void lru_unlink(SDSBlock *b)
+{
+    if (b->prev) b->prev->next = b->next; else cache.head = b->next;
+    if (b->next) b->next->prev = b->prev; else cache.tail = b->prev;
+    b->prev = b->next = NULL;
+}
+
+static void lru_push(SDSBlock *b)
+{
+    b->prev = NULL;
+    b->next = cache.head;
+    if (cache.head) cache.head->prev = b; else cache.tail = b;
+    cache.head = b;
+}
+
+static void free_block(SDSBlock *b)
+{
+    free(b->start);
+    free(b->data);
+    free(b);
+}
+
+// takes the block out of the table; it's freed now or on its last release
+static void drop_block(SDSBlock *b)
+{
+    SDSBlock **p = cache.buckets + block_hash(b->var, b->index);
+    while (*p != b)
+        p = &(*p)->hnext;
+    *p = b->hnext;
+    lru_unlink(b);
+    b->cached = 0;
+    cache.stats.bytes -= b->bytes;
+    cache.stats.nblocks--;
+    if (b->refs == 0)
+        free_block(b);
+}
+
+// evicts least recently used blocks that aren't borrowed until the cache
+// fits its budget
+static void trim(void)
+{
+    SDSBlock *b = cache.tail;
+    while (b && cache.stats.bytes > cache.stats.budget) {
+        SDSBlock *prev = b->prev;
+        if (b->refs == 0) {
+            drop_block(b);
+            cache.stats.evictions++;
+        }
+        b = prev;
+    }
+}
+
+static void grow_buckets(void)
+{
+    size_t n = cache.nbuckets ? cache.nbuckets * 2 : MIN_BUCKETS;
+    SDSBlock **old = cache.buckets;
+    size_t nold = cache.nbuckets;
+    cache.buckets = sds_alloc0(sizeof(SDSBlock *) * n);
+    cache.nbuckets = n;
+    for (size_t i = 0; i < nold; i++) {
+        SDSBlock *b = old[i];
+        while (b) {
+            SDSBlock *next = b->hnext;
+            size_t h = block_hash(b->var, b->index);
+            b->hnext = cache.buckets[h];
+            cache.buckets[h] = b;
+            b = next;
+        }
+    }
+    free(old);
+}
+
+static SDSBlock *find_block(const SDSVarInfo *var, size_t index)
+{
+    if (cache.nbuckets == 0)
+        return NULL;
+    SDSBlock *b = cache.buckets[block_hash(var, index)];
+    while (b && (b->var != var || b->index != index))
+        b = b->hnext;
+    return b;
+}
+
+/* Sets the most memory the cache may hold, evicting blocks to fit.  A
+ * budget of 0 empties the cache and turns it off.
+ */
+void sds_cache_set_budget(size_t bytes)
+{
+    pthread_mutex_lock(&cache.mutex);
+    cache.stats.budget = bytes;
+    trim();
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void sds_cache_stats(SDSCacheStats *stats)
+{
+    pthread_mutex_lock(&cache.mutex);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+/* Drops the cached blocks of var, or of every variable in sds if var is
+ * NULL.  sds_close() and sds_free_vars() call this; call it yourself if a
+ * file changes underneath an open SDSInfo.
+ */
+void sds_cache_drop(SDSInfo *sds, SDSVarInfo *var)
+{
+    pthread_mutex_lock(&cache.mutex);
+    SDSBlock *b = cache.head;
+    while (b) {
+        SDSBlock *next = b->next;
+        if (b->sds == sds && (!var || b->var == var))
+            drop_block(b);
+        b = next;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+int sds_cache_enabled(void)
+{
+    return cache.stats.budget > 0; // a racy peek is fine for a hint
+}
+
+/* Fills in shape, the size of a block along each dimension of var: one
+ * index of every dimension before some dimension k, as many of dimension k
+ * as fit in CACHE_BLOCK_BYTES, and all of every dimension after k.  A
+ * block is then one contiguous run of the variable, however its bytes are
+ * spread over the dimensions.  Returns 0 if the variable can't be cached.
+ */
+static int block_shape(SDSVarInfo *var, size_t budget, size_t *shape)
+{
+    size_t bytes = sds_type_size(var->type);
+    if (var->ndims < 1 || bytes == 0)
+        return 0;
+    for (int i = 0; i < var->ndims; i++)
+        if (var->dims[i]->size == 0)
+            return 0;
+
+    int i = var->ndims - 1;
+    for (; i >= 0; i--) {
+        size_t size = var->dims[i]->size;
+        if (size > CACHE_BLOCK_BYTES / bytes) {
+            shape[i] = CACHE_BLOCK_BYTES / bytes;
+            if (shape[i] == 0)
+                shape[i] = 1;
+            bytes *= shape[i];
+            break;
+        }
+        shape[i] = size;
+        bytes *= size;
+    }
+    while (--i >= 0)
+        shape[i] = 1;
+
+    if (bytes > budget / 2)
+        return 0; // a single block would crowd out everything else
+    return 1;
+}
+
+// number of blocks of the given shape along dimension i of var
+static size_t blocks_along(SDSVarInfo *var, const size_t *shape, int i)
+{
+    return (var->dims[i]->size + shape[i] - 1) / shape[i];
+}
+
+/* Returns the given block, pinned, reading it from the file if it isn't
+ * cached.  rawp is the backend buffer to read through.
+ */
+static SDSBlock *get_block(SDSVarInfo *var, size_t index,
+                           const size_t *shape, void **rawp)
+{
+    pthread_mutex_lock(&cache.mutex);
+    SDSBlock *b = find_block(var, index);
+    if (b) {
+        cache.stats.hits++;
+        b->refs++;
+        lru_unlink(b);
+        lru_push(b);
+        pthread_mutex_unlock(&cache.mutex);
+        return b;
+    }
+    cache.stats.misses++;
+    pthread_mutex_unlock(&cache.mutex);
+
+    // read without holding the lock; if another thread races us to the
+    // same block, its copy wins and ours is discarded below
+    int ndims = var->ndims;
+    int *start = ALLOCA(int, ndims);
+    int *count = ALLOCA(int, ndims);
+    b = NEW(SDSBlock);
+    b->sds = var->sds;
+    b->var = var;
+    b->index = index;
+    b->start = NEWA(size_t, 2 * ndims);
+    b->count = b->start + ndims;
+    b->bytes = sds_type_size(var->type);
+    size_t rest = index;
+    for (int i = ndims - 1; i >= 0; i--) {
+        size_t nblocks = blocks_along(var, shape, i);
+        size_t left;
+        b->start[i] = rest % nblocks * shape[i];
+        rest /= nblocks;
+        left = var->dims[i]->size - b->start[i];
+        b->count[i] = (left < shape[i]) ? left : shape[i];
+        b->bytes *= b->count[i];
+        start[i] = (int)b->start[i];
+        count[i] = (int)b->count[i];
+    }
+    b->refs = 1;
+    b->cached = 1;
+    b->data = sds_alloc(b->bytes ? b->bytes : 1);
+    memcpy(b->data, sds_backend_readv(var, rawp, start, count), b->bytes);
+
+    pthread_mutex_lock(&cache.mutex);
+    SDSBlock *other = find_block(var, index);
+    if (other) {
+        other->refs++;
+        pthread_mutex_unlock(&cache.mutex);
+        free_block(b);
+        return other;
+    }
+    if (cache.stats.nblocks >= cache.nbuckets)
+        grow_buckets();
+    size_t h = block_hash(var, index);
+    b->hnext = cache.buckets[h];
+    cache.buckets[h] = b;
+    lru_push(b);
+    cache.stats.bytes += b->bytes;
+    cache.stats.nblocks++;
+    trim();
+    pthread_mutex_unlock(&cache.mutex);
+    return b;
+}
+
+/* Releases a block returned by sds_cache_borrow().
+ */
+void sds_cache_release(SDSBlock *b)
+{
+    pthread_mutex_lock(&cache.mutex);
+    if (--b->refs == 0) {
+        if (!b->cached)
+            free_block(b);
+        else if (cache.stats.bytes > cache.stats.budget)
+            trim();
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+/* Fills in st and cnt from start and count (see sds_readv()).  Returns 0 if
+ * they run past the end of a dimension, leaving the backend to complain.
+ */
+static int slab_bounds(SDSVarInfo *var, const int *start, const int *count,
+                       size_t *st, size_t *cnt)
+{
+    for (int i = 0; i < var->ndims; i++) {
+        size_t size = var->dims[i]->size;
+        st[i] = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        if (st[i] > size)
+            return 0;
+        cnt[i] = (!count || count[i] < 0) ? size - st[i] : (size_t)count[i];
+        if (cnt[i] > size - st[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Copies the cnt box at src_st of the contiguous ndims-dimensional array
+ * src (with dimension sizes ssizes) to the box at dst_st of dst (with
+ * dimension sizes dsizes).
+ */
+static void copy_box(char *dst, const size_t *dsizes, const size_t *dst_st,
+                     const char *src, const size_t *ssizes,
+                     const size_t *src_st, const size_t *cnt, int ndims,
+                     size_t elsize)
+{
+    size_t *dstrides = ALLOCA(size_t, ndims);
+    size_t *sstrides = ALLOCA(size_t, ndims);
+    dstrides[ndims - 1] = sstrides[ndims - 1] = elsize;
+    for (int i = ndims - 2; i >= 0; i--) {
+        dstrides[i] = dstrides[i + 1] * dsizes[i + 1];
+        sstrides[i] = sstrides[i + 1] * ssizes[i + 1];
+    }
+
+    // gather trailing dimensions whole in both arrays into one run
+    int inner = ndims;
+    size_t run = elsize;
+    while (inner > 0) {
+        inner--;
+        run *= cnt[inner];
+        if (cnt[inner] != dsizes[inner] || cnt[inner] != ssizes[inner])
+            break;
+    }
+    if (run == 0)
+        return;
+
+    size_t *idx = ALLOCA(size_t, ndims);
+    for (int i = 0; i < ndims; i++)
+        idx[i] = 0;
+    for (;;) {
+        size_t doff = 0, soff = 0;
+        for (int i = 0; i < ndims; i++) {
+            doff += (dst_st[i] + idx[i]) * dstrides[i];
+            soff += (src_st[i] + idx[i]) * sstrides[i];
+        }
+        memcpy(dst + doff, src + soff, run);
+
+        int i = inner - 1;
+        while (i >= 0) {
+            if (++idx[i] < cnt[i])
+                break;
+            idx[i] = 0;
+            i--;
+        }
+        if (i < 0)
+            break;
+    }
+}
+
+/* Whether sds_cache_readv() would serve the start/count hyperslab of var,
+ * i.e. the cache is on, var can be cached and the hyperslab is in bounds,
+ * so callers know if a buffer for it is worth allocating.
+ */
+int sds_cache_can_read(SDSVarInfo *var, const int *start, const int *count)
+{
+    int ndims = var->ndims;
+    if (ndims < 1 || !sds_cache_enabled())
+        return 0;
+    size_t *shape = ALLOCA(size_t, ndims);
+    size_t *st = ALLOCA(size_t, ndims);
+    size_t *cnt = ALLOCA(size_t, ndims);
+    return block_shape(var, cache.stats.budget, shape) &&
+        slab_bounds(var, start, count, st, cnt);
+}
+
+/* Reads the start/count hyperslab of var (see sds_readv()) into dst through
+ * the cache.  rawp is the backend buffer to read blocks through.  Returns
+ * dst, or NULL if the cache is off or var can't be cached, in which case
+ * the caller should read it directly.
+ */
+void *sds_cache_readv(SDSVarInfo *var, void *dst, const int *start,
+                      const int *count, void **rawp)
+{
+    int ndims = var->ndims;
+    if (ndims < 1)
+        return NULL;
+    size_t *shape = ALLOCA(size_t, ndims);
+    if (!block_shape(var, cache.stats.budget, shape))
+        return NULL;
+
+    size_t *st = ALLOCA(size_t, ndims);
+    size_t *cnt = ALLOCA(size_t, ndims);
+    if (!slab_bounds(var, start, count, st, cnt))
+        return NULL;
+    for (int i = 0; i < ndims; i++)
+        if (cnt[i] == 0)
+            return dst;
+
+    // walk the blocks the hyperslab touches, lo[i]..hi[i] along each
+    // dimension, copying the part of it in each one into place
+    size_t *lo = ALLOCA(size_t, ndims);
+    size_t *hi = ALLOCA(size_t, ndims);
+    size_t *at = ALLOCA(size_t, ndims);
+    size_t *bst = ALLOCA(size_t, ndims);
+    size_t *ost = ALLOCA(size_t, ndims);
+    size_t *part = ALLOCA(size_t, ndims);
+    for (int i = 0; i < ndims; i++) {
+        lo[i] = at[i] = st[i] / shape[i];
+        hi[i] = (st[i] + cnt[i] - 1) / shape[i];
+    }
+    size_t elsize = sds_type_size(var->type);
+    for (;;) {
+        size_t index = 0;
+        for (int i = 0; i < ndims; i++)
+            index = index * blocks_along(var, shape, i) + at[i];
+        SDSBlock *b = get_block(var, index, shape, rawp);
+
+        for (int i = 0; i < ndims; i++) {
+            size_t first = (st[i] > b->start[i]) ? st[i] : b->start[i];
+            size_t end = st[i] + cnt[i];
+            if (end > b->start[i] + b->count[i])
+                end = b->start[i] + b->count[i];
+            bst[i] = first - b->start[i];
+            ost[i] = first - st[i];
+            part[i] = end - first;
+        }
+        copy_box(dst, cnt, ost, b->data, b->count, bst, part, ndims, elsize);
+        sds_cache_release(b);
+
+        int i = ndims - 1;
+        while (i >= 0) {
+            if (++at[i] <= hi[i])
+                break;
+            at[i] = lo[i];
+            i--;
+        }
+        if (i < 0)
+            break;
+    }
+    return dst;
+}
+
+/* Returns a pointer straight into a cached block holding the start/count
+ * hyperslab of var (see sds_readv()), reading the block if needed, without
+ * copying.  The hyperslab must lie in one block and be contiguous there
+ * (i.e. whole in every dimension after the first one it doesn't cover
+ * completely); otherwise, or if the cache is off, this returns NULL and
+ * you should use sds_readv().  The block stays valid until you pass *blockp
+ * to sds_cache_release().
+ *
+ * rawp - the backend buffer to read through, as with sds_readv(); free it
+ *        with sds_buffer_free().
+ */
+const void *sds_cache_borrow(SDSVarInfo *var, const int *start,
+                             const int *count, void **rawp,
+                             SDSBlock **blockp)
+{
+    int ndims = var->ndims;
+    if (ndims < 1)
+        return NULL;
+    size_t *shape = ALLOCA(size_t, ndims);
+    if (!block_shape(var, cache.stats.budget, shape))
+        return NULL;
+
+    size_t *st = ALLOCA(size_t, ndims);
+    size_t *cnt = ALLOCA(size_t, ndims);
+    size_t *bsize = ALLOCA(size_t, ndims);
+    if (!slab_bounds(var, start, count, st, cnt))
+        return NULL;
+    size_t index = 0;
+    for (int i = 0; i < ndims; i++) {
+        if (cnt[i] == 0 || st[i] / shape[i] != (st[i] + cnt[i] - 1) / shape[i])
+            return NULL;
+        index = index * blocks_along(var, shape, i) + st[i] / shape[i];
+        size_t left = var->dims[i]->size - st[i] / shape[i] * shape[i];
+        bsize[i] = (left < shape[i]) ? left : shape[i];
+    }
+
+    // contiguous if, after the first dimension not read whole in the
+    // block, every dimension is read as a single index
+    int i = ndims - 1;
+    while (i > 0 && st[i] % shape[i] == 0 && cnt[i] == bsize[i])
+        i--;
+    for (int j = i - 1; j >= 0; j--)
+        if (cnt[j] != 1)
+            return NULL;
+
+    SDSBlock *b = get_block(var, index, shape, rawp);
+    size_t off = 0;
+    for (int j = 0; j < ndims; j++)
+        off = off * b->count[j] + (st[j] - b->start[j]);
+    *blockp = b;
+    return (const char *)b->data + off * sds_type_size(var->type);
+}
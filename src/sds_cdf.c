@@ -0,0 +1,659 @@
+/* sds_cdf.c - mmap()-based access to variable data in classic (CDF1) and
+ *             64-bit offset (CDF2) NetCDF files.
+ *
+ * In those formats every variable's data is a big-endian array at an offset
+ * given in the file header (interleaved record by record for variables
+ * along the unlimited dimension), so once the header is parsed the data can
+ * be used straight out of the page cache instead of being copied through
+ * the NetCDF library.
+ */
+#include "sds.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// header tags and types from the classic format spec
+#define CDF_DIMENSION 0x0A
+#define CDF_VARIABLE  0x0B
+#define CDF_ATTRIBUTE 0x0C
+#define CDF_STREAMING 0xFFFFFFFFu
+
+// fewest header bytes a dimension (name length, size) and a variable (name
+// length, rank, attribute tag and count, type, vsize, begin) can take
+#define MIN_DIM_BYTES 8
+#define MIN_VAR_BYTES 28
+
+enum { CDF_BYTE = 1, CDF_CHAR, CDF_SHORT, CDF_INT, CDF_FLOAT, CDF_DOUBLE };
+
+typedef struct {
+    size_t begin; // file offset of the first element
+    size_t len;   // bytes of data in one record (or in all of a fixed var)
+    int isrec;
+} CDFVar;
+
+struct CDFMap {
+    const unsigned char *base;
+    size_t size;
+    size_t numrecs;
+    size_t recsize; // bytes from one record to the next
+    int nvars;
+    CDFVar *vars; // indexed by NetCDF variable id
+};
+
+// called by sds_cdf_runs() for each contiguous run of a hyperslab
+typedef void (*CDFRunFunc)(void *arg, size_t offset, size_t n, size_t index);
+
+typedef struct {
+    const unsigned char *p, *end;
+    int version;
+    int bad;
+} Cursor;
+
+static uint32_t get_u32(Cursor *c)
+{
+    if (c->end - c->p < 4) {
+        c->bad = 1;
+        return 0;
+    }
+    uint32_t v = ((uint32_t)c->p[0] << 24) | ((uint32_t)c->p[1] << 16) |
+        ((uint32_t)c->p[2] << 8) | c->p[3];
+    c->p += 4;
+    return v;
+}
+
+static uint64_t get_u64(Cursor *c)
+{
+    uint64_t hi = get_u32(c);
+    return (hi << 32) | get_u32(c);
+}
+
+static void skip(Cursor *c, size_t n)
+{
+    n = (n + 3) & ~(size_t)3; // everything is padded to 4 bytes
+    if ((size_t)(c->end - c->p) < n) {
+        c->bad = 1;
+        return;
+    }
+    c->p += n;
+}
+
+static size_t cdf_type_size(uint32_t type)
+{
+    switch (type) {
+    case CDF_BYTE:
+    case CDF_CHAR:   return 1;
+    case CDF_SHORT:  return 2;
+    case CDF_INT:
+    case CDF_FLOAT:  return 4;
+    case CDF_DOUBLE: return 8;
+    default: break;
+    }
+    return 0;
+}
+
+/* Sets *sum to a + b, or returns -1 if that doesn't fit in a size_t.
+ */
+static int add_size(size_t a, size_t b, size_t *sum)
+{
+    if (a > SIZE_MAX - b)
+        return -1;
+    *sum = a + b;
+    return 0;
+}
+
+/* Sets *prod to a * b, or returns -1 if that doesn't fit in a size_t.
+ */
+static int mul_size(size_t a, size_t b, size_t *prod)
+{
+    if (b != 0 && a > SIZE_MAX / b)
+        return -1;
+    *prod = a * b;
+    return 0;
+}
+
+/* Sets *end to the file offset just past the variable's data, given the
+ * number of records in the file.  Returns -1 if the header values overflow.
+ */
+static int var_end(const CDFMap *map, const CDFVar *cv, size_t *end)
+{
+    size_t nrecs = cv->isrec ? map->numrecs : 1;
+    size_t skip = 0;
+    *end = cv->begin;
+    if (nrecs == 0)
+        return 0;
+    if (cv->isrec && mul_size(nrecs - 1, map->recsize, &skip))
+        return -1;
+    if (add_size(*end, skip, end) || add_size(*end, cv->len, end))
+        return -1;
+    return 0;
+}
+
+static void skip_atts(Cursor *c)
+{
+    uint32_t tag = get_u32(c);
+    uint32_t n = get_u32(c);
+    if (tag != CDF_ATTRIBUTE && (tag != 0 || n != 0)) {
+        c->bad = 1;
+        return;
+    }
+    for (uint32_t i = 0; i < n && !c->bad; i++) {
+        skip(c, get_u32(c)); // name
+        size_t size = cdf_type_size(get_u32(c));
+        if (size == 0) {
+            c->bad = 1;
+            return;
+        }
+        skip(c, size * get_u32(c));
+    }
+}
+
+static int parse_header(CDFMap *map)
+{
+    Cursor c = { map->base, map->base + map->size, 0, 0 };
+
+    if (map->size < 4 || memcmp(c.p, "CDF", 3) ||
+        (c.p[3] != 1 && c.p[3] != 2))
+        return -1;
+    c.version = c.p[3];
+    c.p += 4;
+
+    uint32_t numrecs = get_u32(&c);
+
+    // dimension sizes, 0 for the record dimension
+    uint32_t tag = get_u32(&c);
+    uint32_t ndims = get_u32(&c);
+    if (tag != CDF_DIMENSION && (tag != 0 || ndims != 0))
+        return -1;
+    // the counts are only trusted as far as the file can hold that many
+    // entries: a dimension takes at least a name length and a size
+    if (c.bad || ndims > (size_t)(c.end - c.p) / MIN_DIM_BYTES)
+        return -1;
+    size_t *dim_sizes = NEWA(size_t, ndims + 1);
+    for (uint32_t i = 0; i < ndims && !c.bad; i++) {
+        skip(&c, get_u32(&c));
+        dim_sizes[i] = get_u32(&c);
+    }
+
+    skip_atts(&c);
+
+    tag = get_u32(&c);
+    uint32_t nvars = get_u32(&c);
+    if (c.bad || (tag != CDF_VARIABLE && (tag != 0 || nvars != 0)) ||
+        nvars > (size_t)(c.end - c.p) / MIN_VAR_BYTES || nvars > INT_MAX) {
+        free(dim_sizes);
+        return -1;
+    }
+
+    map->nvars = (int)nvars;
+    map->vars = NEWA(CDFVar, nvars + 1);
+    map->recsize = 0;
+    int nrecvars = 0;
+    size_t lastreclen = 0;
+    for (uint32_t i = 0; i < nvars && !c.bad; i++) {
+        CDFVar *var = map->vars + i;
+        skip(&c, get_u32(&c));
+
+        uint32_t nvdims = get_u32(&c);
+        size_t len = 1;
+        var->isrec = 0;
+        for (uint32_t j = 0; j < nvdims && !c.bad; j++) {
+            uint32_t dimid = get_u32(&c);
+            if (dimid >= ndims) {
+                c.bad = 1;
+                break;
+            }
+            if (dim_sizes[dimid] == 0) {
+                if (j == 0)
+                    var->isrec = 1;
+                else
+                    c.bad = 1; // only the first dimension can be unlimited
+            } else if (len > SIZE_MAX / dim_sizes[dimid]) {
+                c.bad = 1;
+            } else {
+                len *= dim_sizes[dimid];
+            }
+        }
+
+        skip_atts(&c);
+        size_t size = cdf_type_size(get_u32(&c));
+        if (size == 0 || len > SIZE_MAX / size)
+            c.bad = 1;
+        get_u32(&c); // vsize; not trusted since it saturates for huge vars
+        var->begin = (c.version == 1) ? get_u32(&c) : get_u64(&c);
+        var->len = len * size;
+
+        if (var->isrec) {
+            size_t padded;
+            nrecvars++;
+            lastreclen = var->len;
+            if (add_size(var->len, 3, &padded) ||
+                add_size(map->recsize, padded & ~(size_t)3, &map->recsize))
+                c.bad = 1;
+        }
+    }
+    free(dim_sizes);
+    if (c.bad)
+        return -1;
+
+    // a lone record variable's records aren't padded
+    if (nrecvars == 1)
+        map->recsize = lastreclen;
+
+    map->numrecs = (numrecs == CDF_STREAMING) ? 0 : numrecs;
+    if (numrecs == CDF_STREAMING && map->recsize > 0) {
+        // streamed files leave the count unset; infer it from the size
+        size_t first = (size_t)-1;
+        for (int i = 0; i < map->nvars; i++)
+            if (map->vars[i].isrec && map->vars[i].begin < first)
+                first = map->vars[i].begin;
+        if (first < map->size)
+            map->numrecs = (map->size - first) / map->recsize;
+    }
+
+    // every variable's data has to lie within the file, all records of it
+    for (int i = 0; i < map->nvars; i++) {
+        size_t end;
+        if (var_end(map, map->vars + i, &end) || end > map->size)
+            return -1;
+    }
+    return 0;
+}
+
+void sds_cdf_close(CDFMap *map)
+{
+    if (map) {
+        munmap((void *)map->base, map->size);
+        free(map->vars);
+        free(map);
+    }
+}
+
+/* Maps the given classic or 64-bit offset NetCDF file and parses its header.
+ * Returns NULL if the file can't be mapped or isn't in one of those formats,
+ * or if its header places any variable's data past the end of the file, in
+ * which case reads should go through the NetCDF library as usual.
+ *
+ * The mapping is shared with the file and sized when it's opened, so the
+ * file must not be truncated while it's open: touching a page that's no
+ * longer backed by the file raises SIGBUS (a private mapping wouldn't help,
+ * since pages not yet read still come from the file).  Appending records is
+ * fine, though they won't be seen until the file is reopened.
+ */
+CDFMap *sds_cdf_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 4) {
+        close(fd);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file referenced
+    if (base == MAP_FAILED)
+        return NULL;
+
+    CDFMap *map = NEW(CDFMap);
+    map->base = base;
+    map->size = (size_t)st.st_size;
+    map->vars = NULL;
+    if (parse_header(map)) {
+        sds_cdf_close(map);
+        return NULL;
+    }
+    return map;
+}
+
+static int host_is_little_endian(void)
+{
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one == 1;
+}
+
+/* Fills in a view of the variable's data as it sits in the mapped file.
+ * Returns 0 on success or -1 if the variable's file has no mapping (it isn't
+ * a classic-format NetCDF file) or the data lies past the end of the file.
+ */
+int sds_var_view(SDSVarInfo *var, SDSView *view)
+{
+    CDFMap *map = var->sds->cdf;
+    if (!map || var->id < 0 || var->id >= map->nvars)
+        return -1;
+
+    CDFVar *cv = map->vars + var->id;
+    view->nrecs = cv->isrec ? map->numrecs : 1;
+    view->recbytes = cv->len;
+    view->recstride = cv->isrec ? map->recsize : 0;
+    view->elsize = sds_type_size(var->type);
+    view->needswap = (view->elsize > 1) && host_is_little_endian();
+
+    size_t end;
+    if (var_end(map, cv, &end) || end > map->size)
+        return -1;
+
+    view->data = map->base + cv->begin;
+    return 0;
+}
+
+/* Walks the start/count hyperslab of var (see sds_readv()) as runs of
+ * elements contiguous in the file, in output order, calling
+ * func(arg, offset, n, index) for each run: offset is the run's byte
+ * offset in the file and index is where its first element goes in the
+ * packed output.  Returns 0, or -1 if the variable has no view (see
+ * sds_var_view()) or the hyperslab is out of bounds.
+ */
+int sds_cdf_runs(SDSVarInfo *var, const int *start, const int *count,
+                 CDFRunFunc func, void *arg)
+{
+    SDSView view;
+    if (sds_var_view(var, &view))
+        return -1;
+
+    CDFMap *map = var->sds->cdf;
+    size_t begin = (size_t)((const unsigned char *)view.data - map->base);
+    int ndims = var->ndims;
+    if (ndims < 1) {
+        func(arg, begin, 1, 0);
+        return 0;
+    }
+
+    // the record dimension's size comes from the mapping, since the file
+    // may have grown or shrunk since the header was read by NetCDF
+    size_t *sizes = ALLOCA(size_t, ndims);
+    size_t *st = ALLOCA(size_t, ndims);
+    size_t *cnt = ALLOCA(size_t, ndims);
+    for (int i = 0; i < ndims; i++) {
+        sizes[i] = var->dims[i]->size;
+        if (i == 0 && view.recstride)
+            sizes[i] = view.nrecs;
+        st[i] = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        if (st[i] > sizes[i])
+            return -1;
+        cnt[i] = (!count || count[i] < 0) ? sizes[i] - st[i] : (size_t)count[i];
+        if (cnt[i] > sizes[i] - st[i])
+            return -1;
+        if (cnt[i] == 0)
+            return 0;
+    }
+
+    // element strides within one record (or the whole fixed-size variable)
+    size_t *strides = ALLOCA(size_t, ndims);
+    strides[ndims - 1] = 1;
+    for (int i = ndims - 2; i >= 0; i--)
+        strides[i] = strides[i + 1] * sizes[i + 1];
+
+    // gather trailing dimensions into one contiguous run for as long as the
+    // dimensions after them are read whole; records are never contiguous
+    int lo = view.recstride ? 1 : 0;
+    int inner = ndims;
+    size_t run = 1;
+    while (inner > lo) {
+        inner--;
+        run *= cnt[inner];
+        if (cnt[inner] != sizes[inner])
+            break;
+    }
+
+    size_t *idx = ALLOCA(size_t, ndims);
+    for (int i = 0; i < ndims; i++)
+        idx[i] = st[i];
+
+    size_t out = 0;
+    for (;;) {
+        // for record variables, dim 0 picks the record
+        size_t off = lo ? idx[0] * view.recstride : 0;
+        size_t el = 0;
+        for (int i = lo; i < ndims; i++)
+            el += idx[i] * strides[i];
+        off += el * view.elsize;
+
+        func(arg, begin + off, run, out);
+        out += run;
+
+        // advance the odometer over the dimensions outside the run
+        int i = inner - 1;
+        while (i >= 0) {
+            if (++idx[i] < st[i] + cnt[i])
+                break;
+            idx[i] = st[i];
+            i--;
+        }
+        if (i < 0)
+            break;
+    }
+    return 0;
+}
+
+typedef struct {
+    const unsigned char *base;
+    unsigned char *dst;
+    SDSType from, to;
+    size_t tosize;
+    int swap;
+    const SDSPacking *pack;
+} CopyRuns;
+
+static void copy_run(void *arg, size_t offset, size_t n, size_t index)
+{
+    CopyRuns *c = arg;
+    unsigned char *out = c->dst + index * c->tosize;
+    if (c->pack)
+        sds_unpack(out, c->to, c->base + offset, c->from, n, c->swap, c->pack);
+    else
+        sds_convert(out, c->to, c->base + offset, c->from, n, c->swap);
+}
+
+/* Copies a hyperslab of the variable straight from the mapped file into
+ * dst, byte swapping and converting to the wanted type on the way (and
+ * unpacking, if pack isn't NULL; see sds_unpack()).  start and count work
+ * as for sds_readv().  Returns dst, or NULL if the variable has no view
+ * (see sds_var_view()) or the hyperslab is out of bounds.
+ */
+void *sds_cdf_readv(SDSVarInfo *var, void *dst, const int *start,
+                    const int *count, SDSType want, const SDSPacking *pack)
+{
+    CDFMap *map = var->sds->cdf;
+    if (!map)
+        return NULL;
+    CopyRuns c = { map->base, dst, var->type, want, sds_type_size(want),
+                   sds_type_size(var->type) > 1 && host_is_little_endian(),
+                   pack };
+    return sds_cdf_runs(var, start, count, copy_run, &c) ? NULL : dst;
+}
+
+typedef struct {
+    const unsigned char *base;
+    unsigned char *dst;
+    SDSType type;
+    size_t elsize;
+    int swap;
+    int ndims;
+    const size_t *cnt;        // hyperslab shape
+    const ptrdiff_t *strides; // element strides of each dimension in dst
+} ScatterRuns;
+
+static void scatter_run(void *arg, size_t offset, size_t n, size_t index)
+{
+    ScatterRuns *c = arg;
+    const unsigned char *in = c->base + offset;
+    int last = c->ndims - 1;
+    while (n > 0) {
+        // where the element at index goes in dst, a row at a time
+        size_t rest = index, col = 0;
+        ptrdiff_t out = 0;
+        for (int i = last; i >= 0; i--) {
+            size_t k = rest % c->cnt[i];
+            rest /= c->cnt[i];
+            if (i == last)
+                col = k;
+            out += (ptrdiff_t)k * c->strides[i];
+        }
+        size_t m = c->cnt[last] - col;
+        if (m > n)
+            m = n;
+
+        unsigned char *p = c->dst + out * (ptrdiff_t)c->elsize;
+        if (c->strides[last] == 1) {
+            sds_convert(p, c->type, in, c->type, m, c->swap);
+        } else {
+            ptrdiff_t step = c->strides[last] * (ptrdiff_t)c->elsize;
+            for (size_t j = 0; j < m; j++, p += step) {
+                memcpy(p, in + j * c->elsize, c->elsize);
+                if (c->swap)
+                    sds_byteswap(p, 1, c->elsize);
+            }
+        }
+        in += m * c->elsize;
+        index += m;
+        n -= m;
+    }
+}
+
+/* Like sds_readv_view(), but writes into dst laid out with the given
+ * element strides (see sds_readv_into()).
+ */
+void *sds_cdf_readv_strided(SDSVarInfo *var, void *dst, const int *start,
+                            const int *count, const ptrdiff_t *strides)
+{
+    SDSView view;
+    if (var->ndims < 1 || sds_var_view(var, &view))
+        return NULL;
+
+    size_t *cnt = ALLOCA(size_t, var->ndims);
+    for (int i = 0; i < var->ndims; i++) {
+        size_t size = (i == 0 && view.recstride) ? view.nrecs :
+            var->dims[i]->size;
+        size_t st = (!start || start[i] < 0) ? 0 : (size_t)start[i];
+        if (st > size)
+            return NULL;
+        cnt[i] = (!count || count[i] < 0) ? size - st : (size_t)count[i];
+    }
+    ScatterRuns c = { var->sds->cdf->base, dst, var->type, view.elsize,
+                      view.needswap, var->ndims, cnt, strides };
+    return sds_cdf_runs(var, start, count, scatter_run, &c) ? NULL : dst;
+}
+
+/* Copies a hyperslab of the variable straight from the mapped file into
+ * dst, byte swapping to native order on the way.  start and count work as
+ * for sds_readv().  Returns dst, or NULL if the variable has no view (see
+ * sds_var_view()) or the hyperslab is out of bounds.
+ */
+void *sds_readv_view(SDSVarInfo *var, void *dst,
+                     const int *start, const int *count)
+{
+    return sds_cdf_readv(var, dst, start, count, var->type, NULL);
+}
+
+/* Copies every stride[i]'th element of the variable, count[i] of them from
+ * start[i] on (see sds_readvs()), straight from the mapped file into dst,
+ * byte swapping on the way.  start, count and stride must all be given.
+ * Returns dst, or NULL if the variable has no view (see sds_var_view()) or
+ * the elements run out of bounds.
+ */
+void *sds_cdf_readvs(SDSVarInfo *var, void *dst, const int *start,
+                     const int *count, const int *stride)
+{
+    SDSView view;
+    if (var->ndims < 1 || sds_var_view(var, &view))
+        return NULL;
+
+    // bytes from one index to the next along each dimension; for record
+    // variables, dim 0 steps from record to record
+    int ndims = var->ndims, last = ndims - 1;
+    size_t *step = ALLOCA(size_t, ndims);
+    step[last] = view.elsize;
+    for (int i = last - 1; i >= 0; i--)
+        step[i] = step[i + 1] * var->dims[i + 1]->size;
+    if (view.recstride)
+        step[0] = view.recstride;
+
+    for (int i = 0; i < ndims; i++) {
+        size_t size = (i == 0 && view.recstride) ? view.nrecs :
+            var->dims[i]->size;
+        if (count[i] == 0)
+            return dst;
+        if ((size_t)start[i] + (size_t)(count[i] - 1) * stride[i] >= size)
+            return NULL;
+    }
+
+    int *idx = ALLOCA(int, ndims);
+    for (int i = 0; i < ndims; i++)
+        idx[i] = 0;
+
+    const unsigned char *base = view.data;
+    unsigned char *out = dst;
+    size_t n = (size_t)count[last];
+    size_t gap = stride[last] * step[last];
+    for (;;) {
+        size_t off = 0;
+        for (int i = 0; i < ndims; i++)
+            off += ((size_t)start[i] + (size_t)idx[i] * stride[i]) * step[i];
+
+        const unsigned char *in = base + off;
+        if (gap == view.elsize) {
+            sds_convert(out, var->type, in, var->type, n, view.needswap);
+        } else {
+            for (size_t j = 0; j < n; j++)
+                memcpy(out + j * view.elsize, in + j * gap, view.elsize);
+            if (view.needswap)
+                sds_byteswap(out, n, view.elsize);
+        }
+        out += n * view.elsize;
+
+        // advance the odometer over the outer dimensions
+        int i = last - 1;
+        while (i >= 0) {
+            if (++idx[i] < count[i])
+                break;
+            idx[i] = 0;
+            i--;
+        }
+        if (i < 0)
+            break;
+    }
+    return dst;
+}
+
+/* Copies the values at the given points of the variable (see
+ * sds_read_points()) straight from the mapped file into dst, byte swapping
+ * on the way.  The points must be in bounds.  Returns dst, or NULL if the
+ * variable has no view (see sds_var_view()) or a record is past the end of
+ * the mapping.
+ */
+void *sds_cdf_gather(SDSVarInfo *var, void *dst, const int *points,
+                     size_t npoints)
+{
+    SDSView view;
+    if (var->ndims < 1 || sds_var_view(var, &view))
+        return NULL;
+
+    int ndims = var->ndims, last = ndims - 1;
+    size_t *step = ALLOCA(size_t, ndims);
+    step[last] = view.elsize;
+    for (int i = last - 1; i >= 0; i--)
+        step[i] = step[i + 1] * var->dims[i + 1]->size;
+    if (view.recstride)
+        step[0] = view.recstride;
+
+    const unsigned char *base = view.data;
+    unsigned char *out = dst;
+    for (size_t p = 0; p < npoints; p++, points += ndims) {
+        if (view.recstride && (size_t)points[0] >= view.nrecs)
+            return NULL;
+        size_t off = 0;
+        for (int i = 0; i < ndims; i++)
+            off += (size_t)points[i] * step[i];
+        memcpy(out + p * view.elsize, base + off, view.elsize);
+    }
+    if (view.needswap)
+        sds_byteswap(dst, npoints, view.elsize);
+    return dst;
+}
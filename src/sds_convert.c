@@ -0,0 +1,762 @@
+/* sds_convert.c - Bulk byte swapping, conversion between SDSTypes and
+ *                 unpacking of scaled values.
+ *
+ * The common conversions (and byte swapping) have SSE2/SSSE3/AVX2 kernels
+ * on x86, picked at run time from what the CPU supports; everything else
+ * goes through plain C loops.
+ */
+#include "sds.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SDS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// elements converted per pass when byte swapping has to happen first
+#define SWAP_BLOCK 2048
+
+typedef void (*ConvertFunc)(void *dst, const void *src, size_t n);
+typedef void (*UnpackFunc)(void *dst, const void *src, size_t n,
+                           const SDSPacking *pack);
+
+/* --- CPU feature detection --- */
+
+enum { CPU_SSE2 = 1, CPU_SSSE3 = 2, CPU_AVX2 = 4 };
+
+static int cpu_features(void)
+{
+    static int features = -1;
+    if (features < 0) {
+        int f = 0;
+#ifdef SDS_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))  f |= CPU_SSE2;
+        if (__builtin_cpu_supports("ssse3")) f |= CPU_SSSE3;
+        if (__builtin_cpu_supports("avx2"))  f |= CPU_AVX2;
+#endif
+        features = f;
+    }
+    return features;
+}
+
+/* --- byte swapping --- */
+
+static void swap2_c(void *data, size_t n)
+{
+    uint16_t *p = data;
+    for (size_t u = 0; u < n; u++)
+        p[u] = (uint16_t)((p[u] >> 8) | (p[u] << 8));
+}
+
+static void swap4_c(void *data, size_t n)
+{
+    uint32_t *p = data;
+    for (size_t u = 0; u < n; u++) {
+        uint32_t v = p[u];
+        p[u] = (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) |
+            (v << 24);
+    }
+}
+
+static void swap8_c(void *data, size_t n)
+{
+    uint32_t *p = data;
+    for (size_t u = 0; u < n; u++, p += 2) {
+        uint32_t lo = p[0], hi = p[1];
+        swap4_c(&lo, 1);
+        swap4_c(&hi, 1);
+        p[0] = hi;
+        p[1] = lo;
+    }
+}
+
+#ifdef SDS_X86_SIMD
+__attribute__((target("sse2")))
+static void swap2_sse2(void *data, size_t n)
+{
+    char *p = data;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8, p += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)p);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)p, v);
+    }
+    swap2_c(p, n - u);
+}
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(void *data, size_t n, size_t elsize)
+{
+    __m128i mask;
+    if (elsize == 2)
+        mask = _mm_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+    else if (elsize == 4)
+        mask = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    else
+        mask = _mm_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+
+    char *p = data;
+    size_t bytes = n * elsize, b = 0;
+    for (; b + 16 <= bytes; b += 16, p += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)p);
+        _mm_storeu_si128((__m128i *)p, _mm_shuffle_epi8(v, mask));
+    }
+    n = (bytes - b) / elsize;
+    if (elsize == 2) swap2_c(p, n);
+    else if (elsize == 4) swap4_c(p, n);
+    else swap8_c(p, n);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(void *data, size_t n, size_t elsize)
+{
+    __m256i mask;
+    if (elsize == 2)
+        mask = _mm256_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14,
+                                1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+    else if (elsize == 4)
+        mask = _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    else
+        mask = _mm256_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+                                7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+
+    char *p = data;
+    size_t bytes = n * elsize, b = 0;
+    for (; b + 32 <= bytes; b += 32, p += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *)p);
+        _mm256_storeu_si256((__m256i *)p, _mm256_shuffle_epi8(v, mask));
+    }
+    swap_ssse3(p, (bytes - b) / elsize, elsize);
+}
+#endif
+
+/* Reverses the byte order of n elements of elsize bytes each, in place.
+ */
+void sds_byteswap(void *data, size_t n, size_t elsize)
+{
+    if (elsize != 2 && elsize != 4 && elsize != 8)
+        return;
+
+#ifdef SDS_X86_SIMD
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) {
+        swap_avx2(data, n, elsize);
+        return;
+    }
+    if (cpu & CPU_SSSE3) {
+        swap_ssse3(data, n, elsize);
+        return;
+    }
+    if (elsize == 2 && (cpu & CPU_SSE2)) {
+        swap2_sse2(data, n);
+        return;
+    }
+#endif
+    if (elsize == 2) swap2_c(data, n);
+    else if (elsize == 4) swap4_c(data, n);
+    else swap8_c(data, n);
+}
+
+/* --- type conversion --- */
+
+// every (source, destination) pair gets a plain C loop
+#define SRC_TYPES(X) \
+    X(i8, int8_t) X(u8, uint8_t) X(i16, int16_t) X(u16, uint16_t) \
+    X(i32, int32_t) X(u32, uint32_t) X(i64, int64_t) X(u64, uint64_t) \
+    X(f32, float) X(f64, double)
+#define DST_TYPES(X, SN, ST) \
+    X(SN, ST, i8, int8_t) X(SN, ST, u8, uint8_t) X(SN, ST, i16, int16_t) \
+    X(SN, ST, u16, uint16_t) X(SN, ST, i32, int32_t) \
+    X(SN, ST, u32, uint32_t) X(SN, ST, i64, int64_t) \
+    X(SN, ST, u64, uint64_t) X(SN, ST, f32, float) X(SN, ST, f64, double)
+
+/* Floating-point values going to an integer type are truncated like a C
+ * cast, but saturate at the type's limits and turn NaN into 0, where a
+ * cast would be undefined.  (double)HI rounds up to a power of two for
+ * 64-bit types, which v >= catches before it's cast.
+ */
+#define DEF_SATURATE(DN, DT, LO, HI) \
+    static DT sat_##DN(double v) \
+    { \
+        if (v != v) \
+            return 0; \
+        if (v <= (double)(LO)) \
+            return LO; \
+        if (v >= (double)(HI)) \
+            return HI; \
+        return (DT)v; \
+    }
+DEF_SATURATE(i8, int8_t, INT8_MIN, INT8_MAX)
+DEF_SATURATE(u8, uint8_t, 0, UINT8_MAX)
+DEF_SATURATE(i16, int16_t, INT16_MIN, INT16_MAX)
+DEF_SATURATE(u16, uint16_t, 0, UINT16_MAX)
+DEF_SATURATE(i32, int32_t, INT32_MIN, INT32_MAX)
+DEF_SATURATE(u32, uint32_t, 0, UINT32_MAX)
+DEF_SATURATE(i64, int64_t, INT64_MIN, INT64_MAX)
+DEF_SATURATE(u64, uint64_t, 0, UINT64_MAX)
+// never called; they keep DEF_CONVERT() uniform
+static float sat_f32(double v) { return (float)v; }
+static double sat_f64(double v) { return v; }
+
+#define IS_FLOAT_TYPE(T) ((T)0.5 != 0)
+
+#define DEF_CONVERT(SN, ST, DN, DT) \
+    static void conv_##SN##_##DN(void *dst, const void *src, size_t n) \
+    { \
+        const ST *s = src; \
+        DT *d = dst; \
+        if (IS_FLOAT_TYPE(ST) && !IS_FLOAT_TYPE(DT)) { \
+            for (size_t u = 0; u < n; u++) \
+                d[u] = sat_##DN((double)s[u]); \
+        } else { \
+            for (size_t u = 0; u < n; u++) \
+                d[u] = (DT)s[u]; \
+        } \
+    }
+#define DEF_CONVERTS_FROM(SN, ST) DST_TYPES(DEF_CONVERT, SN, ST)
+SRC_TYPES(DEF_CONVERTS_FROM)
+
+// indexed by SDSType - SDS_I8 for SDS_I8 .. SDS_DOUBLE
+#define CONVERT_ENTRY(SN, ST, DN, DT) conv_##SN##_##DN,
+#define CONVERT_ROW(SN, ST) { DST_TYPES(CONVERT_ENTRY, SN, ST) },
+static const ConvertFunc c_converts[10][10] = {
+    SRC_TYPES(CONVERT_ROW)
+};
+
+#ifdef SDS_X86_SIMD
+__attribute__((target("sse2")))
+static void conv_i16_f32_sse2(void *dst, const void *src, size_t n)
+{
+    const int16_t *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        // sign extend by unpacking into the high halves and shifting down
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(d + u, _mm_cvtepi32_ps(lo));
+        _mm_storeu_ps(d + u + 4, _mm_cvtepi32_ps(hi));
+    }
+    conv_i16_f32(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_i16_f64_sse2(void *dst, const void *src, size_t n)
+{
+    const int16_t *s = src;
+    double *d = dst;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_pd(d + u, _mm_cvtepi32_pd(lo));
+        _mm_storeu_pd(d + u + 2, _mm_cvtepi32_pd(_mm_srli_si128(lo, 8)));
+        _mm_storeu_pd(d + u + 4, _mm_cvtepi32_pd(hi));
+        _mm_storeu_pd(d + u + 6, _mm_cvtepi32_pd(_mm_srli_si128(hi, 8)));
+    }
+    conv_i16_f64(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_u16_f32_sse2(void *dst, const void *src, size_t n)
+{
+    const uint16_t *s = src;
+    float *d = dst;
+    const __m128i zero = _mm_setzero_si128();
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        _mm_storeu_ps(d + u, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_ps(d + u + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+    }
+    conv_u16_f32(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_u8_f32_sse2(void *dst, const void *src, size_t n)
+{
+    const uint8_t *s = src;
+    float *d = dst;
+    const __m128i zero = _mm_setzero_si128();
+    size_t u = 0;
+    for (; u + 16 <= n; u += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_ps(d + u,      _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(d + u + 4,  _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(d + u + 8,  _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(d + u + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+    conv_u8_f32(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_i32_f32_sse2(void *dst, const void *src, size_t n)
+{
+    const int32_t *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        _mm_storeu_ps(d + u, _mm_cvtepi32_ps(v));
+    }
+    conv_i32_f32(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_i32_f64_sse2(void *dst, const void *src, size_t n)
+{
+    const int32_t *s = src;
+    double *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        _mm_storeu_pd(d + u, _mm_cvtepi32_pd(v));
+        _mm_storeu_pd(d + u + 2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+    }
+    conv_i32_f64(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_f32_f64_sse2(void *dst, const void *src, size_t n)
+{
+    const float *s = src;
+    double *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4) {
+        __m128 v = _mm_loadu_ps(s + u);
+        _mm_storeu_pd(d + u, _mm_cvtps_pd(v));
+        _mm_storeu_pd(d + u + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+    conv_f32_f64(d + u, s + u, n - u);
+}
+
+__attribute__((target("sse2")))
+static void conv_f64_f32_sse2(void *dst, const void *src, size_t n)
+{
+    const double *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(s + u));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(s + u + 2));
+        _mm_storeu_ps(d + u, _mm_movelh_ps(lo, hi));
+    }
+    conv_f64_f32(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_i16_f32_avx2(void *dst, const void *src, size_t n)
+{
+    const int16_t *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 16 <= n; u += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(s + u));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(s + u + 8));
+        _mm256_storeu_ps(d + u, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(lo)));
+        _mm256_storeu_ps(d + u + 8, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(hi)));
+    }
+    conv_i16_f32_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_i16_f64_avx2(void *dst, const void *src, size_t n)
+{
+    const int16_t *s = src;
+    double *d = dst;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        __m256i i = _mm256_cvtepi16_epi32(v);
+        _mm256_storeu_pd(d + u, _mm256_cvtepi32_pd(_mm256_castsi256_si128(i)));
+        _mm256_storeu_pd(d + u + 4,
+                         _mm256_cvtepi32_pd(_mm256_extracti128_si256(i, 1)));
+    }
+    conv_i16_f64_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_u16_f32_avx2(void *dst, const void *src, size_t n)
+{
+    const uint16_t *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        _mm256_storeu_ps(d + u, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+    }
+    conv_u16_f32_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_u8_f32_avx2(void *dst, const void *src, size_t n)
+{
+    const uint8_t *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadl_epi64((const __m128i *)(s + u));
+        _mm256_storeu_ps(d + u, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+    }
+    conv_u8_f32_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_i32_f32_avx2(void *dst, const void *src, size_t n)
+{
+    const int32_t *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + u));
+        _mm256_storeu_ps(d + u, _mm256_cvtepi32_ps(v));
+    }
+    conv_i32_f32_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_i32_f64_avx2(void *dst, const void *src, size_t n)
+{
+    const int32_t *s = src;
+    double *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        _mm256_storeu_pd(d + u, _mm256_cvtepi32_pd(v));
+    }
+    conv_i32_f64_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_f32_f64_avx2(void *dst, const void *src, size_t n)
+{
+    const float *s = src;
+    double *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4)
+        _mm256_storeu_pd(d + u, _mm256_cvtps_pd(_mm_loadu_ps(s + u)));
+    conv_f32_f64_sse2(d + u, s + u, n - u);
+}
+
+__attribute__((target("avx2")))
+static void conv_f64_f32_avx2(void *dst, const void *src, size_t n)
+{
+    const double *s = src;
+    float *d = dst;
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4)
+        _mm_storeu_ps(d + u, _mm256_cvtpd_ps(_mm256_loadu_pd(s + u)));
+    conv_f64_f32_sse2(d + u, s + u, n - u);
+}
+#endif
+
+static int type_slot(SDSType t)
+{
+    if (t == SDS_STRING)
+        return SDS_U8 - SDS_I8; // characters convert as unsigned bytes
+    if (t < SDS_I8 || t > SDS_DOUBLE) {
+        fprintf(stderr, "can't convert values of type %s\n",
+                sds_type_names[t]);
+        abort();
+    }
+    return t - SDS_I8;
+}
+
+static ConvertFunc find_convert(SDSType from, SDSType to)
+{
+#ifdef SDS_X86_SIMD
+    int cpu = cpu_features();
+    int avx2 = cpu & CPU_AVX2, sse2 = cpu & CPU_SSE2;
+    if (sse2) {
+        switch (from) {
+        case SDS_I16:
+            if (to == SDS_FLOAT)
+                return avx2 ? conv_i16_f32_avx2 : conv_i16_f32_sse2;
+            if (to == SDS_DOUBLE)
+                return avx2 ? conv_i16_f64_avx2 : conv_i16_f64_sse2;
+            break;
+        case SDS_U16:
+            if (to == SDS_FLOAT)
+                return avx2 ? conv_u16_f32_avx2 : conv_u16_f32_sse2;
+            break;
+        case SDS_U8:
+            if (to == SDS_FLOAT)
+                return avx2 ? conv_u8_f32_avx2 : conv_u8_f32_sse2;
+            break;
+        case SDS_I32:
+            if (to == SDS_FLOAT)
+                return avx2 ? conv_i32_f32_avx2 : conv_i32_f32_sse2;
+            if (to == SDS_DOUBLE)
+                return avx2 ? conv_i32_f64_avx2 : conv_i32_f64_sse2;
+            break;
+        case SDS_FLOAT:
+            if (to == SDS_DOUBLE)
+                return avx2 ? conv_f32_f64_avx2 : conv_f32_f64_sse2;
+            break;
+        case SDS_DOUBLE:
+            if (to == SDS_FLOAT)
+                return avx2 ? conv_f64_f32_avx2 : conv_f64_f32_sse2;
+            break;
+        default:
+            break;
+        }
+    }
+#endif
+    return c_converts[type_slot(from)][type_slot(to)];
+}
+
+/* Converts n values of type from at src into values of type to at dst.
+ * The buffers must not overlap.  Any numeric SDSType (or SDS_STRING, as
+ * unsigned bytes) can be converted to any other.  Integers out of the
+ * destination's range wrap around modulo its size, as C casts do with
+ * GCC and every other two's complement compiler.  Floating-point values
+ * going to an integer type are truncated toward zero and saturate at the
+ * type's limits, with NaN becoming 0 (a C cast is undefined for those).
+ * Doubles too large for a float become infinities.
+ *
+ * swap - nonzero if the source values are in the opposite byte order from
+ *        this host, e.g. when reading straight from a big-endian file.
+ */
+void sds_convert(void *dst, SDSType to, const void *src, SDSType from,
+                 size_t n, int swap)
+{
+    size_t from_size = sds_type_size(from);
+
+    if (from == to || (from_size == 1 && sds_type_size(to) == 1 &&
+                       (from == SDS_STRING || to == SDS_STRING))) {
+        memcpy(dst, src, n * from_size);
+        if (swap)
+            sds_byteswap(dst, n, from_size);
+        return;
+    }
+
+    ConvertFunc convert = find_convert(from, to);
+    if (!swap || from_size == 1) {
+        convert(dst, src, n);
+        return;
+    }
+
+    // swap a cache-sized block at a time, then convert it
+    size_t to_size = sds_type_size(to);
+    double tmp[SWAP_BLOCK]; // big and aligned enough for any element type
+    const char *s = src;
+    char *d = dst;
+    while (n > 0) {
+        size_t m = (n < SWAP_BLOCK) ? n : SWAP_BLOCK;
+        memcpy(tmp, s, m * from_size);
+        sds_byteswap(tmp, m, from_size);
+        convert(d, tmp, m);
+        s += m * from_size;
+        d += m * to_size;
+        n -= m;
+    }
+}
+
+/* --- unpacking --- */
+
+/* Plain C unpacking loops from every source type to float and double.
+ * Float output is computed in float arithmetic so the SIMD kernels below
+ * give identical results.
+ */
+#define DEF_UNPACK(SN, ST, DN, DT) \
+    static void unpack_##SN##_##DN(void *dst, const void *src, size_t n, \
+                                   const SDSPacking *pack) \
+    { \
+        const ST *s = src; \
+        DT *d = dst; \
+        const DT scale = (DT)pack->scale, offset = (DT)pack->offset; \
+        for (size_t u = 0; u < n; u++) { \
+            double v = (double)s[u]; \
+            if ((pack->has_fill && v == pack->fill) || \
+                (pack->has_missing && v == pack->missing)) \
+                d[u] = (DT)NAN; \
+            else \
+                d[u] = (DT)s[u] * scale + offset; \
+        } \
+    }
+#define DEF_UNPACKS_FROM(SN, ST) \
+    DEF_UNPACK(SN, ST, f32, float) DEF_UNPACK(SN, ST, f64, double)
+SRC_TYPES(DEF_UNPACKS_FROM)
+
+#define UNPACK_ROW(SN, ST) { unpack_##SN##_f32, unpack_##SN##_f64 },
+static const UnpackFunc c_unpacks[10][2] = {
+    SRC_TYPES(UNPACK_ROW)
+};
+
+#ifdef SDS_X86_SIMD
+/* Sets *v to the fill or missing value as an int16 and returns all ones if
+ * packed int16 values can equal it, else sets *v to 0 and returns 0.
+ */
+static int16_t i16_mask_value(int has, double value, int16_t *v)
+{
+    if (has && value >= INT16_MIN && value <= INT16_MAX &&
+        value == (double)(int16_t)value) {
+        *v = (int16_t)value;
+        return -1;
+    }
+    *v = 0;
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static void unpack_i16_f32_sse2(void *dst, const void *src, size_t n,
+                                const SDSPacking *pack)
+{
+    const int16_t *s = src;
+    float *d = dst;
+    int16_t fv, mv;
+    int16_t fon = i16_mask_value(pack->has_fill, pack->fill, &fv);
+    int16_t mon = i16_mask_value(pack->has_missing, pack->missing, &mv);
+    const __m128i fill = _mm_set1_epi16(fv), fill_on = _mm_set1_epi16(fon);
+    const __m128i miss = _mm_set1_epi16(mv), miss_on = _mm_set1_epi16(mon);
+    const __m128 scale = _mm_set1_ps((float)pack->scale);
+    const __m128 offset = _mm_set1_ps((float)pack->offset);
+    const __m128 nan = _mm_set1_ps(NAN);
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        __m128i bad = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi16(v, fill), fill_on),
+            _mm_and_si128(_mm_cmpeq_epi16(v, miss), miss_on));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        __m128 blo = _mm_castsi128_ps(_mm_unpacklo_epi16(bad, bad));
+        __m128 bhi = _mm_castsi128_ps(_mm_unpackhi_epi16(bad, bad));
+        __m128 flo = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), scale), offset);
+        __m128 fhi = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), scale), offset);
+        flo = _mm_or_ps(_mm_andnot_ps(blo, flo), _mm_and_ps(blo, nan));
+        fhi = _mm_or_ps(_mm_andnot_ps(bhi, fhi), _mm_and_ps(bhi, nan));
+        _mm_storeu_ps(d + u, flo);
+        _mm_storeu_ps(d + u + 4, fhi);
+    }
+    unpack_i16_f32(d + u, s + u, n - u, pack);
+}
+
+__attribute__((target("avx2")))
+static void unpack_i16_f32_avx2(void *dst, const void *src, size_t n,
+                                const SDSPacking *pack)
+{
+    const int16_t *s = src;
+    float *d = dst;
+    int16_t fv, mv;
+    int16_t fon = i16_mask_value(pack->has_fill, pack->fill, &fv);
+    int16_t mon = i16_mask_value(pack->has_missing, pack->missing, &mv);
+    const __m128i fill = _mm_set1_epi16(fv), fill_on = _mm_set1_epi16(fon);
+    const __m128i miss = _mm_set1_epi16(mv), miss_on = _mm_set1_epi16(mon);
+    const __m256 scale = _mm256_set1_ps((float)pack->scale);
+    const __m256 offset = _mm256_set1_ps((float)pack->offset);
+    const __m256 nan = _mm256_set1_ps(NAN);
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        __m128i bad = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi16(v, fill), fill_on),
+            _mm_and_si128(_mm_cmpeq_epi16(v, miss), miss_on));
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        f = _mm256_add_ps(_mm256_mul_ps(f, scale), offset);
+        __m256 mask = _mm256_castsi256_ps(_mm256_cvtepi16_epi32(bad));
+        _mm256_storeu_ps(d + u, _mm256_blendv_ps(f, nan, mask));
+    }
+    unpack_i16_f32_sse2(d + u, s + u, n - u, pack);
+}
+
+__attribute__((target("avx2")))
+static void unpack_i16_f64_avx2(void *dst, const void *src, size_t n,
+                                const SDSPacking *pack)
+{
+    const int16_t *s = src;
+    double *d = dst;
+    int16_t fv, mv;
+    int16_t fon = i16_mask_value(pack->has_fill, pack->fill, &fv);
+    int16_t mon = i16_mask_value(pack->has_missing, pack->missing, &mv);
+    const __m128i fill = _mm_set1_epi16(fv), fill_on = _mm_set1_epi16(fon);
+    const __m128i miss = _mm_set1_epi16(mv), miss_on = _mm_set1_epi16(mon);
+    const __m256d scale = _mm256_set1_pd(pack->scale);
+    const __m256d offset = _mm256_set1_pd(pack->offset);
+    const __m256d nan = _mm256_set1_pd(NAN);
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + u));
+        __m128i bad = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi16(v, fill), fill_on),
+            _mm_and_si128(_mm_cmpeq_epi16(v, miss), miss_on));
+        __m256i i = _mm256_cvtepi16_epi32(v);
+        __m256i b = _mm256_cvtepi16_epi32(bad);
+        __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(i));
+        __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(i, 1));
+        __m256d blo = _mm256_castsi256_pd(
+            _mm256_cvtepi32_epi64(_mm256_castsi256_si128(b)));
+        __m256d bhi = _mm256_castsi256_pd(
+            _mm256_cvtepi32_epi64(_mm256_extracti128_si256(b, 1)));
+        lo = _mm256_add_pd(_mm256_mul_pd(lo, scale), offset);
+        hi = _mm256_add_pd(_mm256_mul_pd(hi, scale), offset);
+        _mm256_storeu_pd(d + u, _mm256_blendv_pd(lo, nan, blo));
+        _mm256_storeu_pd(d + u + 4, _mm256_blendv_pd(hi, nan, bhi));
+    }
+    unpack_i16_f64(d + u, s + u, n - u, pack);
+}
+#endif
+
+static UnpackFunc find_unpack(SDSType from, SDSType to)
+{
+    if (to != SDS_FLOAT && to != SDS_DOUBLE) {
+        fprintf(stderr, "can't unpack values to type %s\n",
+                sds_type_names[to]);
+        abort();
+    }
+#ifdef SDS_X86_SIMD
+    int cpu = cpu_features();
+    if (from == SDS_I16 && to == SDS_FLOAT) {
+        if (cpu & CPU_AVX2)
+            return unpack_i16_f32_avx2;
+        if (cpu & CPU_SSE2)
+            return unpack_i16_f32_sse2;
+    }
+    if (from == SDS_I16 && to == SDS_DOUBLE && (cpu & CPU_AVX2))
+        return unpack_i16_f64_avx2;
+#endif
+    return c_unpacks[type_slot(from)][to == SDS_DOUBLE];
+}
+
+/* Unpacks n values of type from at src into float or double values at dst:
+ * each value becomes value * scale + offset, or NaN if it equals the fill
+ * or missing value.  The conversion, scaling and fill masking are done in
+ * one pass.  The buffers must not overlap.
+ *
+ * to   - SDS_FLOAT or SDS_DOUBLE.
+ * swap - nonzero if the source values are in the opposite byte order from
+ *        this host.
+ */
+void sds_unpack(void *dst, SDSType to, const void *src, SDSType from,
+                size_t n, int swap, const SDSPacking *pack)
+{
+    UnpackFunc unpack = find_unpack(from, to);
+    size_t from_size = sds_type_size(from);
+    if (!swap || from_size == 1) {
+        unpack(dst, src, n, pack);
+        return;
+    }
+
+    size_t to_size = sds_type_size(to);
+    double tmp[SWAP_BLOCK];
+    const char *s = src;
+    char *d = dst;
+    while (n > 0) {
+        size_t m = (n < SWAP_BLOCK) ? n : SWAP_BLOCK;
+        memcpy(tmp, s, m * from_size);
+        sds_byteswap(tmp, m, from_size);
+        unpack(d, tmp, m, pack);
+        s += m * from_size;
+        d += m * to_size;
+        n -= m;
+    }
+}
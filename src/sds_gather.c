@@ -0,0 +1,226 @@
+/* sds_gather.c - Reads of scattered points of a variable, such as the grid
+ *                cells of thousands of stations.
+ *
+ * Reading each point with its own sds_readv() pays for a library call and
+ * buffer setup per value.  sds_read_points() instead splits the points up
+ * into clusters whose bounding hyperslabs don't hold too many values
+ * nobody asked for, reads each hyperslab once and hands the values back in
+ * the order the points were given.
+ * Classic NetCDF files need none of that: each value is copied straight
+ * out of the file mapping.
+ */
+#include "sds.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+// classic format mapping from sds_cdf.c
+void *sds_cdf_gather(SDSVarInfo *var, void *dst, const int *points,
+                     size_t npoints);
+
+// largest hyperslab read for one box of points
+#define MAX_BOX_BYTES (64 << 20)
+
+typedef struct {
+    SDSVarInfo *var;
+    const int *points;
+    char *dst;
+    size_t elsize;
+    double waste;   // most unwanted values read per point
+    double max_vol; // most values read at once
+    void *buf;
+    SDSGatherStats stats;
+} Gather;
+
+/* Reads the box lo..hi and copies out the values of the n points listed
+ * in idx, all inside it.
+ */
+static void read_box(Gather *g, const int *lo, const int *hi,
+                     const size_t *idx, size_t n)
+{
+    int ndims = g->var->ndims;
+    int *count = ALLOCA(int, ndims);
+    size_t *stride = ALLOCA(size_t, ndims);
+    size_t vol = 1;
+    for (int i = ndims - 1; i >= 0; i--) {
+        count[i] = hi[i] - lo[i] + 1;
+        stride[i] = vol;
+        vol *= (size_t)count[i];
+    }
+
+    const char *data = sds_readv(g->var, &g->buf, lo, count);
+    for (size_t k = 0; k < n; k++) {
+        const int *p = g->points + idx[k] * ndims;
+        size_t off = 0;
+        for (int i = 0; i < ndims; i++)
+            off += (size_t)(p[i] - lo[i]) * stride[i];
+        memcpy(g->dst + idx[k] * g->elsize, data + off * g->elsize,
+               g->elsize);
+    }
+    g->stats.reads++;
+    g->stats.elements += vol;
+}
+
+/* Picks the dimension to split the box lo..hi at the middle of: the one
+ * leaving the halves' bounding boxes the least volume between them, so
+ * splitting drops the most empty space, with near ties going to the widest.
+ * Dimensions the points fill, like the time axis of station series, are
+ * so left whole.
+ */
+static int split_dim(Gather *g, const size_t *idx, size_t n, const int *lo,
+                     const int *hi)
+{
+    int ndims = g->var->ndims;
+    int *box = ALLOCA(int, 4 * ndims); // low and high of each half
+    double *vols = ALLOCA(double, ndims);
+    double least = 0;
+    for (int d = 0; d < ndims; d++) {
+        vols[d] = -1;
+        if (hi[d] == lo[d])
+            continue;
+        int mid = lo[d] + (hi[d] - lo[d] + 1) / 2;
+        for (int i = 0; i < ndims; i++) {
+            box[i] = box[2 * ndims + i] = INT_MAX;
+            box[ndims + i] = box[3 * ndims + i] = INT_MIN;
+        }
+        for (size_t k = 0; k < n; k++) {
+            const int *p = g->points + idx[k] * ndims;
+            int *half = box + ((p[d] < mid) ? 0 : 2 * ndims);
+            for (int i = 0; i < ndims; i++) {
+                if (p[i] < half[i])
+                    half[i] = p[i];
+                if (p[i] > half[ndims + i])
+                    half[ndims + i] = p[i];
+            }
+        }
+        double vl = 1, vr = 1;
+        for (int i = 0; i < ndims; i++) {
+            vl *= (double)(box[ndims + i] - box[i] + 1);
+            vr *= (double)(box[3 * ndims + i] - box[2 * ndims + i] + 1);
+        }
+        vols[d] = vl + vr;
+        if (least == 0 || vols[d] < least)
+            least = vols[d];
+    }
+
+    int best = -1;
+    for (int d = 0; d < ndims; d++)
+        if (vols[d] >= 0 && vols[d] <= least * 1.0625 &&
+            (best < 0 || hi[d] - lo[d] > hi[best] - lo[best]))
+            best = d;
+    return best;
+}
+
+/* Reads the n points listed in idx with their bounding box if that isn't
+ * too wasteful or big; otherwise splits them in two along a dimension (see
+ * split_dim()) and tries each half in turn.  Clusters of points so end up
+ * read with boxes around them, and lone points on their own.
+ */
+static void coalesce(Gather *g, size_t *idx, size_t n)
+{
+    int ndims = g->var->ndims;
+    int *lo = ALLOCA(int, ndims);
+    int *hi = ALLOCA(int, ndims);
+    memcpy(lo, g->points + idx[0] * ndims, sizeof(int) * ndims);
+    memcpy(hi, lo, sizeof(int) * ndims);
+    for (size_t k = 1; k < n; k++) {
+        const int *p = g->points + idx[k] * ndims;
+        for (int i = 0; i < ndims; i++) {
+            if (p[i] < lo[i])
+                lo[i] = p[i];
+            if (p[i] > hi[i])
+                hi[i] = p[i];
+        }
+    }
+
+    double vol = 1;
+    for (int i = 0; i < ndims; i++)
+        vol *= (double)(hi[i] - lo[i] + 1);
+    if (vol <= (double)n * (1 + g->waste) && vol <= g->max_vol) {
+        read_box(g, lo, hi, idx, n);
+        return;
+    }
+
+    // both halves get a point, since lo and hi both come from one; vol > n
+    // means the points aren't all the same, so some extent is over 1
+    int d = split_dim(g, idx, n, lo, hi);
+    int mid = lo[d] + (hi[d] - lo[d] + 1) / 2;
+    size_t i = 0, j = n;
+    while (i < j) {
+        if (g->points[idx[i] * ndims + d] < mid) {
+            i++;
+        } else {
+            size_t t = idx[i];
+            idx[i] = idx[--j];
+            idx[j] = t;
+        }
+    }
+    coalesce(g, idx, i);
+    coalesce(g, idx + i, n - i);
+}
+
+/* Reads the values of the variable at npoints points into dst, in the
+ * order given.  points holds npoints index tuples of var->ndims each, one
+ * after the other.  Points close together in the file are read with one
+ * hyperslab covering them all, as long as it holds no more than waste
+ * values that weren't asked for per point in it; so 0 only reads boxes
+ * filled entirely with points, and larger values trade reading unwanted
+ * values for fewer, bigger reads.  Classic NetCDF files are read straight
+ * from the file mapping instead.  Aborts, after printing why, if a point
+ * is out of bounds.  Returns dst.
+ *
+ * stats - if not NULL, receives the number of reads made and the number of
+ *         values they read.
+ */
+void *sds_read_points(SDSVarInfo *var, const int *points, size_t npoints,
+                      void *dst, double waste, SDSGatherStats *stats)
+{
+    SDSGatherStats st = { 0, 0 };
+    int ndims = var->ndims;
+    size_t elsize = sds_type_size(var->type);
+
+    if (npoints == 0 || ndims < 1) {
+        if (npoints > 0) { // a scalar; every point is the one value
+            sds_readv_into(var, NULL, NULL, dst, NULL);
+            for (size_t k = 1; k < npoints; k++)
+                memcpy((char *)dst + k * elsize, dst, elsize);
+            st.reads = st.elements = 1;
+        }
+        if (stats)
+            *stats = st;
+        return dst;
+    }
+
+    for (size_t k = 0; k < npoints; k++) {
+        const int *p = points + k * ndims;
+        for (int i = 0; i < ndims; i++)
+            if (p[i] < 0 || (size_t)p[i] >= var->dims[i]->size) {
+                fprintf(stderr, "point %u of %s is out of bounds in dimension %i (%i)\n",
+                        (unsigned)k, var->name, i, p[i]);
+                abort();
+            }
+    }
+
+    if (var->sds->cdf && sds_cdf_gather(var, dst, points, npoints)) {
+        if (stats) {
+            st.elements = npoints;
+            *stats = st;
+        }
+        return dst;
+    }
+
+    Gather g = { var, points, dst, elsize, waste < 0 ? 0 : waste,
+                 (double)MAX_BOX_BYTES / elsize, NULL, { 0, 0 } };
+    size_t *idx = sds_alloc(sizeof(size_t) * npoints);
+    for (size_t k = 0; k < npoints; k++)
+        idx[k] = k;
+    coalesce(&g, idx, npoints);
+    free(idx);
+    if (g.buf)
+        sds_buffer_free(g.buf);
+    st = g.stats;
+
+    if (stats)
+        *stats = st;
+    return dst;
+}
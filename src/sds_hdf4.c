@@ -24,26 +24,34 @@ static void hdf_error(const char *filename, int status,
 #define CHECK_HDF_ERROR(filename, status) \
     if ((status) == FAIL) hdf_error(filename,status,__FILE__,__LINE__)
 
+// variables kept open per file unless sds_set_max_open() says otherwise
+#define DEFAULT_MAX_OPEN 16
+
+// an open SDS access id
+typedef struct H4Access {
+    struct H4Access *prev, *next; // most recently used first
+    int sds_index;
+    int32 sds_id;
+} H4Access;
+
+// per-file state, in SDSInfo.backend
+typedef struct {
+    H4Access *head, *tail;
+    int nopen;
+} H4File;
+
 typedef struct {
     void (*free)(void *);
     const char *path; // don't free; a copy from SDSInfo
     void *data;
     size_t size;
-    int sds_index;
-    int sds_id;
 } H4Buffer;
 
 static void h4buffer_free(H4Buffer *buf)
 {
     assert(buf->free == (void (*)(void *))h4buffer_free);
 
-    if (buf->data) {
-        free(buf->data);
-    }
-    if (buf->sds_id != -1) {
-        int status = SDendaccess(buf->sds_id);
-        CHECK_HDF_ERROR(buf->path, status);
-    }
+    sds_pool_put(buf->data, buf->size);
     free(buf);
 }
 
@@ -54,17 +62,12 @@ static H4Buffer *h4buffer_create(SDSInfo *sds)
     buf->path = sds->path;
     buf->data = NULL;
     buf->size = 0;
-    buf->sds_index = -1;
-    buf->sds_id = -1;
     return buf;
 }
 
 static void h4buffer_ensure(H4Buffer *buf, size_t cap_needed)
 {
-    if (buf->size < cap_needed) {
-        buf->data = sds_realloc(buf->data, cap_needed);
-        buf->size = cap_needed;
-    }
+    sds_pool_ensure(&buf->data, &buf->size, cap_needed);
 }
 
 static H4Buffer *prep_read_buffer(SDSVarInfo *var, void **bufp)
@@ -75,20 +78,64 @@ static H4Buffer *prep_read_buffer(SDSVarInfo *var, void **bufp)
     } else {
         *((H4Buffer **)bufp) = buf = h4buffer_create(var->sds);
     }
+    return buf;
+}
 
-    if (buf->sds_index != var->id) {
-        if (buf->sds_id != -1) { // close other var
-            int status = SDendaccess(buf->sds_id);
-            CHECK_HDF_ERROR(buf->path, status);
-        }
+static void unlink_access(H4File *file, H4Access *a)
+{
+    if (a->prev)
+        a->prev->next = a->next;
+    else
+        file->head = a->next;
+    if (a->next)
+        a->next->prev = a->prev;
+    else
+        file->tail = a->prev;
+}
+
+static void end_access(SDSInfo *sds, H4Access *a)
+{
+    H4File *file = sds->backend;
+    unlink_access(file, a);
+    file->nopen--;
+    int status = SDendaccess(a->sds_id);
+    CHECK_HDF_ERROR(sds->path, status);
+    free(a);
+}
+
+/* Returns an access id for the variable from the file's LRU of open ones,
+ * opening it (and closing the least recently used, if there are too many)
+ * if it isn't open already.  Must be called with the I/O lock held.
+ */
+static int32 get_access(SDSInfo *sds, int sds_index)
+{
+    H4File *file = sds->backend;
+    H4Access *a = file->head;
+    while (a && a->sds_index != sds_index)
+        a = a->next;
+
+    if (a) {
+        unlink_access(file, a);
+    } else {
+        int max_open = (sds->max_open > 0) ? sds->max_open : DEFAULT_MAX_OPEN;
+        while (file->tail && file->nopen >= max_open)
+            end_access(sds, file->tail);
 
-        // open this var
-        buf->sds_id = SDselect(var->sds->id, var->id);
-        CHECK_HDF_ERROR(var->sds->path, buf->sds_id);
-        buf->sds_index = var->id;
+        a = NEW(H4Access);
+        a->sds_index = sds_index;
+        a->sds_id = SDselect(sds->id, sds_index);
+        CHECK_HDF_ERROR(sds->path, a->sds_id);
+        file->nopen++;
     }
 
-    return buf;
+    a->prev = NULL;
+    a->next = file->head;
+    if (file->head)
+        file->head->prev = a;
+    else
+        file->tail = a;
+    file->head = a;
+    return a->sds_id;
 }
 
 static void *var_readv(SDSVarInfo *var, void **bufp,
@@ -113,28 +160,89 @@ static void *var_readv(SDSVarInfo *var, void **bufp,
     H4Buffer *buf = prep_read_buffer(var, bufp);
     h4buffer_ensure(buf, bufsize);
 
-    int status = SDreaddata(buf->sds_id, hstart, NULL, hcount, buf->data);
+    int status = SDreaddata(get_access(var->sds, var->id), hstart, NULL, hcount, buf->data);
+    CHECK_HDF_ERROR(var->sds->path, status);
+
+    return buf->data;
+}
+
+/* SDreaddata() can only fill packed arrays, so strided destinations are
+ * left to sds_readv_into() to piece together.
+ */
+static int var_readv_into(SDSVarInfo *var, void *dst, const int *start,
+                          const int *count, const ptrdiff_t *strides)
+{
+    if (strides)
+        return -1;
+
+    int32 hstart[H4_MAX_VAR_DIMS], hcount[H4_MAX_VAR_DIMS];
+    for (int i = 0; i < var->ndims; i++) {
+        hstart[i] = (!start || start[i] < 0) ? 0 : (int32)start[i];
+        if (!count || count[i] < 0)
+            hcount[i] = (int32)var->dims[i]->size - hstart[i];
+        else
+            hcount[i] = (int32)count[i];
+    }
+
+    int status = SDreaddata(get_access(var->sds, var->id), hstart, NULL, hcount, dst);
     CHECK_HDF_ERROR(var->sds->path, status);
+    return 0;
+}
+
+/* Reads every stride[i]'th element, which SDreaddata() picks out itself.
+ * sds_readvs() fills in start, count and stride.
+ */
+static void *var_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                        const int *count, const int *stride)
+{
+    int32 hstart[H4_MAX_VAR_DIMS], hcount[H4_MAX_VAR_DIMS];
+    int32 hstride[H4_MAX_VAR_DIMS];
+    size_t bufsize = sds_type_size(var->type);
+    for (int i = 0; i < var->ndims; i++) {
+        hstart[i] = (int32)start[i];
+        hcount[i] = (int32)count[i];
+        hstride[i] = (int32)stride[i];
+        bufsize *= (size_t)hcount[i];
+    }
+
+    H4Buffer *buf = prep_read_buffer(var, bufp);
+    h4buffer_ensure(buf, bufsize);
+    if (bufsize == 0)
+        return buf->data;
 
+    int status = SDreaddata(get_access(var->sds, var->id), hstart, hstride, hcount, buf->data);
+    CHECK_HDF_ERROR(var->sds->path, status);
     return buf->data;
 }
 
 static void var_writev(SDSVarInfo *var, void *data, const int *index)
 {
-	fprintf(stderr, "hdf4 variable writing not implemented yet!\n");
-	abort();
+    fprintf(stderr, "%s was opened for reading; hdf4 files can only be written by write_as_h4_sds()\n",
+            var->sds->path);
+    abort();
 }
 
 static void close_hdf(SDSInfo *sds)
 {
+    H4File *file = sds->backend;
+    while (file->head)
+        end_access(sds, file->head);
+
     int status = SDend(sds->id);
     CHECK_HDF_ERROR(sds->path, status);
 }
 
+static void *load_att(SDSInfo *sds, SDSAttInfo *att);
+static int load_compress(SDSVarInfo *var);
+
 static struct SDS_Funcs h4_funcs = {
     var_readv,
+    var_readv_into,
+    var_readvs,
 	var_writev,
-    close_hdf
+    close_hdf,
+    load_att,
+    load_compress
 };
 
 static SDSType h4_to_sdstype(int32 h4type)
@@ -173,8 +281,30 @@ static size_t h4_typesize(int32 h4type)
     return 0;
 }
 
-static SDSAttInfo *read_attributes(const char *path, int obj_id, int natts)
+/* Reads the values of attribute index of obj_id into a buffer from the
+ * arena.  nvalues is one more than in the file for strings, to hold a
+ * terminating NUL.
+ */
+static void *read_att_data(SDSArena *arena, const char *path, int obj_id,
+                           int index, SDSType type, size_t typesize,
+                           size_t nvalues)
+{
+    void *data = sds_arena_alloc(arena, typesize * nvalues);
+    int status = SDreadattr(obj_id, index, data);
+    CHECK_HDF_ERROR(path, status);
+    if (type == SDS_STRING)
+        ((char *)data)[nvalues - 1] = '\0';
+    return data;
+}
+
+/* Reads the attributes of obj_id, which is the file's sd_id for global
+ * attributes, or else the access id of the variable with the given index.
+ */
+static SDSAttInfo *read_attributes(SDSInfo *sds, int obj_id, int sds_index,
+                                   int natts, int lazy)
 {
+    SDSArena *arena = sds->arena;
+    const char *path = sds->path;
     SDSAttInfo *att, *att_list = NULL;
     char buf[H4_MAX_NC_NAME + 1];
     int32 type, nvalues;
@@ -191,23 +321,22 @@ static SDSAttInfo *read_attributes(const char *path, int obj_id, int natts)
             !strncasecmp("archivedmetadata", buf, 16))
             continue; // skip these useless attributes
 
-        // read attribute data
         size_t typesize = h4_typesize(type);
         if (type == DFNT_CHAR8 || type == DFNT_UCHAR8)
             nvalues++;
-        void *data = sds_alloc(typesize * nvalues);
-        status = SDreadattr(obj_id, i, data);
-        CHECK_HDF_ERROR(path, status);
-        if (type == DFNT_CHAR8 || type == DFNT_UCHAR8)
-            ((char *)data)[nvalues - 1] = '\0';
 
         // stick attribute in struct in list
-        att = NEW(SDSAttInfo);
-        att->name = sds_strdup(buf);
+        att = ANEW0(arena, SDSAttInfo);
+        att->name = sds_arena_strdup(arena, buf);
         att->type = h4_to_sdstype(type);
         att->count = (size_t)nvalues;
         att->bytes = typesize;
-        att->data.v = data;
+        att->data.v = lazy ? NULL :
+            read_att_data(arena, path, obj_id, i, att->type, typesize,
+                          att->count);
+        att->sds = lazy ? sds : NULL;
+        att->objid = sds_index;
+        att->index = i;
 
         att->next = att_list;
         att_list = att;
@@ -263,7 +392,7 @@ static SDSDimInfo **read_dimensions(SDSInfo *sds, int sds_id, int rank,
     int i, status;
     int32 size, type, natts;
 
-    SDSDimInfo **dims = NEWA(SDSDimInfo *, rank);
+    SDSDimInfo **dims = ANEWA(sds->arena, SDSDimInfo *, rank);
 
     for (i = 0; i < rank; i++) {
         int dim_id = SDgetdimid(sds_id, i);
@@ -275,8 +404,8 @@ static SDSDimInfo **read_dimensions(SDSInfo *sds, int sds_id, int rank,
 
         SDSDimInfo *dim = dim_by_id_or_same_fake(sds->dims, dim_id, size, buf);
         if (!dim) {
-            dim = NEW0(SDSDimInfo);
-            dim->name = sds_strdup(buf);
+            dim = ANEW0(sds->arena, SDSDimInfo);
+            dim->name = sds_arena_strdup(sds->arena, buf);
             dim->size = dim_sizes[i];
             dim->isunlim = (size == 0);
             dim->id = dim_id;
@@ -293,10 +422,42 @@ static SDSDimInfo **read_dimensions(SDSInfo *sds, int sds_id, int rank,
     return dims;
 }
 
+static int comp_level(const char *path, int32 sds_id)
+{
+    comp_coder_t comp_type;
+    comp_info c_info;
+    int status = SDgetcompinfo(sds_id, &comp_type, &c_info);
+    CHECK_HDF_ERROR(path, status);
+    switch (comp_type) {
+    case COMP_CODE_NONE:
+        return 0;
+    case COMP_CODE_DEFLATE:
+        return c_info.deflate.level;
+    default:
+        // any other compression method is 'worth' 1 imo *trollface*
+        // better than claiming 0 to the user
+        return 1;
+    }
+}
+
+static void *load_att(SDSInfo *sds, SDSAttInfo *att)
+{
+    int obj_id = (att->objid < 0) ? sds->id : get_access(sds, att->objid);
+    return read_att_data(sds->arena, sds->path, obj_id, att->index,
+                         att->type, att->bytes, att->count);
+}
+
+static int load_compress(SDSVarInfo *var)
+{
+    return comp_level(var->sds->path, get_access(var->sds, var->id));
+}
+
 /* Opens an HDF file and reads all its SDS metadata, returning an SDSInfo
- * structure containing this metadata.  Returns NULL on error.
+ * structure containing this metadata.  Returns NULL on error.  If lazy is
+ * set, attribute values and compression levels are left to be read on
+ * first use (see sds_open_lazy()).
  */
-SDSInfo *sds_h4_open(const char *path)
+SDSInfo *sds_h4_open(const char *path, int lazy)
 {
     int i, status;
 
@@ -308,13 +469,16 @@ SDSInfo *sds_h4_open(const char *path)
     status = SDfileinfo(sd_id, &n_datasets, &n_global_atts);
     CHECK_HDF_ERROR(path, status);
 
-    SDSInfo *sds = NEW0(SDSInfo);
-    sds->path = sds_strdup(path);
+    SDSArena *arena = sds_arena_create();
+    SDSInfo *sds = ANEW0(arena, SDSInfo);
+    sds->arena = arena;
+    sds->path = sds_arena_strdup(arena, path);
     sds->type = SDS_HDF4_FILE;
     sds->id = sd_id;
+    sds->backend = ANEW0(arena, H4File);
 
     // read global attributes
-    sds->gatts = read_attributes(path, sd_id, n_global_atts);
+    sds->gatts = read_attributes(sds, sd_id, -1, n_global_atts, lazy);
 
     // read variables ('datasets')
     for (i = 0; i < n_datasets; i++) {
@@ -327,32 +491,15 @@ SDSInfo *sds_h4_open(const char *path)
         status = SDgetinfo(sds_id, buf, &rank, dim_sizes, &type, &natts);
         CHECK_HDF_ERROR(path, status);
 
-        SDSVarInfo *var = NEW0(SDSVarInfo);
-        var->name = sds_strdup(buf);
+        SDSVarInfo *var = ANEW0(arena, SDSVarInfo);
+        var->name = sds_arena_strdup(arena, buf);
         var->type = h4_to_sdstype(type);
         var->iscoord = SDiscoordvar(sds_id);
         var->ndims = rank;
         var->dims = read_dimensions(sds, sds_id, rank, dim_sizes);
-        var->atts = read_attributes(path, sds_id, natts);
+        var->atts = read_attributes(sds, sds_id, i, natts, lazy);
         var->id = i; // actually the sds_index
-
-        comp_coder_t comp_type;
-        comp_info c_info;
-        status = SDgetcompinfo(sds_id, &comp_type, &c_info);
-        CHECK_HDF_ERROR(path, status);
-        switch (comp_type) {
-        case COMP_CODE_NONE:
-            var->compress = 0;
-            break;
-        case COMP_CODE_DEFLATE:
-            var->compress = c_info.deflate.level;
-            break;
-        default:
-            // any other compression method is 'worth' 1 imo *trollface*
-            // better than claiming 0 to the user
-            var->compress = 1;
-            break;
-        }
+        var->compress = lazy ? -1 : comp_level(path, sds_id);
 
         var->sds = sds;
 
@@ -368,3 +515,621 @@ SDSInfo *sds_h4_open(const char *path)
     sds->funcs = &h4_funcs;
     return sds;
 }
+
+/* Whether every variable in the sidecar's metadata names a dataset of the
+ * type and shape the library gives it, so reads stay within its data.
+ */
+static int shapes_match(SDSInfo *sds)
+{
+    int32 n_datasets, n_global_atts;
+    if (SDfileinfo(sds->id, &n_datasets, &n_global_atts) == FAIL)
+        return 0;
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next) {
+        if (var->id < 0 || var->id >= n_datasets)
+            return 0;
+        int32 sds_id = SDselect(sds->id, var->id);
+        if (sds_id == FAIL)
+            return 0;
+
+        char buf[_H4_MAX_SDS_NAME + 1];
+        int32 rank, dim_sizes[H4_MAX_VAR_DIMS], type, natts;
+        int ok = SDgetinfo(sds_id, buf, &rank, dim_sizes, &type,
+                           &natts) != FAIL &&
+            h4_to_sdstype(type) == var->type && rank == var->ndims;
+        for (int i = 0; ok && i < rank; i++)
+            ok = ((size_t)dim_sizes[i] == var->dims[i]->size);
+        SDendaccess(sds_id);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+/* Opens the file behind metadata rebuilt from a sidecar (see sds_meta.c)
+ * for reading, without asking the library for the metadata again beyond
+ * the variables' shapes.  Returns -1 if those don't match, so the file's
+ * metadata is read from it instead.
+ */
+int sds_h4_attach(SDSInfo *sds)
+{
+    sds->id = SDstart(sds->path, DFACC_READ);
+    CHECK_HDF_ERROR(sds->path, sds->id);
+    if (!shapes_match(sds)) {
+        SDend(sds->id);
+        sds->id = -1;
+        return -1;
+    }
+    sds->backend = ANEW0(sds->arena, H4File);
+    sds->funcs = &h4_funcs;
+    return 0;
+}
+
+/* Writing.  Every dataset is created chunked, and var_writev() gathers the
+ * values it's handed into buffers of a whole chunk each, passing a chunk on
+ * to the library once all its values have been written.  Writing a slice
+ * at a time so turns into one large, aligned write (and one compression)
+ * per chunk instead of a call per slice that rewrites each chunk it cuts.
+ */
+
+// chunks are cut down to about this many bytes
+#define CHUNK_BYTES (1 << 20)
+
+// partly written chunks held before they're all written out as they are
+#define MAX_BUFFERED ((size_t)256 << 20)
+
+// a chunk being filled in
+typedef struct {
+    char *data;
+    size_t filled; // values written to it so far
+} H4Chunk;
+
+// stands in for chunks already in the file
+static H4Chunk flushed_chunk;
+#define FLUSHED (&flushed_chunk)
+
+typedef struct {
+    SDSVarInfo *var;
+    int32 sds_id;    // -1 for a dimension scale
+    int32 dim_id;    // the dimension a scale is written to when closing
+    int32 h4type;
+    int32 lens[H4_MAX_VAR_DIMS];     // chunk shape
+    size_t nchunks[H4_MAX_VAR_DIMS]; // chunks along each dimension
+    size_t chunk_bytes;
+    H4Chunk **chunks; // by chunk number, NULL for ones not started
+    size_t nslots;
+    char *fill;       // one value, NULL for zeros
+    char *scale;      // values of a dimension scale
+    size_t nscale;
+} H4WriteVar;
+
+// per-file state of a file being written, in SDSInfo.backend
+typedef struct {
+    H4WriteVar *vars; // by SDSVarInfo.id
+    int nvars;
+    size_t buffered;  // bytes of partly written chunks
+} H4Writer;
+
+static int32 sds_to_h4type(const char *path, SDSType type)
+{
+    switch (type) {
+    case SDS_I8:     return DFNT_INT8;
+    case SDS_U8:     return DFNT_UINT8;
+    case SDS_I16:    return DFNT_INT16;
+    case SDS_U16:    return DFNT_UINT16;
+    case SDS_I32:    return DFNT_INT32;
+    case SDS_U32:    return DFNT_UINT32;
+    case SDS_FLOAT:  return DFNT_FLOAT32;
+    case SDS_DOUBLE: return DFNT_FLOAT64;
+    case SDS_STRING: return DFNT_CHAR8;
+    default:
+        fprintf(stderr, "%s: hdf4 has no type for %s values\n", path,
+                sds_type_names[type]);
+        abort();
+    }
+    return 0;
+}
+
+static void write_atts(const char *path, int32 obj_id, SDSAttInfo *att)
+{
+    while (att) {
+        int32 count = (int32)att->count;
+        // read_att_data() adds the terminating NUL back
+        if (att->type == SDS_STRING && count > 1 &&
+            att->data.str[count - 1] == '\0')
+            count--;
+        int status = SDsetattr(obj_id, att->name,
+                               sds_to_h4type(path, att->type), count,
+                               att->data.v);
+        CHECK_HDF_ERROR(path, status);
+        att = att->next;
+    }
+}
+
+/* Picks the chunk shape: one record along an unlimited dimension, and the
+ * rest of the variable with the leading dimensions halved until a chunk is
+ * no bigger than CHUNK_BYTES, so rows stay whole as long as they fit.
+ */
+static size_t choose_chunks(SDSVarInfo *var, int32 *lens)
+{
+    size_t bytes = sds_type_size(var->type);
+    for (int i = 0; i < var->ndims; i++) {
+        size_t size = var->dims[i]->size;
+        lens[i] = (var->dims[i]->isunlim || size < 1) ? 1 : (int32)size;
+        bytes *= (size_t)lens[i];
+    }
+    for (int i = 0; i < var->ndims && bytes > CHUNK_BYTES; i++) {
+        while (lens[i] > 1 && bytes > CHUNK_BYTES) {
+            int32 half = (lens[i] + 1) / 2;
+            bytes = bytes / (size_t)lens[i] * (size_t)half;
+            lens[i] = half;
+        }
+    }
+    return bytes;
+}
+
+static void create_dataset(int32 sd_id, const char *path, H4WriteVar *wv)
+{
+    SDSVarInfo *var = wv->var;
+    int32 sizes[H4_MAX_VAR_DIMS];
+    if (var->ndims < 1 || var->ndims > H4_MAX_VAR_DIMS) {
+        fprintf(stderr, "%s: hdf4 can't hold %s with %i dimensions\n", path,
+                var->name, var->ndims);
+        abort();
+    }
+    for (int i = 0; i < var->ndims; i++) {
+        if (var->dims[i]->isunlim && i > 0) {
+            fprintf(stderr, "%s: hdf4 only allows the first dimension of %s to be unlimited\n",
+                    path, var->name);
+            abort();
+        }
+        sizes[i] = var->dims[i]->isunlim ? SD_UNLIMITED :
+                                           (int32)var->dims[i]->size;
+    }
+
+    wv->sds_id = SDcreate(sd_id, var->name, wv->h4type, var->ndims, sizes);
+    CHECK_HDF_ERROR(path, wv->sds_id);
+
+    for (int i = 0; i < var->ndims; i++) {
+        int32 dim_id = SDgetdimid(wv->sds_id, i);
+        CHECK_HDF_ERROR(path, dim_id);
+        int status = SDsetdimname(dim_id, var->dims[i]->name);
+        CHECK_HDF_ERROR(path, status);
+    }
+
+    wv->chunk_bytes = choose_chunks(var, wv->lens);
+    for (int i = 0; i < var->ndims; i++) {
+        size_t size = var->dims[i]->size;
+        wv->nchunks[i] = (size + (size_t)wv->lens[i] - 1) / (size_t)wv->lens[i];
+    }
+
+    HDF_CHUNK_DEF def;
+    memset(&def, 0, sizeof(def));
+    int32 flags = HDF_CHUNK;
+    if (var->compress > 0) {
+        memcpy(def.comp.chunk_lengths, wv->lens, sizeof(int32) * var->ndims);
+        def.comp.comp_type = COMP_CODE_DEFLATE;
+        def.comp.cinfo.deflate.level = (var->compress > 9) ? 9 : var->compress;
+        flags = HDF_CHUNK | HDF_COMP;
+    } else {
+        memcpy(def.chunk_lengths, wv->lens, sizeof(int32) * var->ndims);
+    }
+    int status = SDsetchunk(wv->sds_id, def, flags);
+    CHECK_HDF_ERROR(path, status);
+
+    write_atts(path, wv->sds_id, var->atts);
+}
+
+/* Copies the box lo..hi (exclusive) between two C-order arrays of the
+ * variable's, of shapes dshape and sshape and starting at dlo and slo.
+ */
+static void copy_box(char *dst, const size_t *dlo, const size_t *dshape,
+                     const char *src, const size_t *slo, const size_t *sshape,
+                     const size_t *lo, const size_t *hi, int ndims,
+                     size_t elsize)
+{
+    int last = ndims - 1;
+    size_t *idx = ALLOCA(size_t, ndims);
+    memcpy(idx, lo, sizeof(size_t) * ndims);
+    size_t row = (hi[last] - lo[last]) * elsize;
+    for (;;) {
+        size_t doff = 0, soff = 0;
+        for (int i = 0; i < ndims; i++) {
+            doff = doff * dshape[i] + (idx[i] - dlo[i]);
+            soff = soff * sshape[i] + (idx[i] - slo[i]);
+        }
+        memcpy(dst + doff * elsize, src + soff * elsize, row);
+
+        int i = last - 1;
+        for (; i >= 0; i--) {
+            if (++idx[i] < hi[i])
+                break;
+            idx[i] = lo[i];
+        }
+        if (i < 0)
+            break;
+    }
+}
+
+/* Returns the slot of chunk c, making room for it first; chunks along an
+ * unlimited first dimension keep coming as records are written.
+ */
+static H4Chunk **chunk_slot(H4WriteVar *wv, const size_t *c)
+{
+    size_t k = c[0];
+    for (int i = 1; i < wv->var->ndims; i++)
+        k = k * wv->nchunks[i] + c[i];
+    if (k >= wv->nslots) {
+        size_t n = (wv->nslots * 2 > k + 1) ? wv->nslots * 2 : k + 1;
+        wv->chunks = sds_realloc(wv->chunks, sizeof(H4Chunk *) * n);
+        memset(wv->chunks + wv->nslots, 0,
+               sizeof(H4Chunk *) * (n - wv->nslots));
+        wv->nslots = n;
+    }
+    return wv->chunks + k;
+}
+
+// the extent of chunk c inside the variable, along each dimension
+static size_t chunk_extent(H4WriteVar *wv, const size_t *c, size_t *ext)
+{
+    size_t vol = 1;
+    for (int i = 0; i < wv->var->ndims; i++) {
+        SDSDimInfo *dim = wv->var->dims[i];
+        size_t origin = c[i] * (size_t)wv->lens[i];
+        ext[i] = (size_t)wv->lens[i];
+        if (!dim->isunlim && origin + ext[i] > dim->size)
+            ext[i] = dim->size - origin;
+        vol *= ext[i];
+    }
+    return vol;
+}
+
+static H4Chunk *new_chunk(H4Writer *w, H4WriteVar *wv)
+{
+    H4Chunk *ch = NEW(H4Chunk);
+    ch->data = sds_alloc(wv->chunk_bytes);
+    ch->filled = 0;
+    size_t elsize = sds_type_size(wv->var->type);
+    if (wv->fill) {
+        for (size_t off = 0; off < wv->chunk_bytes; off += elsize)
+            memcpy(ch->data + off, wv->fill, elsize);
+    } else {
+        memset(ch->data, 0, wv->chunk_bytes);
+    }
+    w->buffered += wv->chunk_bytes;
+    return ch;
+}
+
+/* Writes chunk c from its buffer and marks it written.  Datasets with an
+ * unlimited dimension get the chunk's region through SDwritedata() instead
+ * of SDwritechunk(), which leaves the record count alone.
+ */
+static void flush_chunk(SDSInfo *sds, H4WriteVar *wv, const size_t *c,
+                        H4Chunk **slot)
+{
+    H4Writer *w = sds->backend;
+    H4Chunk *ch = *slot;
+    int ndims = wv->var->ndims;
+    int status;
+
+    if (!wv->var->dims[0]->isunlim) {
+        int32 origin[H4_MAX_VAR_DIMS];
+        for (int i = 0; i < ndims; i++)
+            origin[i] = (int32)c[i];
+        status = SDwritechunk(wv->sds_id, origin, ch->data);
+        CHECK_HDF_ERROR(sds->path, status);
+    } else {
+        size_t lo[H4_MAX_VAR_DIMS], hi[H4_MAX_VAR_DIMS];
+        size_t ext[H4_MAX_VAR_DIMS], shape[H4_MAX_VAR_DIMS];
+        int32 start[H4_MAX_VAR_DIMS], edges[H4_MAX_VAR_DIMS];
+        size_t vol = chunk_extent(wv, c, ext);
+        int whole = 1;
+        for (int i = 0; i < ndims; i++) {
+            shape[i] = (size_t)wv->lens[i];
+            lo[i] = c[i] * shape[i];
+            hi[i] = lo[i] + ext[i];
+            start[i] = (int32)lo[i];
+            edges[i] = (int32)ext[i];
+            whole = whole && ext[i] == shape[i];
+        }
+        char *data = ch->data;
+        if (!whole) { // a chunk hanging off the end; pack the part inside
+            size_t elsize = sds_type_size(wv->var->type);
+            data = sds_alloc(vol * elsize);
+            copy_box(data, lo, ext, ch->data, lo, shape, lo, hi, ndims,
+                     elsize);
+        }
+        status = SDwritedata(wv->sds_id, start, NULL, edges, data);
+        CHECK_HDF_ERROR(sds->path, status);
+        if (!whole)
+            free(data);
+    }
+
+    w->buffered -= wv->chunk_bytes;
+    free(ch->data);
+    free(ch);
+    *slot = FLUSHED;
+}
+
+// writes out every partly written chunk as it is
+static void flush_chunks(SDSInfo *sds)
+{
+    H4Writer *w = sds->backend;
+    size_t c[H4_MAX_VAR_DIMS];
+    for (int v = 0; v < w->nvars; v++) {
+        H4WriteVar *wv = w->vars + v;
+        for (size_t k = 0; k < wv->nslots; k++) {
+            if (!wv->chunks[k] || wv->chunks[k] == FLUSHED)
+                continue;
+            size_t rest = k;
+            for (int i = wv->var->ndims - 1; i > 0; i--) {
+                c[i] = rest % wv->nchunks[i];
+                rest /= wv->nchunks[i];
+            }
+            c[0] = rest;
+            flush_chunk(sds, wv, c, wv->chunks + k);
+        }
+    }
+}
+
+// keeps the values of a dimension scale until the file is closed
+static void write_scale(H4WriteVar *wv, const void *data, size_t start,
+                        size_t count)
+{
+    size_t elsize = sds_type_size(wv->var->type);
+    if (start + count > wv->nscale) {
+        size_t n = start + count;
+        wv->scale = sds_realloc(wv->scale, n * elsize);
+        memset(wv->scale + wv->nscale * elsize, 0,
+               (n - wv->nscale) * elsize);
+        wv->nscale = n;
+    }
+    memcpy(wv->scale + start * elsize, data, count * elsize);
+}
+
+/* Writes one value (index[i] >= 0) or all of them (index[i] < 0) along each
+ * dimension.  Values go into chunk buffers, and each chunk is written once
+ * it's complete; chunks already written are updated in place.
+ */
+static void write_var(SDSVarInfo *var, void *data, const int *index)
+{
+    SDSInfo *sds = var->sds;
+    H4Writer *w = sds->backend;
+    H4WriteVar *wv = w->vars + var->id;
+    int ndims = var->ndims;
+    size_t elsize = sds_type_size(var->type);
+
+    size_t st[H4_MAX_VAR_DIMS], cnt[H4_MAX_VAR_DIMS], hi[H4_MAX_VAR_DIMS];
+    for (int i = 0; i < ndims; i++) {
+        SDSDimInfo *dim = var->dims[i];
+        if (index[i] < 0) {
+            st[i] = 0;
+            cnt[i] = dim->size;
+        } else {
+            st[i] = (size_t)index[i];
+            cnt[i] = 1;
+        }
+        if (cnt[i] == 0)
+            return;
+        hi[i] = st[i] + cnt[i];
+        if (!dim->isunlim && hi[i] > dim->size) {
+            fprintf(stderr, "index %i of %s is out of bounds in dimension %i\n",
+                    index[i], var->name, i);
+            abort();
+        }
+    }
+
+    if (wv->sds_id < 0) {
+        write_scale(wv, data, st[0], cnt[0]);
+        return;
+    }
+
+    size_t c_lo[H4_MAX_VAR_DIMS], c_hi[H4_MAX_VAR_DIMS], c[H4_MAX_VAR_DIMS];
+    size_t origin[H4_MAX_VAR_DIMS], shape[H4_MAX_VAR_DIMS];
+    size_t lo[H4_MAX_VAR_DIMS], bhi[H4_MAX_VAR_DIMS], ext[H4_MAX_VAR_DIMS];
+    for (int i = 0; i < ndims; i++) {
+        shape[i] = (size_t)wv->lens[i];
+        c_lo[i] = c[i] = st[i] / shape[i];
+        c_hi[i] = (hi[i] - 1) / shape[i];
+    }
+
+    for (;;) {
+        size_t vol = 1;
+        for (int i = 0; i < ndims; i++) {
+            origin[i] = c[i] * shape[i];
+            lo[i] = (st[i] > origin[i]) ? st[i] : origin[i];
+            bhi[i] = (hi[i] < origin[i] + shape[i]) ? hi[i] :
+                                                      origin[i] + shape[i];
+            vol *= bhi[i] - lo[i];
+        }
+
+        H4Chunk **slot = chunk_slot(wv, c);
+        if (*slot == FLUSHED) { // too late to buffer; write the part
+            int32 hstart[H4_MAX_VAR_DIMS], hcount[H4_MAX_VAR_DIMS];
+            size_t bcnt[H4_MAX_VAR_DIMS];
+            for (int i = 0; i < ndims; i++) {
+                bcnt[i] = bhi[i] - lo[i];
+                hstart[i] = (int32)lo[i];
+                hcount[i] = (int32)bcnt[i];
+            }
+            char *part = sds_alloc(vol * elsize);
+            copy_box(part, lo, bcnt, data, st, cnt, lo, bhi, ndims, elsize);
+            int status = SDwritedata(wv->sds_id, hstart, NULL, hcount, part);
+            CHECK_HDF_ERROR(sds->path, status);
+            free(part);
+        } else {
+            if (!*slot)
+                *slot = new_chunk(w, wv);
+            copy_box((*slot)->data, origin, shape, data, st, cnt, lo, bhi,
+                     ndims, elsize);
+            (*slot)->filled += vol;
+            if ((*slot)->filled >= chunk_extent(wv, c, ext))
+                flush_chunk(sds, wv, c, slot);
+        }
+
+        int i = ndims - 1;
+        for (; i >= 0; i--) {
+            if (++c[i] <= c_hi[i])
+                break;
+            c[i] = c_lo[i];
+        }
+        if (i < 0)
+            break;
+    }
+
+    if (w->buffered > MAX_BUFFERED)
+        flush_chunks(sds);
+}
+
+static void close_h4_write(SDSInfo *sds)
+{
+    H4Writer *w = sds->backend;
+    int status;
+
+    flush_chunks(sds);
+    for (int v = 0; v < w->nvars; v++) {
+        H4WriteVar *wv = w->vars + v;
+        if (wv->sds_id < 0) {
+            if (wv->nscale > 0) {
+                status = SDsetdimscale(wv->dim_id, (int32)wv->nscale,
+                                       wv->h4type, wv->scale);
+                CHECK_HDF_ERROR(sds->path, status);
+            }
+        } else {
+            status = SDendaccess(wv->sds_id);
+            CHECK_HDF_ERROR(sds->path, status);
+        }
+        free(wv->chunks);
+        free(wv->fill);
+        free(wv->scale);
+    }
+    free(w->vars);
+    free(w);
+    sds->backend = NULL;
+
+    status = SDend(sds->id);
+    CHECK_HDF_ERROR(sds->path, status);
+}
+
+static void *write_only_readv(SDSVarInfo *var, void **bufp,
+                              const int *start, const int *count)
+{
+    fprintf(stderr, "%s is open for writing; hdf4 files being written can't be read\n",
+            var->sds->path);
+    abort();
+    return NULL;
+}
+
+static void *write_only_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                               const int *count, const int *stride)
+{
+    return write_only_readv(var, bufp, start, count);
+}
+
+static struct SDS_Funcs h4_write_funcs = {
+    write_only_readv,
+    NULL,
+    write_only_readvs,
+    write_var,
+    close_h4_write,
+    NULL,
+    NULL
+};
+
+/* Creates the HDF4 file path from sds, which must be a new SDSInfo from
+ * create_sds() or a copy of one, and leaves it open for sds_writev() and
+ * sds_write().  Every dataset is chunked (see choose_chunks()), compressed
+ * with deflate if var->compress is set, and written a whole chunk at a time
+ * as its values come in, so writes can come a slice or value at a time
+ * without each one going to the file on its own.  Partly written chunks
+ * are written out with the rest of their values filled in by sds_close(),
+ * which must be called to finish the file.
+ *
+ * One-dimensional coordinate variables become the scales of their
+ * dimensions where some other variable uses the dimension.  Only the first
+ * dimension of a variable may be unlimited, and 64-bit integers and
+ * scalars can't be stored.
+ */
+void write_as_h4_sds(const char *path, SDSInfo *sds)
+{
+    // make sure we're not starting from an open file
+    if (sds->type != SDS_UNKNOWN_FILE || sds->funcs != NULL) {
+        fprintf(stderr, "Attempt to create hdf4 file %s from uncopied SDSInfo\n",
+                path);
+        abort();
+    }
+
+    sds_io_lock();
+    int32 sd_id = SDstart(path, DFACC_CREATE);
+    CHECK_HDF_ERROR(path, sd_id);
+    // every chunk gets written whole, so filling them first is wasted
+    int status = SDsetfillmode(sd_id, SD_NOFILL);
+    CHECK_HDF_ERROR(path, status);
+
+    H4Writer *w = NEW0(H4Writer);
+    SDSVarInfo *var = sds->vars;
+    while (var) {
+        w->nvars++;
+        var = var->next;
+    }
+    w->vars = (H4WriteVar *)sds_alloc0(sizeof(H4WriteVar) * (w->nvars + 1));
+
+    int v = 0;
+    for (var = sds->vars; var; var = var->next, v++) {
+        H4WriteVar *wv = w->vars + v;
+        wv->var = var;
+        wv->sds_id = -1;
+        wv->h4type = sds_to_h4type(path, var->type);
+        var->id = v;
+        var->sds = sds;
+
+        SDSAttInfo *fill = sds_att_by_name(var->atts, "_FillValue");
+        if (fill && fill->type == var->type && fill->count > 0) {
+            size_t elsize = sds_type_size(var->type);
+            wv->fill = sds_alloc(elsize);
+            memcpy(wv->fill, fill->data.v, elsize);
+        }
+    }
+
+    // datasets first, so coordinate variables can find their dimensions
+    for (v = 0; v < w->nvars; v++) {
+        var = w->vars[v].var;
+        if (!(var->iscoord && var->ndims == 1))
+            create_dataset(sd_id, path, w->vars + v);
+    }
+    for (v = 0; v < w->nvars; v++) {
+        H4WriteVar *wv = w->vars + v;
+        var = wv->var;
+        if (!(var->iscoord && var->ndims == 1))
+            continue;
+
+        wv->dim_id = -1;
+        for (int u = 0; u < w->nvars && wv->dim_id < 0; u++) {
+            H4WriteVar *user = w->vars + u;
+            if (user->sds_id < 0 || user == wv)
+                continue;
+            for (int i = 0; i < user->var->ndims; i++) {
+                if (user->var->dims[i] == var->dims[0]) {
+                    wv->dim_id = SDgetdimid(user->sds_id, i);
+                    CHECK_HDF_ERROR(path, wv->dim_id);
+                    break;
+                }
+            }
+        }
+        if (wv->dim_id < 0) {
+            create_dataset(sd_id, path, wv);
+        } else {
+            wv->nscale = var->dims[0]->size;
+            wv->scale = sds_alloc0(wv->nscale * sds_type_size(var->type));
+            write_atts(path, wv->dim_id, var->atts);
+        }
+    }
+
+    write_atts(path, sd_id, sds->gatts);
+
+    sds->path = sds_arena_strdup(sds->arena, path);
+    sds->type = SDS_HDF4_FILE;
+    sds->id = sd_id;
+    sds->backend = w;
+    sds->funcs = &h4_write_funcs;
+    sds_io_unlock();
+}
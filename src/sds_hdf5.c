@@ -0,0 +1,807 @@
+/* sds_hdf5.c - HDF5 implementation of SDS interface.
+ *
+ * Groups are flattened: a dataset or attribute in a subgroup gets the
+ * group's path as a prefix, e.g. "Geolocation/lat".  Dimensions come from
+ * attached dimension scales where a file has them; otherwise each distinct
+ * dataset extent becomes a "phony_dim_N" dimension, shared between datasets
+ * of the same size as HDF4's fakeDims are.
+ */
+#include "sds.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+// chunk cache bounds; HDF5's own default is a 1 MB cache
+#define MIN_CHUNK_CACHE (1 << 20)
+#define MAX_CHUNK_CACHE (256 << 20)
+
+// don't follow hard links deeper than this, in case of group cycles
+#define MAX_GROUP_DEPTH 32
+
+// longest dimension scale path kept
+#define MAX_SCALE_NAME 1024
+
+static void h5_error(const char *filename, const char *sourcefile, int lineno)
+{
+    fprintf(stderr, "%s:%i: ", sourcefile, lineno);
+    fprintf(stderr, "Error reading %s\n", filename);
+    exit(2);
+}
+
+#define CHECK_H5_ERROR(filename, status) \
+    if ((status) < 0) h5_error(filename,__FILE__,__LINE__)
+
+typedef struct {
+    hid_t fid;
+    int nphony; // phony dimensions made so far
+    void *into; // H5Buffer kept open for var_readv_into(), or NULL
+} H5File;
+
+typedef struct {
+    void (*free)(void *);
+    const char *path; // don't free; a copy from SDSInfo
+    void *data;
+    size_t size;
+    SDSVarInfo *var; // variable the dataset is open for
+    hid_t dset;
+    int rank;
+    hsize_t chunk[H5S_MAX_RANK]; // chunk dims; all 0 if not chunked
+    size_t cache_bytes; // chunk cache size the dataset was opened with
+} H5Buffer;
+
+static void close_dataset(H5Buffer *buf)
+{
+    if (buf->dset >= 0) {
+        herr_t status = H5Dclose(buf->dset);
+        CHECK_H5_ERROR(buf->path, status);
+        buf->dset = -1;
+    }
+    buf->var = NULL;
+}
+
+static void h5buffer_free(H5Buffer *buf)
+{
+    assert(buf->free == (void (*)(void *))h5buffer_free);
+
+    close_dataset(buf);
+    sds_pool_put(buf->data, buf->size);
+    free(buf);
+}
+
+static H5Buffer *h5buffer_create(SDSInfo *sds)
+{
+    H5Buffer *buf = NEW(H5Buffer);
+    buf->free = (void (*)(void *))h5buffer_free;
+    buf->path = sds->path;
+    buf->data = NULL;
+    buf->size = 0;
+    buf->var = NULL;
+    buf->dset = -1;
+    buf->rank = 0;
+    buf->cache_bytes = 0;
+    return buf;
+}
+
+static void h5buffer_ensure(H5Buffer *buf, size_t cap_needed)
+{
+    sds_pool_ensure(&buf->data, &buf->size, cap_needed);
+}
+
+/* Opens the variable's dataset with a chunk cache of the given size (or
+ * HDF5's default if 0) and reads its chunk layout.
+ */
+static void open_dataset(H5Buffer *buf, SDSVarInfo *var, size_t cache_bytes)
+{
+    H5File *file = var->sds->backend;
+
+    close_dataset(buf);
+
+    hid_t dapl = H5Pcreate(H5P_DATASET_ACCESS);
+    CHECK_H5_ERROR(buf->path, dapl);
+    if (cache_bytes > 0) {
+        // HDF5 suggests about 100 hash slots per chunk that fits; the
+        // caller sizes the cache so a chunk averages at least 64 KB
+        size_t nslots = cache_bytes / (64 << 10) * 100 + 1;
+        herr_t status = H5Pset_chunk_cache(dapl, nslots, cache_bytes, 1.0);
+        CHECK_H5_ERROR(buf->path, status);
+    }
+    buf->dset = H5Dopen2(file->fid, var->name, dapl);
+    CHECK_H5_ERROR(buf->path, buf->dset);
+    H5Pclose(dapl);
+
+    buf->var = var;
+    buf->rank = var->ndims;
+    buf->cache_bytes = cache_bytes;
+    memset(buf->chunk, 0, sizeof(buf->chunk));
+
+    hid_t dcpl = H5Dget_create_plist(buf->dset);
+    CHECK_H5_ERROR(buf->path, dcpl);
+    if (H5Pget_layout(dcpl) == H5D_CHUNKED && var->ndims > 0)
+        H5Pget_chunk(dcpl, var->ndims, buf->chunk);
+    H5Pclose(dcpl);
+}
+
+/* Bytes of chunk cache needed to hold every chunk touched by one row of
+ * chunks along dim 0 of the hyperslab, so each chunk is only decompressed
+ * once as the rows are read in order.
+ */
+static size_t chunk_row_bytes(const H5Buffer *buf, const hsize_t *start,
+                              const hsize_t *count, size_t elsize)
+{
+    size_t bytes = elsize;
+    for (int i = 0; i < buf->rank; i++) {
+        bytes *= buf->chunk[i];
+        if (count[i] == 0)
+            return 0;
+        if (i > 0) {
+            hsize_t first = start[i] / buf->chunk[i];
+            hsize_t last = (start[i] + count[i] - 1) / buf->chunk[i];
+            bytes *= last - first + 1;
+        }
+    }
+    return bytes;
+}
+
+static H5Buffer *prep_read_buffer(SDSVarInfo *var, void **bufp,
+                                  const hsize_t *start, const hsize_t *count)
+{
+    H5Buffer *buf = (H5Buffer *)*bufp;
+    if (buf) {
+        assert(buf->free == (void (*)(void *))h5buffer_free);
+    } else {
+        *((H5Buffer **)bufp) = buf = h5buffer_create(var->sds);
+    }
+
+    if (buf->var != var)
+        open_dataset(buf, var, 0);
+    if (buf->chunk[0] == 0)
+        return buf; // contiguous; the chunk cache doesn't matter
+
+    // reopen with a cache big enough for this read's chunk rows
+    size_t want = chunk_row_bytes(buf, start, count, sds_type_size(var->type));
+    if (want < MIN_CHUNK_CACHE)
+        want = MIN_CHUNK_CACHE;
+    if (want > MAX_CHUNK_CACHE)
+        want = MAX_CHUNK_CACHE;
+    if (want > buf->cache_bytes)
+        open_dataset(buf, var, want);
+
+    return buf;
+}
+
+static hid_t sds_to_h5type(SDSType type)
+{
+    switch (type) {
+    case SDS_I8:     return H5T_NATIVE_SCHAR;
+    case SDS_U8:     return H5T_NATIVE_UCHAR;
+    case SDS_I16:    return H5T_NATIVE_SHORT;
+    case SDS_U16:    return H5T_NATIVE_USHORT;
+    case SDS_I32:    return H5T_NATIVE_INT;
+    case SDS_U32:    return H5T_NATIVE_UINT;
+    case SDS_I64:    return H5T_NATIVE_LLONG;
+    case SDS_U64:    return H5T_NATIVE_ULLONG;
+    case SDS_FLOAT:  return H5T_NATIVE_FLOAT;
+    case SDS_DOUBLE: return H5T_NATIVE_DOUBLE;
+    default: break;
+    }
+    abort();
+}
+
+// hyperslab bounds of a read, as HDF5 wants them; returns the element count
+static size_t h5_slab(SDSVarInfo *var, const int *start, const int *count,
+                      hsize_t *hstart, hsize_t *hcount)
+{
+    size_t n = 1;
+    for (int i = 0; i < var->ndims; i++) {
+        hstart[i] = (!start || start[i] < 0) ? 0 : (hsize_t)start[i];
+        if (!count || count[i] < 0)
+            hcount[i] = var->dims[i]->size - hstart[i];
+        else
+            hcount[i] = (hsize_t)count[i];
+        n *= (size_t)hcount[i];
+    }
+    return n;
+}
+
+/* Reads the hyperslab into out one row of chunks (along dim 0) at a time,
+ * with the selections aligned to the chunk boundaries, so that the chunk
+ * cache sized in prep_read_buffer() holds everything each step touches.
+ */
+static void read_slab(H5Buffer *buf, SDSVarInfo *var, void *out,
+                      const hsize_t *hstart, const hsize_t *hcount)
+{
+    int rank = var->ndims;
+    hid_t memtype = sds_to_h5type(var->type);
+    herr_t status;
+    if (rank == 0) {
+        status = H5Dread(buf->dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                         out);
+        CHECK_H5_ERROR(var->sds->path, status);
+        return;
+    }
+
+    size_t rowsize = sds_type_size(var->type);
+    for (int i = 1; i < rank; i++)
+        rowsize *= (size_t)hcount[i];
+
+    hid_t filespace = H5Dget_space(buf->dset);
+    CHECK_H5_ERROR(var->sds->path, filespace);
+
+    hsize_t step = buf->chunk[0] ? buf->chunk[0] : hcount[0];
+    hsize_t end = hstart[0] + hcount[0];
+    char *p = out;
+    hsize_t row = hstart[0];
+    while (row < end) {
+        hsize_t next = (row / step + 1) * step;
+        if (!buf->chunk[0] || next > end)
+            next = end;
+
+        hsize_t st[H5S_MAX_RANK], cnt[H5S_MAX_RANK];
+        memcpy(st, hstart, sizeof(hsize_t) * rank);
+        memcpy(cnt, hcount, sizeof(hsize_t) * rank);
+        st[0] = row;
+        cnt[0] = next - row;
+
+        status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET, st, NULL,
+                                     cnt, NULL);
+        CHECK_H5_ERROR(var->sds->path, status);
+        hid_t memspace = H5Screate_simple(rank, cnt, NULL);
+        CHECK_H5_ERROR(var->sds->path, memspace);
+        status = H5Dread(buf->dset, memtype, memspace, filespace, H5P_DEFAULT,
+                         p);
+        CHECK_H5_ERROR(var->sds->path, status);
+        H5Sclose(memspace);
+
+        p += (size_t)cnt[0] * rowsize;
+        row = next;
+    }
+    H5Sclose(filespace);
+}
+
+static void *var_readv(SDSVarInfo *var, void **bufp,
+                       const int *start, const int *count)
+{
+    hsize_t hstart[H5S_MAX_RANK], hcount[H5S_MAX_RANK];
+    size_t bufsize = h5_slab(var, start, count, hstart, hcount) *
+        sds_type_size(var->type);
+
+    H5Buffer *buf = prep_read_buffer(var, bufp, hstart, hcount);
+    h5buffer_ensure(buf, bufsize);
+    if (bufsize > 0)
+        read_slab(buf, var, buf->data, hstart, hcount);
+    return buf->data;
+}
+
+/* Packed destinations are read into directly through a buffer kept with the
+ * file that just holds the open dataset, so reading one variable piece by
+ * piece doesn't reopen it each time; strided destinations are left to
+ * sds_readv_into().
+ */
+static int var_readv_into(SDSVarInfo *var, void *dst, const int *start,
+                          const int *count, const ptrdiff_t *strides)
+{
+    if (strides)
+        return -1;
+
+    hsize_t hstart[H5S_MAX_RANK], hcount[H5S_MAX_RANK];
+    if (h5_slab(var, start, count, hstart, hcount) == 0)
+        return 0;
+
+    H5File *file = var->sds->backend;
+    H5Buffer *buf = prep_read_buffer(var, &file->into, hstart, hcount);
+    read_slab(buf, var, dst, hstart, hcount);
+    return 0;
+}
+
+/* Reads every stride[i]'th element with one strided hyperslab selection.
+ * sds_readvs() fills in start, count and stride.  The chunk cache is sized
+ * for the whole extent the elements span, as every chunk row may be hit.
+ */
+static void *var_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                        const int *count, const int *stride)
+{
+    int rank = var->ndims;
+    hsize_t hstart[H5S_MAX_RANK], hcount[H5S_MAX_RANK];
+    hsize_t hstride[H5S_MAX_RANK], hspan[H5S_MAX_RANK];
+    size_t bufsize = sds_type_size(var->type);
+    for (int i = 0; i < rank; i++) {
+        hstart[i] = (hsize_t)start[i];
+        hcount[i] = (hsize_t)count[i];
+        hstride[i] = (hsize_t)stride[i];
+        hspan[i] = hcount[i] ? (hcount[i] - 1) * hstride[i] + 1 : 0;
+        bufsize *= (size_t)hcount[i];
+    }
+
+    H5Buffer *buf = prep_read_buffer(var, bufp, hstart, hspan);
+    h5buffer_ensure(buf, bufsize);
+    if (bufsize == 0)
+        return buf->data;
+
+    hid_t filespace = H5Dget_space(buf->dset);
+    CHECK_H5_ERROR(var->sds->path, filespace);
+    herr_t status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET, hstart,
+                                        hstride, hcount, NULL);
+    CHECK_H5_ERROR(var->sds->path, status);
+    hid_t memspace = H5Screate_simple(rank, hcount, NULL);
+    CHECK_H5_ERROR(var->sds->path, memspace);
+    status = H5Dread(buf->dset, sds_to_h5type(var->type), memspace,
+                     filespace, H5P_DEFAULT, buf->data);
+    CHECK_H5_ERROR(var->sds->path, status);
+    H5Sclose(memspace);
+    H5Sclose(filespace);
+    return buf->data;
+}
+
+static void var_writev(SDSVarInfo *var, void *data, const int *index)
+{
+    fprintf(stderr, "hdf5 variable writing not implemented yet!\n");
+    abort();
+}
+
+/* Whether HDF5 was built thread safe, in which case it serializes its own
+ * calls and reads don't need the I/O lock (see sds_file_lock()).
+ */
+static int library_threadsafe(void)
+{
+    hbool_t safe = 0;
+    if (H5is_library_threadsafe(&safe) < 0)
+        return 0;
+    return safe ? 1 : 0;
+}
+
+static void close_h5(SDSInfo *sds)
+{
+    H5File *file = sds->backend;
+    if (file->into) {
+        h5buffer_free(file->into);
+        file->into = NULL;
+    }
+    herr_t status = H5Fclose(file->fid);
+    CHECK_H5_ERROR(sds->path, status);
+}
+
+static struct SDS_Funcs h5_funcs = {
+    var_readv,
+    var_readv_into,
+    var_readvs,
+    var_writev,
+    close_h5,
+    NULL, // metadata is always read in full
+    NULL
+};
+
+/* Maps an HDF5 datatype to an SDSType, or SDS_NO_TYPE for types (compound,
+ * reference, etc.) that aren't supported.
+ */
+static SDSType h5_to_sdstype(hid_t type)
+{
+    size_t size = H5Tget_size(type);
+    switch (H5Tget_class(type)) {
+    case H5T_INTEGER: {
+        int sign = (H5Tget_sign(type) != H5T_SGN_NONE);
+        switch (size) {
+        case 1: return sign ? SDS_I8 : SDS_U8;
+        case 2: return sign ? SDS_I16 : SDS_U16;
+        case 4: return sign ? SDS_I32 : SDS_U32;
+        case 8: return sign ? SDS_I64 : SDS_U64;
+        default: break;
+        }
+        break;
+    }
+    case H5T_FLOAT:
+        if (size == 4)
+            return SDS_FLOAT;
+        if (size == 8)
+            return SDS_DOUBLE;
+        break;
+    case H5T_STRING:
+        return SDS_STRING;
+    default:
+        break;
+    }
+    return SDS_NO_TYPE;
+}
+
+/* Reads a string attribute's values, fixed or variable length, into one
+ * nul-terminated string with multiple values separated by ", ".
+ */
+static char *read_string_att(SDSArena *arena, const char *path, hid_t aid,
+                             hid_t type, size_t nelems, size_t *len)
+{
+    char *str;
+    herr_t status;
+
+    if (H5Tis_variable_str(type) > 0) {
+        char **strs = NEWA(char *, nelems);
+        hid_t memtype = H5Tcopy(H5T_C_S1);
+        H5Tset_size(memtype, H5T_VARIABLE);
+        H5Tset_cset(memtype, H5Tget_cset(type)); // ASCII vs UTF-8
+        status = H5Aread(aid, memtype, strs);
+        CHECK_H5_ERROR(path, status);
+
+        size_t total = 1;
+        for (size_t u = 0; u < nelems; u++)
+            total += (strs[u] ? strlen(strs[u]) : 0) + 2;
+        str = sds_arena_alloc(arena, total);
+        str[0] = '\0';
+        for (size_t u = 0; u < nelems; u++) {
+            if (u > 0)
+                strcat(str, ", ");
+            if (strs[u])
+                strcat(str, strs[u]);
+        }
+
+        hid_t space = H5Aget_space(aid);
+        H5Dvlen_reclaim(memtype, space, H5P_DEFAULT, strs);
+        H5Sclose(space);
+        H5Tclose(memtype);
+        free(strs);
+    } else {
+        // read as nul-terminated strings, with room for the terminators
+        size_t size = H5Tget_size(type) + 1;
+        char *vals = NEWA(char, size * nelems);
+        hid_t memtype = H5Tcopy(H5T_C_S1);
+        H5Tset_size(memtype, size);
+        H5Tset_cset(memtype, H5Tget_cset(type));
+        status = H5Aread(aid, memtype, vals);
+        CHECK_H5_ERROR(path, status);
+        H5Tclose(memtype);
+
+        // join the values, dropping space padding; each takes at most
+        // size - 1 chars plus a ", " separator, plus one terminator
+        str = sds_arena_alloc(arena, (size + 1) * nelems + 1);
+        size_t n = 0;
+        for (size_t u = 0; u < nelems; u++) {
+            const char *s = vals + u * size;
+            size_t slen = strlen(s);
+            while (slen > 0 && s[slen - 1] == ' ')
+                slen--;
+            if (u > 0) {
+                str[n++] = ',';
+                str[n++] = ' ';
+            }
+            memcpy(str + n, s, slen);
+            n += slen;
+        }
+        str[n] = '\0';
+        free(vals);
+    }
+
+    *len = strlen(str) + 1;
+    return str;
+}
+
+typedef struct {
+    SDSArena *arena;
+    const char *path;
+    const char *prefix; // group path for global attributes, or ""
+    SDSAttInfo *list;
+} AttIterData;
+
+static herr_t read_attribute(hid_t loc, const char *name,
+                             const H5A_info_t *ainfo, void *op_data)
+{
+    AttIterData *it = op_data;
+
+    hid_t aid = H5Aopen(loc, name, H5P_DEFAULT);
+    CHECK_H5_ERROR(it->path, aid);
+    hid_t type = H5Aget_type(aid);
+    hid_t space = H5Aget_space(aid);
+    hssize_t nelems = H5Sget_simple_extent_npoints(space);
+    H5Sclose(space);
+
+    SDSType sdstype = h5_to_sdstype(type);
+    if (sdstype == SDS_NO_TYPE || nelems < 1) {
+        // dimension scale references and the like
+        H5Tclose(type);
+        H5Aclose(aid);
+        return 0;
+    }
+
+    SDSAttInfo *att = ANEW0(it->arena, SDSAttInfo);
+    att->type = sdstype;
+    att->sds = NULL;
+    if (sdstype == SDS_STRING) {
+        att->data.v = read_string_att(it->arena, it->path, aid, type,
+                                      (size_t)nelems, &att->count);
+        att->bytes = 1;
+    } else {
+        att->bytes = sds_type_size(sdstype);
+        att->count = (size_t)nelems;
+        att->data.v = sds_arena_alloc(it->arena, att->bytes * att->count);
+        herr_t status = H5Aread(aid, sds_to_h5type(sdstype), att->data.v);
+        CHECK_H5_ERROR(it->path, status);
+    }
+    H5Tclose(type);
+    H5Aclose(aid);
+
+    size_t len = strlen(it->prefix) + strlen(name) + 1;
+    att->name = sds_arena_alloc(it->arena, len);
+    strcpy(att->name, it->prefix);
+    strcat(att->name, name);
+
+    att->next = it->list;
+    it->list = att;
+    return 0;
+}
+
+static SDSAttInfo *read_attributes(SDSArena *arena, const char *path,
+                                   hid_t obj, const char *prefix)
+{
+    AttIterData it = { arena, path, prefix, NULL };
+    hsize_t idx = 0;
+    herr_t status = H5Aiterate2(obj, H5_INDEX_NAME, H5_ITER_NATIVE, &idx,
+                                read_attribute, &it);
+    CHECK_H5_ERROR(path, status);
+    return (SDSAttInfo *)sds_list_reverse((SDSList *)it.list);
+}
+
+static SDSDimInfo *add_dim(SDSInfo *sds, const char *name, size_t size,
+                           int isunlim)
+{
+    SDSDimInfo *dim = ANEW0(sds->arena, SDSDimInfo);
+    dim->name = sds_arena_strdup(sds->arena, name);
+    dim->size = size;
+    dim->isunlim = isunlim;
+    dim->id = -1;
+
+    dim->next = sds->dims;
+    sds->dims = dim;
+
+    if (isunlim && !sds->unlimdim)
+        sds->unlimdim = dim;
+    return dim;
+}
+
+static herr_t scale_name(hid_t did, unsigned dim, hid_t dsid, void *op_data)
+{
+    char *name = op_data;
+    ssize_t len = H5Iget_name(dsid, name, MAX_SCALE_NAME);
+    if (len <= 0)
+        return 0; // keep looking
+    // the full length is returned even when the name was cut short
+    if (len > MAX_SCALE_NAME - 1)
+        len = MAX_SCALE_NAME - 1;
+    name[len] = '\0';
+    if (name[0] == '/')
+        memmove(name, name + 1, (size_t)len);
+    return 1; // found one; stop
+}
+
+/* Finds or makes the dimension for dimension i of the dataset: the first
+ * attached dimension scale if there is one, else a phony dimension shared
+ * with any other dataset dimension of the same size.
+ */
+static SDSDimInfo *dataset_dim(SDSInfo *sds, hid_t did, const char *varname,
+                               int isscale, unsigned i, size_t size,
+                               int isunlim)
+{
+    char name[MAX_SCALE_NAME];
+    name[0] = '\0';
+
+    if (isscale && i == 0) {
+        strncpy(name, varname, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+    } else if (H5DSget_num_scales(did, i) > 0) {
+        H5DSiterate_scales(did, i, NULL, scale_name, name);
+    }
+
+    SDSDimInfo *dim;
+    if (name[0]) {
+        for (dim = sds->dims; dim != NULL; dim = dim->next)
+            if (dim->size == size && !strcmp(dim->name, name))
+                return dim;
+        return add_dim(sds, name, size, isunlim);
+    }
+
+    for (dim = sds->dims; dim != NULL; dim = dim->next)
+        if (!strncmp(dim->name, "phony_dim_", 10) && dim->size == size &&
+            dim->isunlim == isunlim)
+            return dim;
+    H5File *file = sds->backend;
+    snprintf(name, sizeof(name), "phony_dim_%i", file->nphony++);
+    return add_dim(sds, name, size, isunlim);
+}
+
+static void read_dataset(SDSInfo *sds, hid_t did, const char *name)
+{
+    hid_t type = H5Dget_type(did);
+    CHECK_H5_ERROR(sds->path, type);
+    SDSType sdstype = h5_to_sdstype(type);
+    int isstr = (H5Tget_class(type) == H5T_STRING);
+    H5Tclose(type);
+    if (sdstype == SDS_NO_TYPE || isstr)
+        return; // only numeric datasets are supported
+
+    hid_t space = H5Dget_space(did);
+    CHECK_H5_ERROR(sds->path, space);
+    int rank = H5Sget_simple_extent_ndims(space);
+    hsize_t dims[H5S_MAX_RANK], maxdims[H5S_MAX_RANK];
+    H5Sget_simple_extent_dims(space, dims, maxdims);
+    H5Sclose(space);
+
+    int isscale = (H5DSis_scale(did) > 0);
+
+    SDSVarInfo *var = ANEW0(sds->arena, SDSVarInfo);
+    var->name = sds_arena_strdup(sds->arena, name);
+    var->type = sdstype;
+    var->iscoord = (isscale && rank == 1);
+    var->ndims = rank;
+    var->dims = (rank == 0) ? NULL : ANEWA(sds->arena, SDSDimInfo *, rank);
+    for (int i = 0; i < rank; i++)
+        var->dims[i] = dataset_dim(sds, did, name, isscale, (unsigned)i,
+                                   (size_t)dims[i],
+                                   maxdims[i] == H5S_UNLIMITED);
+    var->atts = read_attributes(sds->arena, sds->path, did, "");
+    var->id = -1;
+    var->sds = sds;
+
+    hid_t dcpl = H5Dget_create_plist(did);
+    CHECK_H5_ERROR(sds->path, dcpl);
+    int nfilters = H5Pget_nfilters(dcpl);
+    for (int i = 0; i < nfilters; i++) {
+        unsigned flags, cd_values[8];
+        size_t ncd = 8;
+        H5Z_filter_t filter = H5Pget_filter2(dcpl, (unsigned)i, &flags, &ncd,
+                                             cd_values, 0, NULL, NULL);
+        if (filter == H5Z_FILTER_DEFLATE && ncd > 0)
+            var->compress = (int)cd_values[0];
+        else if (filter != H5Z_FILTER_SHUFFLE &&
+                 filter != H5Z_FILTER_FLETCHER32 && var->compress == 0)
+            var->compress = 1; // some other compression; see sds_hdf4.c
+    }
+    H5Pclose(dcpl);
+
+    var->next = sds->vars;
+    sds->vars = var;
+}
+
+typedef struct {
+    SDSInfo *sds;
+    const char *prefix; // path of the group being visited, with a trailing /
+    int depth;
+} GroupIterData;
+
+static void read_group(SDSInfo *sds, hid_t gid, const char *prefix, int depth);
+
+static herr_t visit_link(hid_t gid, const char *name, const H5L_info_t *info,
+                         void *op_data)
+{
+    GroupIterData *it = op_data;
+    if (info->type != H5L_TYPE_HARD)
+        return 0; // soft and external links would duplicate or leave the file
+
+    char *path = sds_alloc(strlen(it->prefix) + strlen(name) + 2);
+    strcpy(path, it->prefix);
+    strcat(path, name);
+
+    hid_t oid = H5Oopen(gid, name, H5P_DEFAULT);
+    CHECK_H5_ERROR(it->sds->path, oid);
+    switch (H5Iget_type(oid)) {
+    case H5I_GROUP:
+        if (it->depth < MAX_GROUP_DEPTH) {
+            strcat(path, "/");
+            read_group(it->sds, oid, path, it->depth + 1);
+        }
+        break;
+    case H5I_DATASET:
+        read_dataset(it->sds, oid, path);
+        break;
+    default:
+        break; // named datatypes
+    }
+    H5Oclose(oid);
+    free(path);
+    return 0;
+}
+
+static void read_group(SDSInfo *sds, hid_t gid, const char *prefix, int depth)
+{
+    // attributes of subgroups become global attributes named group/att
+    SDSAttInfo *atts = read_attributes(sds->arena, sds->path, gid, prefix);
+    SDSAttInfo **tail = &sds->gatts;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = atts;
+
+    GroupIterData it = { sds, prefix, depth };
+    hsize_t idx = 0;
+    herr_t status = H5Literate(gid, H5_INDEX_NAME, H5_ITER_NATIVE, &idx,
+                               visit_link, &it);
+    CHECK_H5_ERROR(sds->path, status);
+}
+
+/* Opens an HDF5 file and reads all its dataset metadata, returning an
+ * SDSInfo structure containing this metadata.  Returns NULL on error.
+ */
+SDSInfo *sds_h5_open(const char *path)
+{
+    hid_t fid = H5Fopen(path, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (fid < 0)
+        return NULL;
+
+    SDSArena *arena = sds_arena_create();
+    SDSInfo *sds = ANEW0(arena, SDSInfo);
+    sds->arena = arena;
+    sds->path = sds_arena_strdup(arena, path);
+    sds->type = SDS_HDF5_FILE;
+    sds->id = -1;
+
+    H5File *file = ANEW0(arena, H5File);
+    file->fid = fid;
+    sds->backend = file;
+    sds->own_lock = library_threadsafe();
+
+    read_group(sds, fid, "", 0);
+    sds->vars = (SDSVarInfo *)sds_list_reverse((SDSList *)sds->vars);
+    sds->dims = (SDSDimInfo *)sds_list_reverse((SDSList *)sds->dims);
+
+    int id = 0;
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next)
+        var->id = id++;
+    id = 0;
+    for (SDSDimInfo *dim = sds->dims; dim != NULL; dim = dim->next)
+        dim->id = id++;
+
+    sds->funcs = &h5_funcs;
+    return sds;
+}
+
+/* Whether every variable in the sidecar's metadata names a dataset of the
+ * type and shape HDF5 gives it, so reads stay within its data.
+ */
+static int shapes_match(hid_t fid, SDSInfo *sds)
+{
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next) {
+        hid_t did;
+        H5E_BEGIN_TRY { // a missing dataset isn't worth an error trace
+            did = H5Dopen2(fid, var->name, H5P_DEFAULT);
+        } H5E_END_TRY;
+        if (did < 0)
+            return 0;
+
+        hid_t type = H5Dget_type(did);
+        hid_t space = H5Dget_space(did);
+        int ok = (type >= 0 && space >= 0 &&
+                  h5_to_sdstype(type) == var->type &&
+                  H5Sget_simple_extent_ndims(space) == var->ndims);
+        hsize_t dims[H5S_MAX_RANK];
+        if (ok)
+            ok = (H5Sget_simple_extent_dims(space, dims, NULL) >= 0);
+        for (int i = 0; ok && i < var->ndims; i++)
+            ok = ((size_t)dims[i] == var->dims[i]->size);
+        if (type >= 0)
+            H5Tclose(type);
+        if (space >= 0)
+            H5Sclose(space);
+        H5Dclose(did);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+/* Opens the file behind metadata rebuilt from a sidecar (see sds_meta.c)
+ * for reading, without walking its groups again beyond checking the
+ * variables' shapes.  Returns -1 if HDF5 can't open it or those don't
+ * match, so the file's metadata is read from it instead.
+ */
+int sds_h5_attach(SDSInfo *sds)
+{
+    hid_t fid = H5Fopen(sds->path, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (fid < 0)
+        return -1;
+    if (!shapes_match(fid, sds)) {
+        H5Fclose(fid);
+        return -1;
+    }
+    H5File *file = ANEW0(sds->arena, H5File);
+    file->fid = fid;
+    sds->backend = file;
+    sds->own_lock = library_threadsafe();
+    sds->funcs = &h5_funcs;
+    return 0;
+}
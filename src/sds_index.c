@@ -0,0 +1,281 @@
+/* sds_index.c - Hash index for looking up variables, dimensions and
+ *               attributes by name.
+ */
+#include "sds.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+enum IndexKind {
+    INDEX_VAR = 1,
+    INDEX_DIM,
+    INDEX_ATT
+};
+
+typedef struct {
+    const char *name; // NULL for an empty slot
+    const void *owner; // the variable for variable attributes, else NULL
+    int kind;
+    void *item;
+    SDSAttInfo *atts; // a variable's attribute list head when indexed
+} IndexSlot;
+
+struct SDSIndex {
+    size_t mask; // number of slots - 1
+    IndexSlot *slots;
+
+    // list heads the index was built from, to notice when they're replaced
+    SDSAttInfo *gatts;
+    SDSDimInfo *dims;
+    SDSVarInfo *vars;
+    size_t nheap; // malloc()ed members in them; see sds_index_heap_members()
+    SDSAttInfo **var_atts; // each variable's atts list head, in list order
+    size_t nvars;
+};
+
+/* Guards rebuilding indexes against lookups from other threads (worker
+ * threads of sds_read_many(), aggregations being read from and so on).
+ * Lookups are short, so one lock serves every file.  Each file's index
+ * goes out of date on its own, through SDSInfo.index_stale, when members
+ * it points at are freed.
+ */
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a over the name, mixed with the owner pointer and kind
+static size_t slot_hash(int kind, const void *owner, const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *s = (const unsigned char *)name; *s; s++) {
+        h ^= *s;
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t)(uintptr_t)owner + (uint64_t)kind;
+    h *= 1099511628211ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+static IndexSlot *find_slot(SDSIndex *idx, int kind, const void *owner,
+                            const char *name)
+{
+    size_t i = slot_hash(kind, owner, name) & idx->mask;
+    for (;;) {
+        IndexSlot *slot = idx->slots + i;
+        if (!slot->name ||
+            (slot->kind == kind && slot->owner == owner &&
+             !strcmp(slot->name, name)))
+            return slot;
+        i = (i + 1) & idx->mask;
+    }
+}
+
+// first one wins, like the linear sds_*_by_name() searches
+static void add_item(SDSIndex *idx, int kind, const void *owner,
+                     const char *name, void *item)
+{
+    IndexSlot *slot = find_slot(idx, kind, owner, name);
+    if (!slot->name) {
+        slot->name = name;
+        slot->owner = owner;
+        slot->kind = kind;
+        slot->item = item;
+    }
+}
+
+/* Builds an index over the given lists, marking each member with owner
+ * (if not NULL) so that freeing it marks owner's index out of date.
+ */
+static SDSIndex *index_lists(SDSAttInfo *gatts, SDSDimInfo *dims,
+                             SDSVarInfo *vars, SDSInfo *owner)
+{
+    size_t n = sds_list_count((SDSList *)gatts) +
+        sds_list_count((SDSList *)dims);
+    for (SDSVarInfo *var = vars; var != NULL; var = var->next)
+        n += 1 + sds_list_count((SDSList *)var->atts);
+
+    // keep the table at most half full
+    size_t nslots = 16;
+    while (nslots < 2 * n)
+        nslots *= 2;
+
+    SDSIndex *idx = NEW(SDSIndex);
+    idx->mask = nslots - 1;
+    idx->slots = sds_alloc0(sizeof(IndexSlot) * nslots);
+    idx->gatts = gatts;
+    idx->dims = dims;
+    idx->vars = vars;
+    idx->nheap = 0;
+    idx->nvars = sds_list_count((SDSList *)vars);
+    idx->var_atts = NEWA(SDSAttInfo *, idx->nvars + 1);
+
+    for (SDSAttInfo *att = gatts; att != NULL; att = att->next) {
+        add_item(idx, INDEX_ATT, NULL, att->name, att);
+        if (owner)
+            att->owner = owner;
+        idx->nheap += att->heap;
+    }
+    for (SDSDimInfo *dim = dims; dim != NULL; dim = dim->next) {
+        add_item(idx, INDEX_DIM, NULL, dim->name, dim);
+        if (owner)
+            dim->owner = owner;
+        idx->nheap += dim->heap;
+    }
+    size_t nv = 0;
+    for (SDSVarInfo *var = vars; var != NULL; var = var->next) {
+        idx->var_atts[nv++] = var->atts;
+        add_item(idx, INDEX_VAR, NULL, var->name, var);
+        IndexSlot *slot = find_slot(idx, INDEX_VAR, NULL, var->name);
+        if (slot->item == var)
+            slot->atts = var->atts;
+        if (owner)
+            var->owner = owner;
+        idx->nheap += var->heap;
+        for (SDSAttInfo *att = var->atts; att != NULL; att = att->next) {
+            add_item(idx, INDEX_ATT, var, att->name, att);
+            if (owner)
+                att->owner = owner;
+            idx->nheap += att->heap;
+        }
+    }
+
+    return idx;
+}
+
+/* Builds an index over the given lists (any of which may be NULL),
+ * including each variable's attributes.  The index points into the lists,
+ * so it must be rebuilt if any of their members are freed.
+ */
+SDSIndex *sds_index_create(SDSAttInfo *gatts, SDSDimInfo *dims,
+                           SDSVarInfo *vars)
+{
+    return index_lists(gatts, dims, vars, NULL);
+}
+
+void sds_index_free(SDSIndex *idx)
+{
+    if (idx) {
+        free(idx->slots);
+        free(idx->var_atts);
+        free(idx);
+    }
+}
+
+SDSVarInfo *sds_index_var(SDSIndex *idx, const char *name)
+{
+    return find_slot(idx, INDEX_VAR, NULL, name)->item;
+}
+
+SDSDimInfo *sds_index_dim(SDSIndex *idx, const char *name)
+{
+    return find_slot(idx, INDEX_DIM, NULL, name)->item;
+}
+
+SDSAttInfo *sds_index_att(SDSIndex *idx, SDSVarInfo *var, const char *name)
+{
+    return find_slot(idx, INDEX_ATT, var, name)->item;
+}
+
+/* Rebuilds the name index of the given SDSInfo.  Lookups notice when the
+ * gatts, dims, vars or a variable's atts list heads are replaced, when
+ * the sds_free_*(), keep and delete functions free members, or when
+ * sds_create_*() puts members in front of them, and rebuild by themselves;
+ * but if you free members of those lists yourself, or link members in
+ * anywhere but the front, call this afterwards.
+ */
+void sds_reindex(SDSInfo *sds)
+{
+    // built unlocked; members freed meanwhile mark it stale again
+    SDS_STORE_INT(&sds->index_stale, 0);
+    SDSIndex *idx = index_lists(sds->gatts, sds->dims, sds->vars, sds);
+    pthread_mutex_lock(&index_mutex);
+    SDSIndex *old = sds->index;
+    sds->index = idx;
+    pthread_mutex_unlock(&index_mutex);
+    sds_index_free(old);
+}
+
+// replaces the index of the given SDSInfo; index_mutex must be held
+static SDSIndex *rebuild(SDSInfo *sds)
+{
+    sds_index_free(sds->index);
+    SDS_STORE_INT(&sds->index_stale, 0);
+    sds->index = index_lists(sds->gatts, sds->dims, sds->vars, sds);
+    return sds->index;
+}
+
+/* Returns the index of the given SDSInfo, rebuilding it first if it's out
+ * of date.  Must be called with index_mutex held, which keeps the index
+ * from being freed until the lookup in it is done.
+ */
+static SDSIndex *current_index(SDSInfo *sds)
+{
+    SDSIndex *idx = sds->index;
+    if (!idx || idx->gatts != sds->gatts || idx->dims != sds->dims ||
+        idx->vars != sds->vars || SDS_LOAD_INT(&sds->index_stale))
+        idx = rebuild(sds);
+    return idx;
+}
+
+/* Looks up a variable by name in constant time.
+ */
+SDSVarInfo *sds_find_var(SDSInfo *sds, const char *name)
+{
+    pthread_mutex_lock(&index_mutex);
+    SDSVarInfo *var = sds_index_var(current_index(sds), name);
+    pthread_mutex_unlock(&index_mutex);
+    return var;
+}
+
+/* Looks up a dimension by name in constant time.
+ */
+SDSDimInfo *sds_find_dim(SDSInfo *sds, const char *name)
+{
+    pthread_mutex_lock(&index_mutex);
+    SDSDimInfo *dim = sds_index_dim(current_index(sds), name);
+    pthread_mutex_unlock(&index_mutex);
+    return dim;
+}
+
+/* Looks up an attribute by name in constant time.
+ * var - the variable whose attribute to find, or NULL for a global
+ *       attribute.  Variables not in sds's list are searched linearly.
+ */
+SDSAttInfo *sds_find_att(SDSInfo *sds, SDSVarInfo *var, const char *name)
+{
+    pthread_mutex_lock(&index_mutex);
+    SDSIndex *idx = current_index(sds);
+    if (var) {
+        IndexSlot *slot = find_slot(idx, INDEX_VAR, NULL, var->name);
+        if (slot->item != var) {
+            pthread_mutex_unlock(&index_mutex);
+            return sds_att_by_name(var->atts, name);
+        }
+        if (slot->atts != var->atts) // the variable's list was replaced
+            idx = rebuild(sds);
+    }
+    SDSAttInfo *att = sds_index_att(idx, var, name);
+    pthread_mutex_unlock(&index_mutex);
+    return att;
+}
+
+/* Returns how many members of the file's lists were malloc()ed one at a
+ * time rather than carved from its arena, for sds_close() to know whether
+ * to walk them.  The count comes from the index, brought up to date first
+ * if the lists changed; that takes a look at each variable's attribute
+ * list head, since those are often started afresh with sds_create_att().
+ * Private to the library.
+ */
+size_t sds_index_heap_members(SDSInfo *sds)
+{
+    pthread_mutex_lock(&index_mutex);
+    SDSIndex *idx = current_index(sds);
+    size_t i = 0;
+    SDSVarInfo *var = sds->vars;
+    for (; var != NULL && i < idx->nvars; var = var->next, i++)
+        if (var->atts != idx->var_atts[i])
+            break;
+    if (var || i < idx->nvars)
+        idx = rebuild(sds);
+    size_t n = idx->nheap;
+    pthread_mutex_unlock(&index_mutex);
+    return n;
+}
@@ -0,0 +1,480 @@
+/* sds_meta.c - On-disk cache of parsed file metadata.
+ *
+ * Opening a file with lots of variables and attributes spends most of its
+ * time in the format library's inquiry calls.  When a cache directory is
+ * set (see sds_set_meta_cache()), sds_open() saves the SDSInfo it parsed to
+ * a sidecar file there, named after the file's absolute path, and later
+ * opens of the same file, as long as its size and modification time are
+ * unchanged, map the sidecar and rebuild the SDSInfo from it instead.  The
+ * format library is then only used to open the file for reading data.
+ *
+ * Sidecars are in host byte order and rejected if written by a host of the
+ * other byte order or by another version of this code.  Since anyone who
+ * can write to the cache directory can write a sidecar, every field read
+ * back is checked to be one the backends could have produced.  Any sidecar
+ * that can't be read, doesn't match or fails a check is simply ignored and
+ * rewritten.
+ */
+#define _GNU_SOURCE // realpath()
+#include "sds.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define META_MAGIC "SDSMETA"
+#define META_VERSION 1
+#define META_BOM 0x01020304u
+#define META_SUFFIX ".sdsmeta"
+
+// most dimensions of a variable; the least of the backends' limits
+// (HDF4's and HDF5's 32), since they keep per-dimension arrays that size
+#define META_MAX_VAR_DIMS 32
+
+static struct {
+    pthread_mutex_t mutex;
+    int set;   // sds_set_meta_cache() called, so ignore the environment
+    char *dir; // NULL if off
+} meta = { PTHREAD_MUTEX_INITIALIZER, 0, NULL };
+
+/* Turns the metadata cache on, keeping sidecars in the given directory, or
+ * off if dir is NULL.  Until this is called the SDS_META_CACHE environment
+ * variable, if set, names the directory.  The directory must exist.
+ */
+void sds_set_meta_cache(const char *dir)
+{
+    pthread_mutex_lock(&meta.mutex);
+    free(meta.dir);
+    meta.dir = dir ? strdup(dir) : NULL;
+    meta.set = 1;
+    pthread_mutex_unlock(&meta.mutex);
+}
+
+// copy of the cache directory, or NULL if the cache is off
+static char *cache_dir(void)
+{
+    pthread_mutex_lock(&meta.mutex);
+    if (!meta.set) {
+        const char *env = getenv("SDS_META_CACHE");
+        meta.dir = (env && env[0]) ? strdup(env) : NULL;
+        meta.set = 1;
+    }
+    char *dir = meta.dir ? strdup(meta.dir) : NULL;
+    pthread_mutex_unlock(&meta.mutex);
+    return dir;
+}
+
+// identifies one version of a data file
+typedef struct {
+    char *abspath;
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+} FileKey;
+
+static int file_key(const char *path, FileKey *key)
+{
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+    key->abspath = realpath(path, NULL);
+    if (!key->abspath)
+        return -1;
+    key->size = st.st_size;
+    key->mtime_sec = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+// dir/<FNV-1a hash of the absolute path>.sdsmeta
+static char *sidecar_path(const char *dir, const char *abspath)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)abspath; *p; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    char *path = sds_alloc(strlen(dir) + 32);
+    sprintf(path, "%s/%016llx%s", dir, (unsigned long long)h, META_SUFFIX);
+    return path;
+}
+
+/*
+ * Writing
+ */
+
+typedef struct {
+    char *p;
+    size_t len, cap;
+} Out;
+
+static void put(Out *o, const void *src, size_t n)
+{
+    if (n == 0)
+        return;
+    if (o->len + n > o->cap) {
+        o->cap = (o->len + n) * 2;
+        o->p = sds_realloc(o->p, o->cap);
+    }
+    memcpy(o->p + o->len, src, n);
+    o->len += n;
+}
+
+static void put_u32(Out *o, uint32_t v) { put(o, &v, sizeof(v)); }
+static void put_i32(Out *o, int32_t v) { put(o, &v, sizeof(v)); }
+static void put_u64(Out *o, uint64_t v) { put(o, &v, sizeof(v)); }
+static void put_i64(Out *o, int64_t v) { put(o, &v, sizeof(v)); }
+
+static void put_str(Out *o, const char *s)
+{
+    size_t n = strlen(s);
+    put_u32(o, (uint32_t)n);
+    put(o, s, n);
+}
+
+static void put_atts(Out *o, SDSAttInfo *atts)
+{
+    uint32_t n = 0;
+    for (SDSAttInfo *att = atts; att != NULL; att = att->next)
+        n++;
+    put_u32(o, n);
+    for (SDSAttInfo *att = atts; att != NULL; att = att->next) {
+        put_str(o, att->name);
+        put_u32(o, att->type);
+        put_u64(o, att->count);
+        put_u64(o, att->bytes);
+        put(o, sds_att_data(att), att->count * att->bytes);
+    }
+}
+
+static uint32_t dim_index(SDSDimInfo *dims, SDSDimInfo *dim)
+{
+    uint32_t i = 0;
+    for (; dims != NULL && dims != dim; dims = dims->next)
+        i++;
+    return dims ? i : UINT32_MAX;
+}
+
+static void serialize(Out *o, SDSInfo *sds, const FileKey *key)
+{
+    put(o, META_MAGIC, sizeof(META_MAGIC));
+    put_u32(o, META_VERSION);
+    put_u32(o, META_BOM);
+    put_str(o, key->abspath);
+    put_u64(o, key->size);
+    put_i64(o, key->mtime_sec);
+    put_i64(o, key->mtime_nsec);
+
+    put_u32(o, sds->type);
+    put_atts(o, sds->gatts);
+
+    uint32_t ndims = 0;
+    for (SDSDimInfo *dim = sds->dims; dim != NULL; dim = dim->next)
+        ndims++;
+    put_u32(o, ndims);
+    for (SDSDimInfo *dim = sds->dims; dim != NULL; dim = dim->next) {
+        put_str(o, dim->name);
+        put_u64(o, dim->size);
+        put_u32(o, dim->isunlim);
+        put_i32(o, dim->id);
+    }
+    put_u32(o, dim_index(sds->dims, sds->unlimdim));
+
+    uint32_t nvars = 0;
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next)
+        nvars++;
+    put_u32(o, nvars);
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next) {
+        put_str(o, var->name);
+        put_u32(o, var->type);
+        put_i32(o, sds_var_compress(var));
+        put_u32(o, var->iscoord);
+        put_i32(o, var->id);
+        put_u32(o, var->ndims);
+        for (int i = 0; i < var->ndims; i++)
+            put_u32(o, dim_index(sds->dims, var->dims[i]));
+        put_atts(o, var->atts);
+    }
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Saves the metadata of a file just opened to its sidecar, if the cache is
+ * on.  Metadata a lazy open left out is read first.  The sidecar is written
+ * under a temporary name and renamed into place, so readers never see a
+ * partial one.  Failures just leave the file uncached.
+ */
+void sds_meta_save(SDSInfo *sds)
+{
+    char *dir = cache_dir();
+    if (!dir)
+        return;
+    FileKey key;
+    if (file_key(sds->path, &key)) {
+        free(dir);
+        return;
+    }
+
+    Out o = { NULL, 0, 0 };
+    serialize(&o, sds, &key);
+
+    char *path = sidecar_path(dir, key.abspath);
+    char *tmp = sds_alloc(strlen(path) + 32);
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        int err = fchmod(fd, 0644);
+        err |= write_all(fd, o.p, o.len);
+        err |= close(fd);
+        if (err || rename(tmp, path))
+            unlink(tmp);
+    }
+
+    free(tmp);
+    free(path);
+    free(o.p);
+    free(key.abspath);
+    free(dir);
+}
+
+/*
+ * Reading
+ */
+
+typedef struct {
+    const char *p, *end;
+    int bad;
+} Cursor;
+
+static const void *get(Cursor *c, size_t n)
+{
+    if (c->bad || (size_t)(c->end - c->p) < n) {
+        c->bad = 1;
+        return NULL;
+    }
+    const void *p = c->p;
+    c->p += n;
+    return p;
+}
+
+#define GETTER(name, type)                      \
+    static type name(Cursor *c)                 \
+    {                                           \
+        type v = 0;                             \
+        const void *p = get(c, sizeof(v));      \
+        if (p)                                  \
+            memcpy(&v, p, sizeof(v));           \
+        return v;                               \
+    }
+GETTER(get_u32, uint32_t)
+GETTER(get_i32, int32_t)
+GETTER(get_u64, uint64_t)
+GETTER(get_i64, int64_t)
+
+// reads a name, failing on a nul inside it
+static char *get_str(Cursor *c, SDSArena *arena)
+{
+    uint32_t n = get_u32(c);
+    const char *s = get(c, n);
+    if (!s)
+        return NULL;
+    if (memchr(s, '\0', n)) {
+        c->bad = 1;
+        return NULL;
+    }
+    char *str = sds_arena_alloc(arena, n + 1);
+    memcpy(str, s, n);
+    str[n] = '\0';
+    return str;
+}
+
+// reads a 0/1 flag
+static int get_flag(Cursor *c)
+{
+    uint32_t v = get_u32(c);
+    if (v > 1)
+        c->bad = 1;
+    return (int)v;
+}
+
+// reads an SDSType; SDS_NO_TYPE stands for types the backend can't read
+static SDSType get_type(Cursor *c)
+{
+    uint32_t v = get_u32(c);
+    if (v > SDS_STRING) {
+        c->bad = 1;
+        return SDS_NO_TYPE;
+    }
+    return (SDSType)v;
+}
+
+static SDSAttInfo *get_atts(Cursor *c, SDSArena *arena)
+{
+    SDSAttInfo *head = NULL, **tail = &head;
+    uint32_t n = get_u32(c);
+    for (uint32_t i = 0; i < n && !c->bad; i++) {
+        SDSAttInfo *att = ANEW0(arena, SDSAttInfo);
+        att->name = get_str(c, arena);
+        att->type = get_type(c);
+        att->count = get_u64(c);
+        att->bytes = get_u64(c);
+        if (c->bad)
+            break;
+        if ((att->type != SDS_NO_TYPE &&
+             att->bytes != sds_type_size(att->type)) ||
+            (att->bytes != 0 && att->count > SIZE_MAX / att->bytes)) {
+            c->bad = 1;
+            break;
+        }
+        size_t bytes = att->count * att->bytes;
+        const void *data = get(c, bytes);
+        if (!data)
+            break;
+        // strings keep a terminator past count, as the backends leave them
+        att->data.v = sds_arena_alloc0(arena, bytes + 1);
+        memcpy(att->data.v, data, bytes);
+        *tail = att;
+        tail = &att->next;
+    }
+    return head;
+}
+
+static SDSInfo *deserialize(Cursor *c, const FileKey *key, const char *path)
+{
+    const char *magic = get(c, sizeof(META_MAGIC));
+    if (!magic || memcmp(magic, META_MAGIC, sizeof(META_MAGIC)) ||
+        get_u32(c) != META_VERSION || get_u32(c) != META_BOM)
+        return NULL;
+
+    uint32_t n = get_u32(c);
+    const char *abspath = get(c, n);
+    if (!abspath || n != strlen(key->abspath) ||
+        memcmp(abspath, key->abspath, n) || get_u64(c) != key->size ||
+        get_i64(c) != key->mtime_sec || get_i64(c) != key->mtime_nsec ||
+        c->bad)
+        return NULL; // a different file, or this one has changed
+
+    SDSArena *arena = sds_arena_create();
+    SDSInfo *sds = ANEW0(arena, SDSInfo);
+    sds->arena = arena;
+    sds->path = sds_arena_strdup(arena, path);
+    // the type picks the backend, which must be the one the file's magic
+    // number would (NetCDF-3 and -4 share one)
+    sds->type = get_u32(c);
+    SDSFileType ftype = sds_file_type(path);
+    if (sds->type == SDS_NC3_FILE || sds->type == SDS_NC4_FILE) {
+        if (ftype != SDS_NC3_FILE && ftype != SDS_NC4_FILE)
+            c->bad = 1;
+    } else if (sds->type != ftype || ftype == SDS_UNKNOWN_FILE) {
+        c->bad = 1;
+    }
+    sds->id = -1;
+    sds->gatts = get_atts(c, arena);
+
+    uint32_t ndims = get_u32(c);
+    if (ndims > (size_t)(c->end - c->p))
+        c->bad = 1; // each takes more than a byte; don't allocate wildly
+    SDSDimInfo **dims = ANEWA(arena, SDSDimInfo *, c->bad ? 1 : ndims + 1);
+    SDSDimInfo **dtail = &sds->dims;
+    for (uint32_t i = 0; i < ndims && !c->bad; i++) {
+        SDSDimInfo *dim = ANEW0(arena, SDSDimInfo);
+        dim->name = get_str(c, arena);
+        dim->size = get_u64(c);
+        dim->isunlim = get_flag(c);
+        dim->id = get_i32(c);
+        if (dim->id < -1)
+            c->bad = 1;
+        dims[i] = dim;
+        *dtail = dim;
+        dtail = &dim->next;
+    }
+    uint32_t unlim = get_u32(c);
+    if (c->bad || (unlim != UINT32_MAX &&
+                   (unlim >= ndims || !dims[unlim]->isunlim)))
+        c->bad = 1;
+    else
+        sds->unlimdim = (unlim < ndims) ? dims[unlim] : NULL;
+
+    uint32_t nvars = get_u32(c);
+    SDSVarInfo **vtail = &sds->vars;
+    for (uint32_t i = 0; i < nvars && !c->bad; i++) {
+        SDSVarInfo *var = ANEW0(arena, SDSVarInfo);
+        var->name = get_str(c, arena);
+        var->type = get_type(c);
+        var->compress = get_i32(c);
+        var->iscoord = get_flag(c);
+        var->id = get_i32(c);
+        uint32_t nvdims = get_u32(c);
+        if (var->compress < 0 || var->compress > 9 || var->id < 0 ||
+            nvdims > META_MAX_VAR_DIMS)
+            c->bad = 1;
+        if (c->bad)
+            break;
+        var->ndims = nvdims;
+        var->dims = (nvdims == 0) ? NULL : ANEWA(arena, SDSDimInfo *, nvdims);
+        for (uint32_t j = 0; j < nvdims; j++) {
+            uint32_t d = get_u32(c);
+            if (d >= ndims) {
+                c->bad = 1;
+                break;
+            }
+            var->dims[j] = dims[d];
+        }
+        var->atts = get_atts(c, arena);
+        var->sds = sds;
+        *vtail = var;
+        vtail = &var->next;
+    }
+
+    if (c->bad || c->p != c->end) {
+        sds_arena_free(arena);
+        return NULL;
+    }
+    return sds;
+}
+
+/* Returns the metadata of the file at path rebuilt from its sidecar, with
+ * no backend attached yet, or NULL if the cache is off or holds nothing
+ * current for the file.
+ */
+SDSInfo *sds_meta_load(const char *path)
+{
+    char *dir = cache_dir();
+    if (!dir)
+        return NULL;
+    FileKey key;
+    if (file_key(path, &key)) {
+        free(dir);
+        return NULL;
+    }
+    char *meta_path = sidecar_path(dir, key.abspath);
+    free(dir);
+
+    SDSInfo *sds = NULL;
+    int fd = open(meta_path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED) {
+            Cursor c = { base, (const char *)base + st.st_size, 0 };
+            sds = deserialize(&c, &key, path);
+            munmap(base, st.st_size);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(meta_path);
+    free(key.abspath);
+    return sds;
+}
@@ -19,6 +19,14 @@ static void netcdf_error(const char *filename, int status,
 #define CHECK_NC_ERROR(filename,status) \
     if ((status) != NC_NOERR) netcdf_error(filename,status,__FILE__,__LINE__)
 
+// classic format mapping from sds_cdf.c
+CDFMap *sds_cdf_open(const char *path);
+void sds_cdf_close(CDFMap *map);
+void *sds_cdf_readv_strided(SDSVarInfo *var, void *dst, const int *start,
+                            const int *count, const ptrdiff_t *strides);
+void *sds_cdf_readvs(SDSVarInfo *var, void *dst, const int *start,
+                     const int *count, const int *stride);
+
 typedef struct {
     void (*free)(void *);
     const char *path;
@@ -30,9 +38,7 @@ static void nc_buffer_free(NCBuffer *buf)
 {
     assert(buf->free == (void (*)(void *))nc_buffer_free);
 
-    if (buf->data) {
-        free(buf->data);
-    }
+    sds_pool_put(buf->data, buf->size);
     free(buf);
 }
 
@@ -48,84 +54,82 @@ static NCBuffer *nc_buffer_create(SDSInfo *sds)
 
 static void nc_buffer_ensure(NCBuffer *buf, size_t cap_needed)
 {
-    if (buf->size < cap_needed) {
-        buf->data = sds_realloc(buf->data, cap_needed);
-        buf->size = cap_needed;
-    }
+    sds_pool_ensure(&buf->data, &buf->size, cap_needed);
 }
 
-static void *var_readv(SDSVarInfo *var, void **bufp,
-                       const int *start, const int *count)
+/* Fills nc_start and nc_count (of at least one element each) from the
+ * start/count hyperslab of var, returning the number of elements in it.
+ */
+static size_t nc_slab(SDSVarInfo *var, const int *start, const int *count,
+                      size_t *nc_start, size_t *nc_count)
 {
-    int status;
-
-    int ndims = var->ndims;
-    if (ndims < 1) ndims = 1;
-    size_t *nc_start = ALLOCA(size_t, ndims);
-    size_t *nc_count = ALLOCA(size_t, ndims);
-    size_t bufsize = sds_type_size(var->type);
-
+    size_t n = 1;
     if (var->ndims < 1) {
         nc_start[0] = 0;
         nc_count[0] = 1;
-    } else {
-        for (int i = 0; i < var->ndims; i++) {
-            if (!start || start[i] < 0)
-                nc_start[i] = 0;
-            else
-                nc_start[i] = (size_t)start[i];
-
-            if (!count || count[i] < 0)
-                nc_count[i] = var->dims[i]->size - nc_start[i];
-            else
-                nc_count[i] = (size_t)count[i];
-
-            bufsize *= nc_count[i];
-        }
+        return n;
     }
+    for (int i = 0; i < var->ndims; i++) {
+        if (!start || start[i] < 0)
+            nc_start[i] = 0;
+        else
+            nc_start[i] = (size_t)start[i];
 
-    NCBuffer *buf = (NCBuffer *)*bufp;
-    if (buf) {
-        assert(buf->free == (void (*)(void *))nc_buffer_free);
-    } else {
-        *((NCBuffer **)bufp) = buf = nc_buffer_create(var->sds);
+        if (!count || count[i] < 0)
+            nc_count[i] = var->dims[i]->size - nc_start[i];
+        else
+            nc_count[i] = (size_t)count[i];
+
+        n *= nc_count[i];
     }
-    nc_buffer_ensure(buf, bufsize);
+    return n;
+}
+
+/* Reads a hyperslab into dst, laid out according to imap (element strides
+ * of each dimension in dst, as for nc_get_varm()), or packed if imap is
+ * NULL.  nc_stride picks every so many elements in the file, or all of
+ * them if NULL.  Call it with the I/O lock held.
+ */
+static void get_slab_locked(SDSVarInfo *var, const size_t *nc_start,
+                            const size_t *nc_count, const ptrdiff_t *nc_stride,
+                            const ptrdiff_t *imap, void *dst)
+{
+    int status;
 
 #if HAVE_NETCDF4
-    status = nc_get_vars(var->sds->id, var->id, nc_start, nc_count,
-                         NULL, buf->data);
+    status = nc_get_varm(var->sds->id, var->id, nc_start, nc_count,
+                         nc_stride, imap, dst);
     CHECK_NC_ERROR(var->sds->path, status);
 #else
     switch (var->type) {
     case SDS_I8:
-        status = nc_get_vars_uchar(var->sds->id, var->id, nc_start, nc_count,
-                                   NULL, (unsigned char*)buf->data);
+        status = nc_get_varm_uchar(var->sds->id, var->id, nc_start, nc_count,
+                                   nc_stride, imap, (unsigned char*)dst);
         CHECK_NC_ERROR(var->sds->path, status);
         break;
     case SDS_I16:
-        status = nc_get_vars_short(var->sds->id, var->id, nc_start, nc_count,
-                                   NULL, (short*)buf->data);
+        status = nc_get_varm_short(var->sds->id, var->id, nc_start, nc_count,
+                                   nc_stride, imap, (short*)dst);
         CHECK_NC_ERROR(var->sds->path, status);
         break;
     case SDS_I32:
-        status = nc_get_vars_int(var->sds->id, var->id, nc_start, nc_count,
-                                 NULL, (int*)buf->data);
+        status = nc_get_varm_int(var->sds->id, var->id, nc_start, nc_count,
+                                 nc_stride, imap, (int*)dst);
         CHECK_NC_ERROR(var->sds->path, status);
         break;
     case SDS_FLOAT:
-        status = nc_get_vars_float(var->sds->id, var->id, nc_start, nc_count,
-                                   NULL, (float*)buf->data);
+        status = nc_get_varm_float(var->sds->id, var->id, nc_start, nc_count,
+                                   nc_stride, imap, (float*)dst);
         CHECK_NC_ERROR(var->sds->path, status);
         break;
     case SDS_DOUBLE:
-        status = nc_get_vars_double(var->sds->id, var->id, nc_start, nc_count,
-                                    NULL, (double*)buf->data);
+        status = nc_get_varm_double(var->sds->id, var->id, nc_start, nc_count,
+                                    nc_stride, imap, (double*)dst);
         CHECK_NC_ERROR(var->sds->path, status);
         break;
     case SDS_STRING:
-        status = nc_get_vars_text(var->sds->id, var->id, nc_start, nc_count,
-                                  NULL, (char*)buf->data);
+        status = nc_get_varm_text(var->sds->id, var->id, nc_start, nc_count,
+                                  nc_stride, imap, (char*)dst);
         CHECK_NC_ERROR(var->sds->path, status);
         break;
     case SDS_NO_TYPE:
@@ -134,6 +138,107 @@ static void *var_readv(SDSVarInfo *var, void **bufp,
         break;
     }
 #endif
+}
+
+/* get_slab_locked() for any file.  Mapped classic files are read holding
+ * only their own lock (sds->own_lock; see sds_file_lock()), so the library
+ * calls they fall back on take the I/O lock here.
+ */
+static void get_slab(SDSVarInfo *var, const size_t *nc_start,
+                     const size_t *nc_count, const ptrdiff_t *nc_stride,
+                     const ptrdiff_t *imap, void *dst)
+{
+    if (var->sds->own_lock)
+        sds_io_lock();
+    get_slab_locked(var, nc_start, nc_count, nc_stride, imap, dst);
+    if (var->sds->own_lock)
+        sds_io_unlock();
+}
+
+static NCBuffer *prep_buffer(SDSVarInfo *var, void **bufp, size_t bufsize)
+{
+    NCBuffer *buf = (NCBuffer *)*bufp;
+    if (buf) {
+        assert(buf->free == (void (*)(void *))nc_buffer_free);
+    } else {
+        *((NCBuffer **)bufp) = buf = nc_buffer_create(var->sds);
+    }
+    nc_buffer_ensure(buf, bufsize);
+    return buf;
+}
+
+static void *var_readv(SDSVarInfo *var, void **bufp,
+                       const int *start, const int *count)
+{
+    int ndims = var->ndims;
+    if (ndims < 1) ndims = 1;
+    size_t *nc_start = ALLOCA(size_t, ndims);
+    size_t *nc_count = ALLOCA(size_t, ndims);
+    size_t bufsize = nc_slab(var, start, count, nc_start, nc_count) *
+        sds_type_size(var->type);
+
+    NCBuffer *buf = prep_buffer(var, bufp, bufsize);
+
+    // classic files can be copied straight out of the mapping
+    if (var->sds->cdf && sds_readv_view(var, buf->data, start, count))
+        return buf->data;
+
+    get_slab(var, nc_start, nc_count, NULL, NULL, buf->data);
+    return buf->data;
+}
+
+/* Reads straight into the caller's array.  Classic files are copied out
+ * of the mapping, unless the destination is strided along the last
+ * dimension: that's a transpose, which sds_readv_into() does faster a
+ * block at a time than the mapping can be scattered an element at a time.
+ * NetCDF-4 files are left to sds_readv_into() when strided, since
+ * nc_get_varm() reads them a row at a time through HDF5, which is far
+ * slower than reading once and scattering.
+ */
+static int var_readv_into(SDSVarInfo *var, void *dst, const int *start,
+                          const int *count, const ptrdiff_t *strides)
+{
+    if (var->sds->cdf) {
+        if (strides && var->ndims > 0 && strides[var->ndims - 1] != 1)
+            return -1;
+        if (strides ? sds_cdf_readv_strided(var, dst, start, count, strides) :
+            sds_readv_view(var, dst, start, count))
+            return 0;
+    } else if (strides && var->sds->type == SDS_NC4_FILE) {
+        return -1;
+    }
+
+    int ndims = var->ndims;
+    if (ndims < 1) ndims = 1;
+    size_t *nc_start = ALLOCA(size_t, ndims);
+    size_t *nc_count = ALLOCA(size_t, ndims);
+    if (nc_slab(var, start, count, nc_start, nc_count) > 0)
+        get_slab(var, nc_start, nc_count, NULL,
+                 var->ndims < 1 ? NULL : strides, dst);
+    return 0;
+}
+
+/* Reads every stride[i]'th element; sds_readvs() fills in start, count and
+ * stride.  For classic files nc_get_vars() makes a library call per
+ * element, so those are picked straight out of the mapping instead.
+ */
+static void *var_readvs(SDSVarInfo *var, void **bufp, const int *start,
+                        const int *count, const int *stride)
+{
+    int ndims = var->ndims;
+    size_t *nc_start = ALLOCA(size_t, ndims);
+    size_t *nc_count = ALLOCA(size_t, ndims);
+    ptrdiff_t *nc_stride = ALLOCA(ptrdiff_t, ndims);
+    size_t n = nc_slab(var, start, count, nc_start, nc_count);
+    for (int i = 0; i < ndims; i++)
+        nc_stride[i] = stride[i];
+
+    NCBuffer *buf = prep_buffer(var, bufp, n * sds_type_size(var->type));
+    if (var->sds->cdf &&
+        sds_cdf_readvs(var, buf->data, start, count, stride))
+        return buf->data;
+    if (n > 0)
+        get_slab(var, nc_start, nc_count, nc_stride, NULL, buf->data);
     return buf->data;
 }
 
@@ -203,12 +308,21 @@ static void close_nc(SDSInfo *sds)
 {
     int status = nc_close(sds->id);
     CHECK_NC_ERROR(sds->path, status);
+    sds_cdf_close(sds->cdf);
+    sds->cdf = NULL;
 }
 
+static void *load_att(SDSInfo *sds, SDSAttInfo *att);
+static int load_compress(SDSVarInfo *var);
+
 static struct SDS_Funcs nc_funcs = {
     var_readv,
+    var_readv_into,
+    var_readvs,
     var_writev,
-    close_nc
+    close_nc,
+    load_att,
+    load_compress
 };
 
 static SDSType nc_to_sds_type(nc_type type)
@@ -254,15 +368,48 @@ static nc_type sds_to_nc_type(SDSType type)
     abort();
 }
 
-static SDSAttInfo *read_attributes(const char *path, int ncid, int id,
-                                   int natts)
+/* Reads an attribute's values into a buffer from the arena.  count is one
+ * more than in the file for strings, to hold a terminating NUL.
+ */
+static void *get_att_data(SDSArena *arena, const char *path, int ncid, int id,
+                          const char *name, SDSType type, size_t count,
+                          size_t bytes)
+{
+    void *data = sds_arena_alloc(arena, count * bytes);
+    int status = nc_get_att(ncid, id, name, data);
+    CHECK_NC_ERROR(path, status);
+    if (type == SDS_STRING) {
+        ((char *)data)[count - 1] = '\0';
+    }
+    return data;
+}
+
+static void *load_att(SDSInfo *sds, SDSAttInfo *att)
+{
+    return get_att_data(sds->arena, sds->path, sds->id, att->objid, att->name,
+                        att->type, att->count, att->bytes);
+}
+
+static int load_compress(SDSVarInfo *var)
+{
+    int level = 0;
+#if HAVE_NETCDF4
+    int status = nc_inq_var_deflate(var->sds->id, var->id, NULL, NULL, &level);
+    CHECK_NC_ERROR(var->sds->path, status);
+#endif
+    return level;
+}
+
+static SDSAttInfo *read_attributes(SDSInfo *sds, int ncid, int id, int natts,
+                                   int lazy)
 {
+    SDSArena *arena = sds->arena;
+    const char *path = sds->path;
     SDSAttInfo *att, *att_list = NULL;
     char buf[NC_MAX_NAME + 1];
     int status, i;
     nc_type type;
     size_t count, bytes;
-    void *data;
 
     for (i = 0; i < natts; i++) {
         status = nc_inq_attname(ncid, id, i, buf);
@@ -297,19 +444,16 @@ static SDSAttInfo *read_attributes(const char *path, int ncid, int id,
         default: abort(); break;
         }
 #endif
-        data = sds_alloc(count * bytes);
-        status = nc_get_att(ncid, id, buf, data);
-        CHECK_NC_ERROR(path, status);
-        if (type == NC_CHAR) {
-            ((char *)data)[count - 1] = '\0';
-        }
-
-        att = NEW(SDSAttInfo);
-        att->name = sds_strdup(buf);
+        att = ANEW0(arena, SDSAttInfo);
+        att->name = sds_arena_strdup(arena, buf);
         att->type = nc_to_sds_type(type);
         att->count = count;
         att->bytes = bytes;
-        att->data.v = data;
+        att->data.v = lazy ? NULL : get_att_data(arena, path, ncid, id, buf,
+                                                 att->type, count, bytes);
+        att->sds = lazy ? sds : NULL;
+        att->objid = id;
+        att->index = i;
 
         att->next = att_list;
         att_list = att;
@@ -349,21 +493,26 @@ static void map_dimids(SDSVarInfo *vi, int *dimids, SDSDimInfo *dims)
 }
 
 /* Opens a NetCDF file and reads all its metadata, returning an SDSInfo
- * structure containing this metadata.  Returns NULL on error.
+ * structure containing this metadata.  Returns NULL on error.  If lazy is
+ * set, attribute values and compression levels are left to be read on
+ * first use (see sds_open_lazy()).
  */
-SDSInfo *sds_nc_open(const char *path)
+SDSInfo *sds_nc_open(const char *path, int lazy)
 {
     int ids[MAX(MAX(NC_MAX_DIMS, NC_MAX_ATTRS), NC_MAX_VARS)];
     int dimids[NC_MAX_VAR_DIMS], unlimdimid;
     char buf[NC_MAX_NAME + 1];
     int ncid, status, i, ndims, nvars, ngatts;
+    SDSArena *arena;
     SDSInfo *sds;
 
     status = nc_open(path, NC_NOWRITE, &ncid);
     CHECK_NC_ERROR(path, status);
 
-    sds = NEW0(SDSInfo);
-    sds->path = sds_strdup(path);
+    arena = sds_arena_create();
+    sds = ANEW0(arena, SDSInfo);
+    sds->arena = arena;
+    sds->path = sds_arena_strdup(arena, path);
     sds->id = ncid;
 
 #if HAVE_NETCDF4
@@ -387,13 +536,17 @@ SDSInfo *sds_nc_open(const char *path)
     sds->type = SDS_NC3_FILE;
 #endif
 
+    if (sds->type == SDS_NC3_FILE)
+        sds->cdf = sds_cdf_open(path);
+    sds->own_lock = (sds->cdf != NULL);
+
     /* get counts for everything */
     unlimdimid = -1;
     status = nc_inq(ncid, &ndims, &nvars, &ngatts, &unlimdimid);
     CHECK_NC_ERROR(path, status);
 
     /* read global attributes */
-    sds->gatts = read_attributes(path, ncid, NC_GLOBAL, ngatts);
+    sds->gatts = read_attributes(sds, ncid, NC_GLOBAL, ngatts, lazy);
 
     /* read dimension info */
 #if HAVE_NETCDF4
@@ -410,8 +563,8 @@ SDSInfo *sds_nc_open(const char *path)
         status = nc_inq_dim(ncid, ids[i], buf, &size);
         CHECK_NC_ERROR(path, status);
 
-        dim = NEW(SDSDimInfo);
-        dim->name = sds_strdup(buf);
+        dim = ANEW0(arena, SDSDimInfo);
+        dim->name = sds_arena_strdup(arena, buf);
         dim->size = size;
         dim->isunlim = (ids[i] == unlimdimid);
         dim->id = ids[i];
@@ -440,23 +593,22 @@ SDSInfo *sds_nc_open(const char *path)
         status = nc_inq_var(ncid, ids[i], buf, &type, &nvdims, dimids, &natts);
         CHECK_NC_ERROR(path, status);
 
-        vi = NEW(SDSVarInfo);
-        vi->name = sds_strdup(buf);
+        vi = ANEW0(arena, SDSVarInfo);
+        vi->name = sds_arena_strdup(arena, buf);
         vi->type = nc_to_sds_type(type);
         vi->iscoord = is_coord_var(sds->dims, buf);
         vi->ndims = nvdims;
         vi->id = ids[i];
-        vi->dims = (nvdims == 0) ? NULL : NEWA(SDSDimInfo *, ndims);
+        vi->dims = (nvdims == 0) ? NULL : ANEWA(arena, SDSDimInfo *, nvdims);
         map_dimids(vi, dimids, sds->dims);
 
-#if HAVE_NETCDF4
-        status = nc_inq_var_deflate(ncid, ids[i], NULL, NULL, &vi->compress);
-        CHECK_NC_ERROR(path, status);
-#endif
-
-        vi->atts = read_attributes(path, ncid, ids[i], natts);
-
         vi->sds = sds;
+        if (lazy && sds->type == SDS_NC4_FILE)
+            vi->compress = -1;
+        else
+            vi->compress = load_compress(vi);
+
+        vi->atts = read_attributes(sds, ncid, ids[i], natts, lazy);
 
         vi->next = sds->vars;
         sds->vars = vi;
@@ -467,6 +619,54 @@ SDSInfo *sds_nc_open(const char *path)
     return sds;
 }
 
+/* Whether every variable of metadata rebuilt from a sidecar has the id,
+ * type and shape the library gives it, so reads (including those through
+ * the classic mapping, which trusts the shapes) stay within its data.
+ */
+static int shapes_match(SDSInfo *sds)
+{
+    int nvars;
+    if (nc_inq_nvars(sds->id, &nvars) != NC_NOERR)
+        return 0;
+    for (SDSVarInfo *var = sds->vars; var != NULL; var = var->next) {
+        nc_type type;
+        int ndims, dimids[NC_MAX_VAR_DIMS];
+        if (var->id < 0 || var->id >= nvars ||
+            nc_inq_var(sds->id, var->id, NULL, &type, &ndims, dimids,
+                       NULL) != NC_NOERR ||
+            nc_to_sds_type(type) != var->type || ndims != var->ndims)
+            return 0;
+        for (int i = 0; i < ndims; i++) {
+            size_t len;
+            if (nc_inq_dimlen(sds->id, dimids[i], &len) != NC_NOERR ||
+                len != var->dims[i]->size)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Opens the file behind metadata rebuilt from a sidecar (see sds_meta.c)
+ * for reading, without asking the library for the metadata again beyond
+ * the variables' shapes.  Returns -1 if those don't match, so the file's
+ * metadata is read from it instead.
+ */
+int sds_nc_attach(SDSInfo *sds)
+{
+    int status = nc_open(sds->path, NC_NOWRITE, &sds->id);
+    CHECK_NC_ERROR(sds->path, status);
+    if (!shapes_match(sds)) {
+        nc_close(sds->id);
+        sds->id = -1;
+        return -1;
+    }
+    if (sds->type == SDS_NC3_FILE)
+        sds->cdf = sds_cdf_open(sds->path);
+    sds->own_lock = (sds->cdf != NULL);
+    sds->funcs = &nc_funcs;
+    return 0;
+}
+
 static void def_atts(const char *path, int ncid, int varid, SDSAttInfo *att)
 {
     int status;
@@ -523,6 +723,7 @@ void write_as_nc_sds(const char *path, SDSInfo *sds)
         abort();
     }
 
+    sds_io_lock();
     int status, ncid, flags = 0;
 #if HAVE_NETCDF4
     if (sds->type == SDS_NC4_FILE)
@@ -570,7 +771,7 @@ void write_as_nc_sds(const char *path, SDSInfo *sds)
 
     nc_enddef(ncid);
 
-    sds->path = sds_strdup(path);
+    sds->path = sds_arena_strdup(sds->arena, path);
 #if HAVE_NETCDF4
     sds->type = SDS_NC4_FILE;
 #else
@@ -578,4 +779,5 @@ void write_as_nc_sds(const char *path, SDSInfo *sds)
 #endif
     sds->id = ncid;
     sds->funcs = &nc_funcs;
+    sds_io_unlock();
 }
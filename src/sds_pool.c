@@ -0,0 +1,211 @@
+/* sds_pool.c - Process-wide pool of aligned buffers for read data.
+ *
+ * Every sds_readv() buffer used to realloc() to exactly the size of each
+ * bigger read, so jobs reading many variables kept freeing big blocks and
+ * faulting in fresh pages for new ones.  Backend buffers now take their
+ * memory from here in a few size classes, and give it back when they grow
+ * or are freed, so the next read of a similar size reuses warm pages.
+ * Buffers are aligned to a cache line, or optionally to a 2 MB huge page.
+ */
+#define _GNU_SOURCE // madvise(), MADV_HUGEPAGE
+#include "sds.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define POOL_ALIGN 64
+#define POOL_MIN_BYTES 4096
+#define HUGE_PAGE_BYTES (2 << 20)
+#define DEFAULT_LIMIT (256 << 20)
+
+// an idle buffer
+typedef struct PoolEntry {
+    struct PoolEntry *prev, *next; // newest first
+    void *data;
+    size_t capacity;
+} PoolEntry;
+
+static struct {
+    pthread_mutex_t mutex;
+    PoolEntry *head, *tail;
+    size_t limit; // most idle bytes to keep
+    int huge;     // align big buffers to huge pages
+    SDSPoolStats stats;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, NULL, NULL, DEFAULT_LIMIT, 0,
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+/* Rounds a size up to its size class: a quarter step between powers of
+ * two (1, 1.25, 1.5, 1.75 x 2^k), so at most a quarter is wasted.  Huge
+ * page buffers are whole numbers of huge pages.
+ */
+static size_t size_class(size_t bytes, int huge)
+{
+    if (bytes <= POOL_MIN_BYTES)
+        return POOL_MIN_BYTES;
+    size_t pow = POOL_MIN_BYTES;
+    while (pow < bytes / 2)
+        pow *= 2;
+    size_t step = pow / 4;
+    size_t cap = (bytes + step - 1) / step * step;
+    if (huge && cap >= HUGE_PAGE_BYTES)
+        cap = (cap + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    return cap;
+}
+
+static void *alloc_aligned(size_t capacity, int huge)
+{
+    size_t align = (huge && capacity >= HUGE_PAGE_BYTES) ?
+        HUGE_PAGE_BYTES : POOL_ALIGN;
+    void *p;
+    if (posix_memalign(&p, align, capacity)) {
+        fprintf(stderr, "Failed to allocate %u byte buffer\n",
+                (unsigned)capacity);
+        abort();
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == HUGE_PAGE_BYTES)
+        madvise(p, capacity, MADV_HUGEPAGE); // just a hint; ignore failure
+#endif
+    return p;
+}
+
+static void unlink_entry(PoolEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        pool.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        pool.tail = e->prev;
+    pool.stats.idle_bytes -= e->capacity;
+}
+
+// frees the oldest idle buffers until no more than limit bytes are idle
+static void trim_to(size_t limit)
+{
+    while (pool.tail && pool.stats.idle_bytes > limit) {
+        PoolEntry *e = pool.tail;
+        unlink_entry(e);
+        pool.stats.trimmed += e->capacity;
+        free(e->data);
+        free(e);
+    }
+}
+
+/* Returns a buffer of at least bytes bytes from the pool, allocating one
+ * if no idle buffer of the right size class is held, and sets *capacity to
+ * its actual size.  Give it back with sds_pool_put().
+ */
+void *sds_pool_get(size_t bytes, size_t *capacity)
+{
+    pthread_mutex_lock(&pool.mutex);
+    size_t cap = size_class(bytes, pool.huge);
+    int huge = pool.huge;
+    pool.stats.gets++;
+
+    PoolEntry *e = pool.head;
+    while (e && e->capacity != cap)
+        e = e->next;
+    void *data = NULL;
+    if (e) {
+        pool.stats.hits++;
+        unlink_entry(e);
+        data = e->data;
+        free(e);
+    }
+    pool.stats.inuse_bytes += cap;
+    if (pool.stats.inuse_bytes > pool.stats.peak_bytes)
+        pool.stats.peak_bytes = pool.stats.inuse_bytes;
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (!data)
+        data = alloc_aligned(cap, huge);
+    *capacity = cap;
+    return data;
+}
+
+/* Returns a buffer from sds_pool_get() to the pool.  capacity must be the
+ * size it was given out with.  data may be NULL.
+ */
+void sds_pool_put(void *data, size_t capacity)
+{
+    if (!data)
+        return;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.stats.inuse_bytes -= capacity;
+    if (capacity > pool.limit) {
+        pool.stats.trimmed += capacity;
+        pthread_mutex_unlock(&pool.mutex);
+        free(data);
+        return;
+    }
+
+    PoolEntry *e = NEW(PoolEntry);
+    e->data = data;
+    e->capacity = capacity;
+    e->prev = NULL;
+    e->next = pool.head;
+    if (pool.head)
+        pool.head->prev = e;
+    else
+        pool.tail = e;
+    pool.head = e;
+    pool.stats.idle_bytes += capacity;
+    trim_to(pool.limit);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/* Gives a backend buffer's data at least bytes bytes, swapping it for a
+ * bigger pool buffer if need be.  The contents aren't kept.  *capacity is
+ * the size of *datap, 0 if it's NULL.
+ */
+void sds_pool_ensure(void **datap, size_t *capacity, size_t bytes)
+{
+    if (*datap && *capacity >= bytes)
+        return;
+    sds_pool_put(*datap, *capacity);
+    *datap = sds_pool_get(bytes, capacity);
+}
+
+/* Sets the most bytes of idle buffers the pool keeps (256 MB by default),
+ * freeing the oldest ones beyond that.  0 turns pooling off.
+ */
+void sds_pool_set_limit(size_t bytes)
+{
+    pthread_mutex_lock(&pool.mutex);
+    pool.limit = bytes;
+    trim_to(bytes);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/* Whether buffers of 2 MB or more should be huge-page aligned and sized,
+ * and marked for transparent huge pages where the OS has them.  Affects
+ * buffers allocated from now on.
+ */
+void sds_pool_set_huge_pages(int on)
+{
+    pthread_mutex_lock(&pool.mutex);
+    pool.huge = on;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/* Frees all idle buffers.
+ */
+void sds_pool_trim(void)
+{
+    pthread_mutex_lock(&pool.mutex);
+    trim_to(0);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void sds_pool_stats(SDSPoolStats *stats)
+{
+    pthread_mutex_lock(&pool.mutex);
+    *stats = pool.stats;
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,245 @@
+/* sds_prefetch.c - Background read-ahead of a record variable's timesteps.
+ *
+ * Once sds_prefetch_start() is called for a variable, sds_timestep() on it
+ * is served from a ring of buffers.  While the timesteps asked for run in
+ * order, a background thread keeps the next few read ahead, so the caller's
+ * work on timestep t overlaps reading t+1 and on.  Any other access pattern
+ * just reads on demand.
+ */
+#include "sds.h"
+#include <pthread.h>
+#include <stdio.h>
+
+// private locked backend read from sds.c
+void *sds_backend_readv(SDSVarInfo *var, void **bufp,
+                        const int *start, const int *count);
+
+enum { SLOT_EMPTY, SLOT_LOADING, SLOT_READY };
+
+typedef struct {
+    int state;
+    int tstep;
+    int used; // handed to the caller since it was read
+    void *buf; // backend buffer the timestep was read into
+    void *data;
+} Slot;
+
+struct SDSPrefetch {
+    SDSVarInfo *var;
+    int depth; // number of slots
+    Slot *slots;
+    int ntsteps;
+    int last;       // last timestep asked for, or -1
+    int sequential; // were the last two requests in order?
+    int held;       // slot the caller's data is in, or -1
+    int quit;
+    SDSPrefetchStats stats;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // signalled whenever a slot or the window changes
+};
+
+static void read_tstep(SDSPrefetch *pf, Slot *slot, int tstep)
+{
+    SDSVarInfo *var = pf->var;
+    int *start = ALLOCA(int, var->ndims);
+    int *count = ALLOCA(int, var->ndims);
+    start[0] = tstep;
+    count[0] = 1;
+    for (int i = 1; i < var->ndims; i++) {
+        start[i] = 0;
+        count[i] = -1;
+    }
+    slot->data = sds_backend_readv(var, &slot->buf, start, count);
+}
+
+static Slot *find_tstep(SDSPrefetch *pf, int tstep)
+{
+    for (int i = 0; i < pf->depth; i++)
+        if (pf->slots[i].state != SLOT_EMPTY && pf->slots[i].tstep == tstep)
+            return pf->slots + i;
+    return NULL;
+}
+
+// whether tstep is among the ones the thread should have read ahead
+static int in_window(const SDSPrefetch *pf, int tstep)
+{
+    return pf->sequential && tstep > pf->last && tstep < pf->ntsteps &&
+        tstep <= pf->last + pf->depth - 1;
+}
+
+// a slot that may be overwritten: not being read, not the caller's, and not
+// holding a timestep still to come
+static Slot *free_slot(SDSPrefetch *pf)
+{
+    for (int i = 0; i < pf->depth; i++) {
+        Slot *slot = pf->slots + i;
+        if (i != pf->held && slot->state != SLOT_LOADING &&
+            (slot->state == SLOT_EMPTY || !in_window(pf, slot->tstep)))
+            return slot;
+    }
+    return NULL;
+}
+
+static void reuse_slot(SDSPrefetch *pf, Slot *slot, int tstep)
+{
+    if (slot->state == SLOT_READY && !slot->used)
+        pf->stats.wasted++;
+    slot->state = SLOT_LOADING;
+    slot->tstep = tstep;
+    slot->used = 0;
+}
+
+static void *prefetch_main(void *arg)
+{
+    SDSPrefetch *pf = arg;
+    pthread_mutex_lock(&pf->mutex);
+    while (!pf->quit) {
+        // the first timestep in the window that isn't read or being read
+        int tstep = -1;
+        if (pf->sequential)
+            for (int t = pf->last + 1; in_window(pf, t); t++)
+                if (!find_tstep(pf, t)) {
+                    tstep = t;
+                    break;
+                }
+        Slot *slot = (tstep < 0) ? NULL : free_slot(pf);
+        if (!slot) {
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+            continue;
+        }
+
+        reuse_slot(pf, slot, tstep);
+        pthread_mutex_unlock(&pf->mutex);
+        read_tstep(pf, slot, tstep);
+        pthread_mutex_lock(&pf->mutex);
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+/* Turns on read-ahead for sds_timestep() calls on the given record
+ * variable, keeping up to depth - 1 timesteps read ahead of the last one
+ * asked for while they're asked for in order.  The pointer sds_timestep()
+ * returns for the variable then stays valid only until the next
+ * sds_timestep() call on it, whichever buffer is passed, and the reads
+ * happen under the file's lock (see sds_file_lock()).  Returns 0, or -1 if the
+ * variable isn't along an unlimited dimension.
+ *
+ * depth - number of timestep buffers; values < 2 mean 2.
+ */
+int sds_prefetch_start(SDSVarInfo *var, int depth)
+{
+    if (var->ndims < 1 || !var->dims[0]->isunlim)
+        return -1;
+    if (var->prefetch)
+        sds_prefetch_stop(var);
+    if (depth < 2)
+        depth = 2;
+
+    SDSPrefetch *pf = NEW(SDSPrefetch);
+    pf->var = var;
+    pf->depth = depth;
+    pf->slots = sds_alloc0(sizeof(Slot) * depth);
+    pf->ntsteps = (int)var->dims[0]->size;
+    pf->last = -1;
+    pf->sequential = 0;
+    pf->held = -1;
+    pf->quit = 0;
+    pf->stats = (SDSPrefetchStats){ 0, 0, 0, 0, 0 };
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetch_main, pf)) {
+        fprintf(stderr, "Failed to create prefetch thread for %s\n",
+                var->name);
+        abort();
+    }
+
+    var->prefetch = pf;
+    sds_io_lock();
+    var->sds->nprefetch++;
+    sds_io_unlock();
+    return 0;
+}
+
+/* Returns the data of the given timestep, waiting for it if it's being
+ * read ahead or reading it now if not.  sds_timestep() calls this for
+ * variables with read-ahead on.
+ */
+void *sds_prefetch_get(SDSPrefetch *pf, int tstep)
+{
+    pthread_mutex_lock(&pf->mutex);
+    pf->stats.requests++;
+    pf->sequential = (tstep == pf->last + 1);
+    pf->last = tstep;
+    pf->held = -1; // the caller is done with the last one
+
+    Slot *slot = find_tstep(pf, tstep);
+    if (slot && slot->state == SLOT_READY) {
+        pf->stats.hits++;
+    } else if (slot) {
+        pf->stats.waits++;
+        while (slot->state != SLOT_READY)
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+    } else {
+        // not read ahead: read it here, in a slot the thread won't touch
+        pf->stats.misses++;
+        while (!(slot = free_slot(pf)))
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        reuse_slot(pf, slot, tstep);
+        pthread_mutex_unlock(&pf->mutex);
+        read_tstep(pf, slot, tstep);
+        pthread_mutex_lock(&pf->mutex);
+        slot->state = SLOT_READY;
+    }
+
+    slot->used = 1;
+    pf->held = (int)(slot - pf->slots);
+    void *data = slot->data;
+    pthread_cond_broadcast(&pf->cond); // the window moved
+    pthread_mutex_unlock(&pf->mutex);
+    return data;
+}
+
+void sds_prefetch_stats(SDSVarInfo *var, SDSPrefetchStats *stats)
+{
+    SDSPrefetch *pf = var->prefetch;
+    if (!pf) {
+        *stats = (SDSPrefetchStats){ 0, 0, 0, 0, 0 };
+        return;
+    }
+    pthread_mutex_lock(&pf->mutex);
+    *stats = pf->stats;
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+/* Turns off read-ahead for the variable, waiting for any read in progress
+ * and freeing the buffers.  sds_close() does this for you.
+ */
+void sds_prefetch_stop(SDSVarInfo *var)
+{
+    SDSPrefetch *pf = var->prefetch;
+    if (!pf)
+        return;
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->quit = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    pthread_join(pf->thread, NULL);
+
+    for (int i = 0; i < pf->depth; i++)
+        if (pf->slots[i].buf)
+            sds_buffer_free(pf->slots[i].buf);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    free(pf->slots);
+    free(pf);
+    var->prefetch = NULL;
+    sds_io_lock();
+    var->sds->nprefetch--;
+    sds_io_unlock();
+}
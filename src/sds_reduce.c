@@ -0,0 +1,798 @@
+/* sds_reduce.c - Streaming reductions (min, max, sum, count, mean and
+ *                variance) of a variable over any set of its dimensions.
+ *
+ * The variable is read a tile at a time, each tile being a run of whole
+ * rows along some dimension that fits the memory budget, so a reduction
+ * never holds more than a few tiles however big the variable is.  Tiles
+ * are handed out to worker threads: reads are serialized by the file's lock
+ * as usual, but the arithmetic on one tile overlaps the read of the next.
+ * Where tiles would add into the same cells of the result, the work goes
+ * out instead as slabs along a dimension that is kept, so no two threads
+ * ever add into one cell.
+ *
+ * Each cell of the result keeps a count, a minimum, a maximum and sums of
+ * the values and their squares taken about a shift: the first value the
+ * cell saw.  Shifting keeps the variance accurate for data like
+ * temperatures in Kelvin, whose spread is tiny next to their mean.
+ * Values are accumulated in double whatever the type of the variable;
+ * float and double data have AVX2 kernels, everything else goes through
+ * plain C loops.
+ */
+#include "sds.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SDS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// memory budget for tiles when the caller doesn't give one
+#define DEFAULT_BUDGET (64 << 20)
+
+// smallest tile worth a read of its own, unless the variable is smaller
+#define MIN_TILE_BYTES (256 << 10)
+
+// cells updated per pass over the rows of a tile, when each row spreads
+// over many cells; their sums then stay in cache between rows
+#define ROW_BLOCK 1024
+
+/* Running totals of the cells of a reduction, one array element per cell.
+ * Counts are kept as doubles (exact up to 2^53) so the SIMD kernels can
+ * work on all of them alike.
+ */
+typedef struct {
+    double *cnt;   // values seen
+    double *sum;   // sum of (value - shift)
+    double *sq;    // sum of (value - shift)^2
+    double *min;
+    double *max;
+    double *shift; // first value seen
+} Cells;
+
+/* Which values to leave out, and how many were.
+ */
+typedef struct {
+    int has_fill;
+    double fill;
+    int has_missing;
+    double missing;
+    size_t nfill; // values equal to fill or missing
+    size_t nnan;  // NaN values
+} Screen;
+
+// adds n values at src into the one cell
+typedef void (*RunFunc)(const void *src, size_t n, Cells *c, size_t cell,
+                        Screen *sc);
+// adds value u at src into cell + u, for u in [0, n)
+typedef void (*RowFunc)(const void *src, size_t n, Cells *c, size_t cell,
+                        Screen *sc);
+
+/* Returns 1 if v is a value to reduce; else counts it as NaN or fill and
+ * returns 0.
+ */
+static inline int screen(Screen *sc, double v)
+{
+    if (v != v) {
+        sc->nnan++;
+        return 0;
+    }
+    if ((sc->has_fill && v == sc->fill) ||
+        (sc->has_missing && v == sc->missing)) {
+        sc->nfill++;
+        return 0;
+    }
+    return 1;
+}
+
+/* --- plain C kernels, for every numeric type --- */
+
+#define REDUCE_TYPES(X) \
+    X(i8, int8_t) X(u8, uint8_t) X(i16, int16_t) X(u16, uint16_t) \
+    X(i32, int32_t) X(u32, uint32_t) X(i64, int64_t) X(u64, uint64_t) \
+    X(f32, float) X(f64, double)
+
+#define DEF_KERNELS(N, T) \
+    static void run_##N(const void *src, size_t n, Cells *c, size_t cell, \
+                        Screen *sc) \
+    { \
+        const T *s = src; \
+        double k = c->shift[cell], mn = c->min[cell], mx = c->max[cell]; \
+        double cnt = 0, sum = 0, sq = 0; \
+        int first = (c->cnt[cell] == 0); \
+        for (size_t u = 0; u < n; u++) { \
+            double v = (double)s[u]; \
+            if (!screen(sc, v)) \
+                continue; \
+            if (first) { \
+                k = c->shift[cell] = v; \
+                first = 0; \
+            } \
+            double d = v - k; \
+            cnt++; \
+            sum += d; \
+            sq += d * d; \
+            if (v < mn) mn = v; \
+            if (v > mx) mx = v; \
+        } \
+        c->cnt[cell] += cnt; \
+        c->sum[cell] += sum; \
+        c->sq[cell] += sq; \
+        c->min[cell] = mn; \
+        c->max[cell] = mx; \
+    } \
+    static void row_##N(const void *src, size_t n, Cells *c, size_t cell, \
+                        Screen *sc) \
+    { \
+        const T *s = src; \
+        for (size_t u = 0; u < n; u++) { \
+            double v = (double)s[u]; \
+            if (!screen(sc, v)) \
+                continue; \
+            size_t j = cell + u; \
+            if (c->cnt[j] == 0) \
+                c->shift[j] = v; \
+            double d = v - c->shift[j]; \
+            c->cnt[j]++; \
+            c->sum[j] += d; \
+            c->sq[j] += d * d; \
+            if (v < c->min[j]) c->min[j] = v; \
+            if (v > c->max[j]) c->max[j] = v; \
+        } \
+    }
+REDUCE_TYPES(DEF_KERNELS)
+
+// indexed by SDSType - SDS_I8 for SDS_I8 .. SDS_DOUBLE
+#define RUN_ENTRY(N, T) run_##N,
+#define ROW_ENTRY(N, T) row_##N,
+static const RunFunc c_runs[10] = { REDUCE_TYPES(RUN_ENTRY) };
+static const RowFunc c_rows[10] = { REDUCE_TYPES(ROW_ENTRY) };
+
+/* --- AVX2 kernels for float and double --- */
+
+#ifdef SDS_X86_SIMD
+// vectors used by SCREEN4(); declare in an AVX2 function taking sc
+#define SCREEN4_VARS(sc) \
+    const __m256d ones = _mm256_castsi256_pd(_mm256_set1_epi64x(-1)); \
+    const __m256d one = _mm256_set1_pd(1.0); \
+    const __m256d fill = _mm256_set1_pd((sc)->fill); \
+    const __m256d fill_on = _mm256_castsi256_pd( \
+        _mm256_set1_epi64x((sc)->has_fill ? -1 : 0)); \
+    const __m256d miss = _mm256_set1_pd((sc)->missing); \
+    const __m256d miss_on = _mm256_castsi256_pd( \
+        _mm256_set1_epi64x((sc)->has_missing ? -1 : 0)); \
+    __m256d nnan = _mm256_setzero_pd(), nfill = _mm256_setzero_pd()
+
+// sets ok to all ones in the lanes of v holding values to reduce, and
+// counts the NaN and fill values in the other lanes
+#define SCREEN4(v, ok) do { \
+        __m256d nan_ = _mm256_cmp_pd(v, v, _CMP_UNORD_Q); \
+        __m256d fill_ = _mm256_or_pd( \
+            _mm256_and_pd(_mm256_cmp_pd(v, fill, _CMP_EQ_OQ), fill_on), \
+            _mm256_and_pd(_mm256_cmp_pd(v, miss, _CMP_EQ_OQ), miss_on)); \
+        nnan = _mm256_add_pd(nnan, _mm256_and_pd(nan_, one)); \
+        nfill = _mm256_add_pd(nfill, _mm256_and_pd(fill_, one)); \
+        ok = _mm256_xor_pd(_mm256_or_pd(nan_, fill_), ones); \
+    } while (0)
+
+// adds the lane counts of SCREEN4() to sc
+#define SCREEN4_DONE(sc) do { \
+        double t_[4]; \
+        _mm256_storeu_pd(t_, nnan); \
+        (sc)->nnan += (size_t)(t_[0] + t_[1] + t_[2] + t_[3]); \
+        _mm256_storeu_pd(t_, nfill); \
+        (sc)->nfill += (size_t)(t_[0] + t_[1] + t_[2] + t_[3]); \
+    } while (0)
+
+// accumulates the lanes of v into the vector totals of a run kernel
+#define RUN4(v) do { \
+        __m256d ok_; \
+        SCREEN4(v, ok_); \
+        __m256d d_ = _mm256_and_pd(_mm256_sub_pd(v, k), ok_); \
+        cnt = _mm256_add_pd(cnt, _mm256_and_pd(ok_, one)); \
+        sum = _mm256_add_pd(sum, d_); \
+        sq = _mm256_add_pd(sq, _mm256_mul_pd(d_, d_)); \
+        mn = _mm256_min_pd(mn, _mm256_blendv_pd(pinf, v, ok_)); \
+        mx = _mm256_max_pd(mx, _mm256_blendv_pd(ninf, v, ok_)); \
+    } while (0)
+
+// accumulates the lanes of v into cells j .. j + 3
+#define ROW4(v, j) do { \
+        __m256d ok_; \
+        SCREEN4(v, ok_); \
+        __m256d c_ = _mm256_loadu_pd(c->cnt + (j)); \
+        __m256d k_ = _mm256_loadu_pd(c->shift + (j)); \
+        __m256d first_ = _mm256_and_pd(ok_, \
+            _mm256_cmp_pd(c_, _mm256_setzero_pd(), _CMP_EQ_OQ)); \
+        k_ = _mm256_blendv_pd(k_, v, first_); \
+        __m256d d_ = _mm256_and_pd(_mm256_sub_pd(v, k_), ok_); \
+        _mm256_storeu_pd(c->shift + (j), k_); \
+        _mm256_storeu_pd(c->cnt + (j), \
+                         _mm256_add_pd(c_, _mm256_and_pd(ok_, one))); \
+        _mm256_storeu_pd(c->sum + (j), \
+                         _mm256_add_pd(_mm256_loadu_pd(c->sum + (j)), d_)); \
+        _mm256_storeu_pd(c->sq + (j), \
+                         _mm256_add_pd(_mm256_loadu_pd(c->sq + (j)), \
+                                       _mm256_mul_pd(d_, d_))); \
+        _mm256_storeu_pd(c->min + (j), \
+                         _mm256_min_pd(_mm256_loadu_pd(c->min + (j)), \
+                                       _mm256_blendv_pd(pinf, v, ok_))); \
+        _mm256_storeu_pd(c->max + (j), \
+                         _mm256_max_pd(_mm256_loadu_pd(c->max + (j)), \
+                                       _mm256_blendv_pd(ninf, v, ok_))); \
+    } while (0)
+
+// vector totals of a run kernel, about the cell's shift
+#define RUN4_VARS(c, cell) \
+    const __m256d k = _mm256_set1_pd((c)->shift[cell]); \
+    const __m256d pinf = _mm256_set1_pd(INFINITY); \
+    const __m256d ninf = _mm256_set1_pd(-INFINITY); \
+    __m256d cnt = _mm256_setzero_pd(), sum = _mm256_setzero_pd(); \
+    __m256d sq = _mm256_setzero_pd(); \
+    __m256d mn = pinf, mx = ninf
+
+// adds the vector totals of a run kernel to the cell
+#define RUN4_DONE(c, cell) do { \
+        double t_[4]; \
+        _mm256_storeu_pd(t_, cnt); \
+        (c)->cnt[cell] += t_[0] + t_[1] + t_[2] + t_[3]; \
+        _mm256_storeu_pd(t_, sum); \
+        (c)->sum[cell] += t_[0] + t_[1] + t_[2] + t_[3]; \
+        _mm256_storeu_pd(t_, sq); \
+        (c)->sq[cell] += t_[0] + t_[1] + t_[2] + t_[3]; \
+        _mm256_storeu_pd(t_, mn); \
+        for (int l_ = 0; l_ < 4; l_++) \
+            if (t_[l_] < (c)->min[cell]) (c)->min[cell] = t_[l_]; \
+        _mm256_storeu_pd(t_, mx); \
+        for (int l_ = 0; l_ < 4; l_++) \
+            if (t_[l_] > (c)->max[cell]) (c)->max[cell] = t_[l_]; \
+    } while (0)
+
+__attribute__((target("avx2")))
+static void run_f32_avx2(const void *src, size_t n, Cells *c, size_t cell,
+                         Screen *sc)
+{
+    const float *s = src;
+    size_t u = 0;
+    // values up to the first one to reduce set the shift
+    for (; u < n && c->cnt[cell] == 0; u++)
+        run_f32(s + u, 1, c, cell, sc);
+
+    SCREEN4_VARS(sc);
+    RUN4_VARS(c, cell);
+    for (; u + 8 <= n; u += 8) {
+        __m256 f = _mm256_loadu_ps(s + u);
+        __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(f));
+        __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1));
+        RUN4(lo);
+        RUN4(hi);
+    }
+    SCREEN4_DONE(sc);
+    RUN4_DONE(c, cell);
+    run_f32(s + u, n - u, c, cell, sc);
+}
+
+__attribute__((target("avx2")))
+static void run_f64_avx2(const void *src, size_t n, Cells *c, size_t cell,
+                         Screen *sc)
+{
+    const double *s = src;
+    size_t u = 0;
+    for (; u < n && c->cnt[cell] == 0; u++)
+        run_f64(s + u, 1, c, cell, sc);
+
+    SCREEN4_VARS(sc);
+    RUN4_VARS(c, cell);
+    for (; u + 4 <= n; u += 4) {
+        __m256d v = _mm256_loadu_pd(s + u);
+        RUN4(v);
+    }
+    SCREEN4_DONE(sc);
+    RUN4_DONE(c, cell);
+    run_f64(s + u, n - u, c, cell, sc);
+}
+
+__attribute__((target("avx2")))
+static void row_f32_avx2(const void *src, size_t n, Cells *c, size_t cell,
+                         Screen *sc)
+{
+    const float *s = src;
+    const __m256d pinf = _mm256_set1_pd(INFINITY);
+    const __m256d ninf = _mm256_set1_pd(-INFINITY);
+    SCREEN4_VARS(sc);
+    size_t u = 0;
+    for (; u + 8 <= n; u += 8) {
+        __m256 f = _mm256_loadu_ps(s + u);
+        __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(f));
+        __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1));
+        ROW4(lo, cell + u);
+        ROW4(hi, cell + u + 4);
+    }
+    SCREEN4_DONE(sc);
+    row_f32(s + u, n - u, c, cell + u, sc);
+}
+
+__attribute__((target("avx2")))
+static void row_f64_avx2(const void *src, size_t n, Cells *c, size_t cell,
+                         Screen *sc)
+{
+    const double *s = src;
+    const __m256d pinf = _mm256_set1_pd(INFINITY);
+    const __m256d ninf = _mm256_set1_pd(-INFINITY);
+    SCREEN4_VARS(sc);
+    size_t u = 0;
+    for (; u + 4 <= n; u += 4) {
+        __m256d v = _mm256_loadu_pd(s + u);
+        ROW4(v, cell + u);
+    }
+    SCREEN4_DONE(sc);
+    row_f64(s + u, n - u, c, cell + u, sc);
+}
+
+static int have_avx2(void)
+{
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2;
+}
+#endif
+
+static void find_kernels(SDSVarInfo *var, RunFunc *run, RowFunc *row)
+{
+    if (var->type < SDS_I8 || var->type > SDS_DOUBLE) {
+        fprintf(stderr, "can't reduce %s, of type %s\n", var->name,
+                sds_type_names[var->type]);
+        abort();
+    }
+    *run = c_runs[var->type - SDS_I8];
+    *row = c_rows[var->type - SDS_I8];
+#ifdef SDS_X86_SIMD
+    if (have_avx2()) {
+        if (var->type == SDS_FLOAT) {
+            *run = run_f32_avx2;
+            *row = row_f32_avx2;
+        } else if (var->type == SDS_DOUBLE) {
+            *run = run_f64_avx2;
+            *row = row_f64_avx2;
+        }
+    }
+#endif
+}
+
+/* --- tiling --- */
+
+typedef struct {
+    SDSVarInfo *var;
+    size_t elsize;
+    size_t *cstride; // result stride of each dimension; 0 if reduced over
+    size_t tile;     // most bytes a tile holds
+    int split;       // dimension tiles are cut along; -1 for scalars
+    size_t rows;     // ...and how many of its indices each tile covers
+    int part;        // kept dimension tasks are slabs of, or -1 for tiles
+    size_t part_rows; // ...and how many of its indices each slab covers
+    int group;       // first of the trailing dims that runs of values span
+    int inner_reduced; // runs go into one cell; else each into its own
+    RunFunc run;
+    RowFunc row;
+    Cells *cells;    // per worker, or just one if tasks never share cells
+    int shared;
+    Screen *screens; // per worker
+    void **bufs;     // per worker
+} Reduce;
+
+/* Steps the index of the dimensions before the run group on to the next
+ * run, returning the cell of that run.
+ */
+static size_t next_run(size_t *idx, const int *count, const size_t *cstride,
+                       int g, size_t cell)
+{
+    for (int i = g - 1; i >= 0; i--) {
+        cell += cstride[i];
+        if (++idx[i] < (size_t)count[i])
+            return cell;
+        cell -= cstride[i] * (size_t)count[i];
+        idx[i] = 0;
+    }
+    return cell;
+}
+
+static void reduce_tile(Reduce *r, const char *data, const int *start,
+                        const int *count, Cells *c, Screen *sc)
+{
+    int ndims = r->var->ndims, g = r->group;
+    size_t run = 1, nruns = 1, cell0 = 0;
+    for (int i = 0; i < ndims; i++) {
+        if (i < g)
+            nruns *= (size_t)count[i];
+        else
+            run *= (size_t)count[i];
+        cell0 += r->cstride[i] * (size_t)start[i];
+    }
+    size_t *idx = ALLOCA(size_t, g + 1);
+    memset(idx, 0, sizeof(size_t) * (g + 1));
+
+    if (r->inner_reduced) {
+        size_t cell = cell0;
+        for (size_t k = 0; k < nruns; k++) {
+            r->run(data + k * run * r->elsize, run, c, cell, sc);
+            cell = next_run(idx, count, r->cstride, g, cell);
+        }
+        return;
+    }
+
+    // a block of the run's cells at a time over all the runs, so rows
+    // landing on the same cells find them in cache
+    for (size_t b = 0; b < run; b += ROW_BLOCK) {
+        size_t m = (run - b < ROW_BLOCK) ? run - b : ROW_BLOCK;
+        size_t cell = cell0;
+        for (size_t k = 0; k < nruns; k++) {
+            r->row(data + (k * run + b) * r->elsize, m, c, cell + b, sc);
+            cell = next_run(idx, count, r->cstride, g, cell);
+        }
+    }
+}
+
+/* Plans the tiles of a box of the variable with the given count along each
+ * dimension: whole in the dimensions after *split, *rows indices of that
+ * one at a time, and single indices of those before it.  Returns the
+ * number of tiles.
+ */
+static size_t plan_tiles(const Reduce *r, const int *count, size_t tile,
+                         int *split, size_t *rows)
+{
+    int ndims = r->var->ndims;
+    size_t inner = r->elsize;
+    for (int i = 0; i < ndims; i++)
+        inner *= (size_t)count[i];
+    *split = -1;
+    *rows = 1;
+    if (ndims == 0 || inner == 0)
+        return (inner > 0) ? 1 : 0;
+
+    // a row of the last dimension is a single element
+    int s = 0;
+    for (; s < ndims - 1; s++) {
+        inner /= (size_t)count[s];
+        if (inner <= tile)
+            break;
+    }
+    if (s == ndims - 1)
+        inner = r->elsize;
+    *split = s;
+    *rows = tile / inner;
+    if (*rows < 1)
+        *rows = 1;
+    if (*rows > (size_t)count[s])
+        *rows = (size_t)count[s];
+    size_t n = ((size_t)count[s] + *rows - 1) / *rows;
+    for (int i = 0; i < s; i++)
+        n *= (size_t)count[i];
+    return n;
+}
+
+// start and count of tile t of the box bstart/bcount planned as above
+static void tile_bounds(const Reduce *r, const int *bstart, const int *bcount,
+                        int split, size_t rows, size_t t, int *start,
+                        int *count)
+{
+    size_t nchunks = 1;
+    if (split >= 0)
+        nchunks = ((size_t)bcount[split] + rows - 1) / rows;
+    size_t chunk = t % nchunks;
+    t /= nchunks;
+    for (int i = r->var->ndims - 1; i >= 0; i--) {
+        size_t size = (size_t)bcount[i];
+        if (i > split) {
+            start[i] = bstart[i];
+            count[i] = bcount[i];
+        } else if (i == split) {
+            size_t first = chunk * rows;
+            start[i] = bstart[i] + (int)first;
+            count[i] = (int)((size - first < rows) ? size - first : rows);
+        } else {
+            start[i] = bstart[i] + (int)(t % size);
+            count[i] = 1;
+            t /= size;
+        }
+    }
+}
+
+static void read_tile(Reduce *r, int worker, int *start, int *count)
+{
+    int ndims = r->var->ndims;
+    const char *data = sds_readv(r->var, r->bufs + worker,
+                                 ndims ? start : NULL, ndims ? count : NULL);
+    reduce_tile(r, data, start, count, r->cells + (r->shared ? 0 : worker),
+                r->screens + worker);
+}
+
+/* A task is either one tile of the whole variable, or a slab of indices of
+ * the kept dimension r->part, whose cells no other task touches, reduced a
+ * tile at a time.
+ */
+static void reduce_task(void *arg, size_t task, int worker)
+{
+    Reduce *r = arg;
+    SDSVarInfo *var = r->var;
+    int ndims = var->ndims;
+    int *bstart = ALLOCA(int, ndims + 1);
+    int *bcount = ALLOCA(int, ndims + 1);
+    int *start = ALLOCA(int, ndims + 1);
+    int *count = ALLOCA(int, ndims + 1);
+    for (int i = 0; i < ndims; i++) {
+        bstart[i] = 0;
+        bcount[i] = (int)var->dims[i]->size;
+    }
+
+    if (r->part < 0) {
+        tile_bounds(r, bstart, bcount, r->split, r->rows, task, start, count);
+        read_tile(r, worker, start, count);
+        return;
+    }
+
+    size_t size = (size_t)bcount[r->part], first = task * r->part_rows;
+    bstart[r->part] = (int)first;
+    bcount[r->part] = (int)((size - first < r->part_rows) ? size - first :
+                            r->part_rows);
+    int split;
+    size_t rows;
+    size_t ntiles = plan_tiles(r, bcount, r->tile, &split, &rows);
+    for (size_t t = 0; t < ntiles; t++) {
+        tile_bounds(r, bstart, bcount, split, rows, t, start, count);
+        read_tile(r, worker, start, count);
+    }
+}
+
+static void init_cells(Cells *c, double *mem, size_t n)
+{
+    c->cnt = mem;
+    c->sum = mem + n;
+    c->sq = mem + 2 * n;
+    c->min = mem + 3 * n;
+    c->max = mem + 4 * n;
+    c->shift = mem + 5 * n;
+    memset(mem, 0, sizeof(double) * 3 * n);
+    for (size_t j = 0; j < n; j++) {
+        c->min[j] = INFINITY;
+        c->max[j] = -INFINITY;
+        c->shift[j] = 0;
+    }
+}
+
+/* Adds the totals of b into a, moving b's sums over to a's shifts.
+ */
+static void merge_cells(Cells *a, const Cells *b, size_t n)
+{
+    for (size_t j = 0; j < n; j++) {
+        double nb = b->cnt[j];
+        if (nb == 0)
+            continue;
+        if (a->cnt[j] == 0) {
+            a->cnt[j] = nb;
+            a->sum[j] = b->sum[j];
+            a->sq[j] = b->sq[j];
+            a->shift[j] = b->shift[j];
+        } else {
+            double delta = b->shift[j] - a->shift[j];
+            a->cnt[j] += nb;
+            a->sq[j] += b->sq[j] + 2 * delta * b->sum[j] + nb * delta * delta;
+            a->sum[j] += b->sum[j] + nb * delta;
+        }
+        if (b->min[j] < a->min[j])
+            a->min[j] = b->min[j];
+        if (b->max[j] > a->max[j])
+            a->max[j] = b->max[j];
+    }
+}
+
+/* Reduces the variable over the dimensions flagged in reduce, reading it a
+ * tile at a time and never all at once.  The result has one cell for each
+ * combination of indices of the remaining dimensions, in C order, with the
+ * count, minimum, maximum, sum, mean and (population) variance of the
+ * values that went into it.  Values equal to the _FillValue or
+ * missing_value (see sds_var_packing()) and NaNs are left out and counted
+ * in nfill and nnan.  A cell that got no values has NaN for its minimum,
+ * maximum, mean and variance.
+ *
+ * So for a [time][lat][lon] variable, reduce = {1, 0, 0} gives time means
+ * on the grid, and a NULL reduce gives the statistics of the whole variable
+ * in one cell.
+ *
+ * reduce   - var->ndims flags: nonzero to reduce over that dimension.  NULL
+ *            reduces over all of them.
+ * unpack   - nonzero to give the results unpacked with the scale_factor and
+ *            add_offset of the variable.
+ * budget   - most bytes of data to hold at once in tiles; 0 for 64 MB.  The
+ *            result takes 48 bytes per cell on top of that.  When tiles
+ *            could share cells (the slowest dimension is reduced over), the
+ *            work is split along a kept dimension instead; only if none is
+ *            long enough, such as when reducing over everything, do threads
+ *            get their own copies of the cells, if the budget allows.
+ * nthreads - <= 0 for sds_default_threads().
+ *
+ * Free the result with sds_reduction_free().
+ */
+SDSReduction *sds_reduce(SDSVarInfo *var, const int *reduce, int unpack,
+                         size_t budget, int nthreads)
+{
+    int ndims = var->ndims;
+    Reduce r;
+    memset(&r, 0, sizeof(r));
+    r.var = var;
+    r.elsize = sds_type_size(var->type);
+    find_kernels(var, &r.run, &r.row);
+
+    // cells and their strides, over the dimensions kept
+    SDSReduction *res = NEW0(SDSReduction);
+    res->dims = NEWA(int, ndims + 1);
+    r.cstride = ALLOCA(size_t, ndims + 1);
+    size_t ncells = 1;
+    for (int i = ndims - 1; i >= 0; i--) {
+        if (reduce && !reduce[i]) {
+            r.cstride[i] = ncells;
+            ncells *= var->dims[i]->size;
+        } else {
+            r.cstride[i] = 0;
+        }
+    }
+    for (int i = 0; i < ndims; i++)
+        if (reduce && !reduce[i])
+            res->dims[res->ndims++] = i;
+    res->n = ncells;
+
+    // runs of values span the trailing dims that are all kept or all
+    // reduced over
+    r.group = (ndims > 0) ? ndims - 1 : 0;
+    r.inner_reduced = (ndims == 0 || r.cstride[ndims - 1] == 0);
+    while (r.group > 0 &&
+           (r.cstride[r.group - 1] == 0) == (r.cstride[ndims - 1] == 0))
+        r.group--;
+
+    if (budget == 0)
+        budget = DEFAULT_BUDGET;
+    if (nthreads <= 0)
+        nthreads = sds_default_threads();
+
+    // cut tiles along the first dimension whose rows fit a worker's share
+    // of the budget, small enough that every worker gets a few of them
+    size_t total = sds_var_count(var);
+    size_t tile = budget / (size_t)nthreads;
+    if (tile > total * r.elsize / (4 * (size_t)nthreads))
+        tile = total * r.elsize / (4 * (size_t)nthreads);
+    if (tile < MIN_TILE_BYTES)
+        tile = MIN_TILE_BYTES;
+    int *sizes = ALLOCA(int, ndims + 1);
+    for (int i = 0; i < ndims; i++)
+        sizes[i] = (int)var->dims[i]->size;
+    r.tile = tile;
+    r.part = -1;
+    size_t ntasks = plan_tiles(&r, sizes, tile, &r.split, &r.rows);
+
+    // tiles differ in the dimensions up to split; if those are all kept,
+    // no two tiles share a cell and the workers can share the totals
+    r.shared = 1;
+    for (int i = 0; i <= r.split; i++)
+        if (r.cstride[i] == 0)
+            r.shared = 0;
+    size_t cell_bytes = 6 * sizeof(double) * ncells;
+
+    // otherwise split the work into slabs along a kept dimension instead,
+    // so tasks still never share a cell, unless no dimension will do (runs
+    // of values may not be cut across, so only kept ones up to the first of
+    // the run group qualify) or it's too short to keep the threads busy
+    // while copies of the cells for each thread fit the budget
+    if (!r.shared && total > 0) {
+        int part = -1;
+        for (int i = 0; i < ndims && i <= r.group; i++)
+            if (r.cstride[i] != 0 && (part < 0 || var->dims[i]->size >
+                                      var->dims[part]->size))
+                part = i;
+        int copies_fit = (size_t)(nthreads - 1) * cell_bytes <= budget;
+        if (part >= 0 && (var->dims[part]->size >= (size_t)nthreads ||
+                          !copies_fit)) {
+            size_t size = var->dims[part]->size;
+            size_t nslabs = 4 * (size_t)nthreads;
+            if (nslabs > size)
+                nslabs = size;
+            r.part = part;
+            r.part_rows = (size + nslabs - 1) / nslabs;
+            ntasks = (size + r.part_rows - 1) / r.part_rows;
+            r.shared = 1;
+        }
+    }
+    if (ntasks > 0 && (size_t)nthreads > ntasks)
+        nthreads = (int)ntasks;
+    if (nthreads < 1)
+        nthreads = 1;
+    if (!r.shared)
+        while (nthreads > 1 && (size_t)(nthreads - 1) * cell_bytes > budget)
+            nthreads--;
+
+    int ncopies = r.shared ? 1 : nthreads;
+    double *mem = sds_alloc(cell_bytes * ncopies + 1);
+    r.cells = NEWA(Cells, ncopies);
+    for (int w = 0; w < ncopies; w++)
+        init_cells(r.cells + w, mem + 6 * ncells * w, ncells);
+
+    const SDSPacking *pack = sds_var_packing(var);
+    r.screens = NEWA(Screen, nthreads);
+    r.bufs = NEWA(void *, nthreads);
+    for (int w = 0; w < nthreads; w++) {
+        Screen *sc = r.screens + w;
+        sc->has_fill = pack->has_fill;
+        sc->fill = pack->fill;
+        sc->has_missing = pack->has_missing;
+        sc->missing = pack->missing;
+        sc->nfill = sc->nnan = 0;
+        r.bufs[w] = NULL;
+    }
+
+    sds_run_tasks(reduce_task, &r, ntasks, nthreads);
+
+    for (int w = 0; w < nthreads; w++) {
+        res->nfill += r.screens[w].nfill;
+        res->nnan += r.screens[w].nnan;
+        if (r.bufs[w])
+            sds_buffer_free(r.bufs[w]);
+    }
+    for (int w = 1; w < ncopies; w++)
+        merge_cells(r.cells, r.cells + w, ncells);
+
+    // turn the shifted sums into the results
+    double scale = 1, offset = 0;
+    if (unpack) {
+        scale = pack->scale;
+        offset = pack->offset;
+    }
+    res->count = NEWA(size_t, ncells + 1);
+    res->min = NEWA(double, ncells + 1);
+    res->max = NEWA(double, ncells + 1);
+    res->sum = NEWA(double, ncells + 1);
+    res->mean = NEWA(double, ncells + 1);
+    res->variance = NEWA(double, ncells + 1);
+    Cells *c = r.cells;
+    for (size_t j = 0; j < ncells; j++) {
+        double n = c->cnt[j];
+        res->count[j] = (size_t)n;
+        if (n == 0) {
+            res->min[j] = res->max[j] = NAN;
+            res->mean[j] = res->variance[j] = NAN;
+            res->sum[j] = 0;
+            continue;
+        }
+        double variance = (c->sq[j] - c->sum[j] * c->sum[j] / n) / n;
+        if (variance < 0) // rounding
+            variance = 0;
+        double lo = c->min[j], hi = c->max[j];
+        res->sum[j] = (c->sum[j] + n * c->shift[j]) * scale + n * offset;
+        res->mean[j] = (c->shift[j] + c->sum[j] / n) * scale + offset;
+        res->variance[j] = variance * scale * scale;
+        res->min[j] = ((scale < 0) ? hi : lo) * scale + offset;
+        res->max[j] = ((scale < 0) ? lo : hi) * scale + offset;
+    }
+
+    free(r.bufs);
+    free(r.screens);
+    free(r.cells);
+    free(mem);
+    return res;
+}
+
+void sds_reduction_free(SDSReduction *res)
+{
+    if (!res)
+        return;
+    free(res->dims);
+    free(res->count);
+    free(res->min);
+    free(res->max);
+    free(res->sum);
+    free(res->mean);
+    free(res->variance);
+    free(res);
+}
@@ -0,0 +1,215 @@
+/* sds_threads.c - Worker threads for running batches of tasks, and the locks
+ *                 that serialize reads of each file and calls into the file
+ *                 format libraries.
+ *
+ * NetCDF, HDF4 and (non-threadsafe builds of) HDF5 keep global state, so
+ * only one thread at a time may call into any of them, whichever file it's
+ * reading.  Work that doesn't touch them (conversion, copying out of a
+ * mapped file) can run in parallel, and so can reads of files whose
+ * backends don't need the libraries for them (see sds_file_lock()).
+ */
+#include "sds.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void sds_io_lock(void)
+{
+    pthread_mutex_lock(&io_mutex);
+}
+
+void sds_io_unlock(void)
+{
+    pthread_mutex_unlock(&io_mutex);
+}
+
+// files share these by the hash of their SDSInfo address, so there's
+// nothing to set up or free per file; a collision just serializes two files
+#define NFILE_LOCKS 64
+
+static pthread_mutex_t file_mutexes[NFILE_LOCKS];
+static pthread_once_t file_mutexes_once = PTHREAD_ONCE_INIT;
+
+static void init_file_mutexes(void)
+{
+    for (int i = 0; i < NFILE_LOCKS; i++)
+        pthread_mutex_init(&file_mutexes[i], NULL);
+}
+
+static pthread_mutex_t *file_mutex(const SDSInfo *sds)
+{
+    pthread_once(&file_mutexes_once, init_file_mutexes);
+    uintptr_t h = (uintptr_t)sds;
+    h ^= h >> 12;
+    return &file_mutexes[(h >> 4) % NFILE_LOCKS];
+}
+
+/* Locks the file for a read through its backend.  Unless the backend said
+ * when opening it that its reads take the I/O lock themselves whenever they
+ * call into a format library (sds->own_lock), the I/O lock is held too, so
+ * reads of files that do need the libraries stay serialized while reads of
+ * ones that don't, such as mapped classic NetCDF files, run in parallel.
+ * A thread may hold only one file's lock at a time, and must not already
+ * hold the I/O lock.
+ */
+void sds_file_lock(SDSInfo *sds)
+{
+    pthread_mutex_lock(file_mutex(sds));
+    if (!sds->own_lock)
+        pthread_mutex_lock(&io_mutex);
+}
+
+void sds_file_unlock(SDSInfo *sds)
+{
+    if (!sds->own_lock)
+        pthread_mutex_unlock(&io_mutex);
+    pthread_mutex_unlock(file_mutex(sds));
+}
+
+/* The SDS_LOAD_* and SDS_STORE_* fallbacks (see sds.h) for compilers
+ * without the __atomic builtins.
+ */
+static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *sds_load_ptr(void *const *p)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    void *v = *p;
+    pthread_mutex_unlock(&atomic_mutex);
+    return v;
+}
+
+void sds_store_ptr(void **p, void *v)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    *p = v;
+    pthread_mutex_unlock(&atomic_mutex);
+}
+
+int sds_load_int(const int *p)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    int v = *p;
+    pthread_mutex_unlock(&atomic_mutex);
+    return v;
+}
+
+void sds_store_int(int *p, int v)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    *p = v;
+    pthread_mutex_unlock(&atomic_mutex);
+}
+
+unsigned sds_load_uint(const unsigned *p)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    unsigned v = *p;
+    pthread_mutex_unlock(&atomic_mutex);
+    return v;
+}
+
+void sds_store_uint(unsigned *p, unsigned v)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    *p = v;
+    pthread_mutex_unlock(&atomic_mutex);
+}
+
+/* Number of worker threads to use when the caller doesn't say: the number
+ * of online CPUs.
+ */
+int sds_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (int)n;
+}
+
+/* Seconds on a monotonic clock, for timing.
+ */
+double sds_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    SDSTaskFunc func;
+    void *arg;
+    size_t ntasks;
+    size_t next; // next task to hand out
+    pthread_mutex_t mutex;
+} TaskQueue;
+
+typedef struct {
+    TaskQueue *queue;
+    int worker;
+} Worker;
+
+static void *worker_main(void *p)
+{
+    Worker *w = p;
+    TaskQueue *q = w->queue;
+    for (;;) {
+        pthread_mutex_lock(&q->mutex);
+        size_t task = q->next++;
+        pthread_mutex_unlock(&q->mutex);
+        if (task >= q->ntasks)
+            break;
+        (q->func)(q->arg, task, w->worker);
+    }
+    return NULL;
+}
+
+/* Runs func(arg, task, worker) for each task in [0, ntasks) on nthreads
+ * threads (the calling thread being one of them), handing tasks out in
+ * order as threads come free, and returns once all of them are done.
+ * worker is in [0, nthreads) and identifies the thread, for per-thread
+ * scratch space.
+ *
+ * nthreads - <= 0 for sds_default_threads(); never more than ntasks.
+ */
+void sds_run_tasks(SDSTaskFunc func, void *arg, size_t ntasks, int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = sds_default_threads();
+    if ((size_t)nthreads > ntasks)
+        nthreads = (int)ntasks;
+    if (nthreads <= 1) {
+        for (size_t task = 0; task < ntasks; task++)
+            func(arg, task, 0);
+        return;
+    }
+
+    TaskQueue q;
+    q.func = func;
+    q.arg = arg;
+    q.ntasks = ntasks;
+    q.next = 0;
+    pthread_mutex_init(&q.mutex, NULL);
+
+    Worker *workers = NEWA(Worker, nthreads);
+    pthread_t *threads = NEWA(pthread_t, nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].queue = &q;
+        workers[i].worker = i;
+    }
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(threads + i, NULL, worker_main, workers + i)) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            abort();
+        }
+    }
+    worker_main(workers);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&q.mutex);
+    free(threads);
+    free(workers);
+}
@@ -0,0 +1,285 @@
+/* sds_transpose.c - Copying arrays into other layouts: strided scatters and
+ *                   permutations of the axes, such as turning [time][lat][lon]
+ *                   data into [lon][lat][time] for column-major code.
+ *
+ * When the destination isn't contiguous along the source's last dimension,
+ * copying row by row writes every element to a different cache line.  The
+ * copy is instead done a plane at a time, over the source's last dimension
+ * and the one the destination is densest along, in square blocks that fit
+ * in L1 so both sides are read and written a whole line at a time.  Blocks
+ * of 4 and 8 byte elements are transposed in SSE registers.
+ */
+#include "sds.h"
+#include <stdio.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SDS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// elements along each side of a block of a plane
+#define BLOCK 32
+
+/* Copies an ni x nj block: dst[i * dsi + j * dsj] = src[i * ssi + j], all
+ * in elements of the given type.
+ */
+#define DEF_BLOCK(N, T) \
+    static void block_##N(char *dst, ptrdiff_t dsi, ptrdiff_t dsj, \
+                          const char *src, ptrdiff_t ssi, \
+                          size_t ni, size_t nj) \
+    { \
+        T *d = (T *)dst; \
+        const T *s = (const T *)src; \
+        for (size_t i = 0; i < ni; i++) \
+            for (size_t j = 0; j < nj; j++) \
+                d[(ptrdiff_t)i * dsi + (ptrdiff_t)j * dsj] = \
+                    s[(ptrdiff_t)i * ssi + j]; \
+    }
+DEF_BLOCK(1, uint8_t)
+DEF_BLOCK(2, uint16_t)
+DEF_BLOCK(4, uint32_t)
+DEF_BLOCK(8, uint64_t)
+
+static void block_any(char *dst, ptrdiff_t dsi, ptrdiff_t dsj,
+                      const char *src, ptrdiff_t ssi, size_t ni, size_t nj,
+                      size_t elsize)
+{
+    ptrdiff_t es = (ptrdiff_t)elsize;
+    for (size_t i = 0; i < ni; i++)
+        for (size_t j = 0; j < nj; j++)
+            memcpy(dst + ((ptrdiff_t)i * dsi + (ptrdiff_t)j * dsj) * es,
+                   src + ((ptrdiff_t)i * ssi + (ptrdiff_t)j) * es, elsize);
+}
+
+#ifdef SDS_X86_SIMD
+enum { CPU_SSE = 1, CPU_SSE2 = 2 };
+
+// 32-bit x86 builds can't count on SSE, so the kernels check at run time
+static int cpu_features(void)
+{
+    static int features = -1;
+    if (features < 0) {
+        int f = 0;
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse"))  f |= CPU_SSE;
+        if (__builtin_cpu_supports("sse2")) f |= CPU_SSE2;
+        features = f;
+    }
+    return features;
+}
+
+/* Like block_4() for a destination contiguous along i (dsi == 1),
+ * transposing 4 x 4 tiles in registers.
+ */
+__attribute__((target("sse")))
+static void block_4_sse(char *dst, ptrdiff_t dsj, const char *src,
+                        ptrdiff_t ssi, size_t ni, size_t nj)
+{
+    float *d = (float *)dst;
+    const float *s = (const float *)src;
+    size_t i = 0;
+    for (; i + 4 <= ni; i += 4) {
+        const float *r = s + (ptrdiff_t)i * ssi;
+        size_t j = 0;
+        for (; j + 4 <= nj; j += 4) {
+            __m128 r0 = _mm_loadu_ps(r + j);
+            __m128 r1 = _mm_loadu_ps(r + ssi + j);
+            __m128 r2 = _mm_loadu_ps(r + 2 * ssi + j);
+            __m128 r3 = _mm_loadu_ps(r + 3 * ssi + j);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            float *o = d + (ptrdiff_t)j * dsj + i;
+            _mm_storeu_ps(o, r0);
+            _mm_storeu_ps(o + dsj, r1);
+            _mm_storeu_ps(o + 2 * dsj, r2);
+            _mm_storeu_ps(o + 3 * dsj, r3);
+        }
+        if (j < nj)
+            block_4((char *)(d + (ptrdiff_t)j * dsj + i), 1, dsj,
+                    (const char *)(r + j), ssi, 4, nj - j);
+    }
+    if (i < ni)
+        block_4((char *)(d + i), 1, dsj, (const char *)(s + (ptrdiff_t)i * ssi),
+                ssi, ni - i, nj);
+}
+
+/* Like block_8() for a destination contiguous along i, transposing 2 x 2
+ * tiles in registers.
+ */
+__attribute__((target("sse2")))
+static void block_8_sse2(char *dst, ptrdiff_t dsj, const char *src,
+                         ptrdiff_t ssi, size_t ni, size_t nj)
+{
+    double *d = (double *)dst;
+    const double *s = (const double *)src;
+    size_t i = 0;
+    for (; i + 2 <= ni; i += 2) {
+        const double *r = s + (ptrdiff_t)i * ssi;
+        size_t j = 0;
+        for (; j + 2 <= nj; j += 2) {
+            __m128d r0 = _mm_loadu_pd(r + j);
+            __m128d r1 = _mm_loadu_pd(r + ssi + j);
+            double *o = d + (ptrdiff_t)j * dsj + i;
+            _mm_storeu_pd(o, _mm_unpacklo_pd(r0, r1));
+            _mm_storeu_pd(o + dsj, _mm_unpackhi_pd(r0, r1));
+        }
+        if (j < nj)
+            block_8((char *)(d + (ptrdiff_t)j * dsj + i), 1, dsj,
+                    (const char *)(r + j), ssi, 2, nj - j);
+    }
+    if (i < ni)
+        block_8((char *)(d + i), 1, dsj, (const char *)(s + (ptrdiff_t)i * ssi),
+                ssi, ni - i, nj);
+}
+#endif
+
+/* Copies an ni x nj plane, dst[i * dsi + j * dsj] = src[i * ssi + j] in
+ * elements, a block at a time.
+ */
+static void copy_plane(char *dst, ptrdiff_t dsi, ptrdiff_t dsj,
+                       const char *src, ptrdiff_t ssi, size_t ni, size_t nj,
+                       size_t elsize)
+{
+    ptrdiff_t es = (ptrdiff_t)elsize;
+#ifdef SDS_X86_SIMD
+    int cpu = cpu_features();
+#endif
+    for (size_t i = 0; i < ni; i += BLOCK) {
+        size_t bi = (ni - i < BLOCK) ? ni - i : BLOCK;
+        for (size_t j = 0; j < nj; j += BLOCK) {
+            size_t bj = (nj - j < BLOCK) ? nj - j : BLOCK;
+            char *d = dst + ((ptrdiff_t)i * dsi + (ptrdiff_t)j * dsj) * es;
+            const char *s = src + ((ptrdiff_t)i * ssi + (ptrdiff_t)j) * es;
+            switch (elsize) {
+            case 1: block_1(d, dsi, dsj, s, ssi, bi, bj); break;
+            case 2: block_2(d, dsi, dsj, s, ssi, bi, bj); break;
+            case 4:
+#ifdef SDS_X86_SIMD
+                if (dsi == 1 && (cpu & CPU_SSE)) {
+                    block_4_sse(d, dsj, s, ssi, bi, bj);
+                    break;
+                }
+#endif
+                block_4(d, dsi, dsj, s, ssi, bi, bj);
+                break;
+            case 8:
+#ifdef SDS_X86_SIMD
+                if (dsi == 1 && (cpu & CPU_SSE2)) {
+                    block_8_sse2(d, dsj, s, ssi, bi, bj);
+                    break;
+                }
+#endif
+                block_8(d, dsi, dsj, s, ssi, bi, bj);
+                break;
+            default:
+                block_any(d, dsi, dsj, s, ssi, bi, bj, elsize);
+            }
+        }
+    }
+}
+
+/* Copies the packed (C order) array src of shape cnt into dst, laid out
+ * with the given element strides.  Private to the library; see
+ * sds_readv_into().
+ */
+void sds_scatter(void *dst, const ptrdiff_t *strides, const void *src,
+                 int ndims, const size_t *cnt, size_t elsize)
+{
+    if (ndims < 1) {
+        memcpy(dst, src, elsize);
+        return;
+    }
+    int last = ndims - 1;
+
+    // plane over last and the other dimension densest in dst, if last
+    // isn't already contiguous there
+    int p = -1;
+    if (strides[last] != 1) {
+        for (int i = 0; i < last; i++) {
+            ptrdiff_t s = (strides[i] < 0) ? -strides[i] : strides[i];
+            if (cnt[i] > 1 &&
+                (p < 0 || s < ((strides[p] < 0) ? -strides[p] : strides[p])))
+                p = i;
+        }
+    }
+
+    // source element strides
+    size_t *sstr = ALLOCA(size_t, ndims);
+    sstr[last] = 1;
+    for (int i = last - 1; i >= 0; i--)
+        sstr[i] = sstr[i + 1] * cnt[i + 1];
+
+    size_t *idx = ALLOCA(size_t, ndims);
+    memset(idx, 0, sizeof(size_t) * ndims);
+    ptrdiff_t es = (ptrdiff_t)elsize;
+    for (;;) {
+        char *out = dst;
+        const char *in = src;
+        for (int i = 0; i < last; i++) {
+            out += (ptrdiff_t)idx[i] * strides[i] * es;
+            in += idx[i] * sstr[i] * elsize;
+        }
+        if (p >= 0)
+            copy_plane(out, strides[p], strides[last], in, (ptrdiff_t)sstr[p],
+                       cnt[p], cnt[last], elsize);
+        else if (strides[last] == 1)
+            memcpy(out, in, cnt[last] * elsize);
+        else
+            copy_plane(out, 0, strides[last], in, 0, 1, cnt[last], elsize);
+
+        // next row or plane; p was covered whole by the plane
+        int i = last - 1;
+        for (; i >= 0; i--) {
+            if (i == p)
+                continue;
+            if (++idx[i] < cnt[i])
+                break;
+            idx[i] = 0;
+        }
+        if (i < 0)
+            break;
+    }
+}
+
+/* Fills in strides with the element stride in dst of each dimension of
+ * src, for the transpose below.  Private to the library; see
+ * sds_readv_perm().  Aborts, after printing why, if perm isn't a
+ * permutation of 0..ndims-1.
+ */
+void sds_perm_strides(ptrdiff_t *strides, int ndims, const size_t *count,
+                      const int *perm)
+{
+    int *seen = ALLOCA(int, ndims + 1);
+    memset(seen, 0, sizeof(int) * (ndims + 1));
+    for (int i = 0; i < ndims; i++) {
+        if (perm[i] < 0 || perm[i] >= ndims || seen[perm[i]]++) {
+            fprintf(stderr, "axis order is not a permutation of %i dimensions\n",
+                    ndims);
+            abort();
+        }
+    }
+
+    ptrdiff_t stride = 1;
+    for (int i = ndims - 1; i >= 0; i--) {
+        strides[perm[i]] = stride;
+        stride *= (ptrdiff_t)count[perm[i]];
+    }
+}
+
+/* Copies the C-order array src, of shape count, into dst with its axes
+ * permuted: dimension i of dst is dimension perm[i] of src.  So for src
+ * [time][lat][lon], perm {2, 1, 0} gives [lon][lat][time], the same array
+ * Fortran would see as (time, lat, lon).  The arrays must not overlap.
+ * Aborts, after printing why, if perm isn't a permutation of 0..ndims-1.
+ */
+void sds_transpose(void *dst, const void *src, int ndims, const size_t *count,
+                   const int *perm, size_t elsize)
+{
+    ptrdiff_t *strides = ALLOCA(ptrdiff_t, ndims + 1);
+    sds_perm_strides(strides, ndims, count, perm);
+    for (int i = 0; i < ndims; i++)
+        if (count[i] == 0)
+            return;
+    sds_scatter(dst, strides, src, ndims, count, elsize);
+}
@@ -0,0 +1,86 @@
+/* stress_atts.c - Copies and frees metadata with 1,000,000 attributes.
+ *
+ * The list copy and free functions used to recurse once per member, so
+ * lists this long overflowed the stack.  Run it with a small stack (the
+ * Makefile's check target uses ulimit -s 256) to make sure they don't any
+ * more.  Exits with status 1, after printing why, if a copy comes out
+ * wrong.
+ */
+#include "sds.h"
+#include <stdio.h>
+#include <string.h>
+
+#define NATTS 1000000
+
+static int failed = 0;
+
+static void check_atts(const char *what, SDSAttInfo *att, size_t n)
+{
+    size_t count = sds_list_count((SDSList *)att);
+    if (count != n) {
+        fprintf(stderr, "%s: %u attributes, expected %u\n", what,
+                (unsigned)count, (unsigned)n);
+        failed = 1;
+        return;
+    }
+    // built by prepending, so the values count down
+    for (size_t i = 0; att != NULL; att = att->next, i++) {
+        int32_t want = (int32_t)(n - 1 - i);
+        if (att->count != 1 || att->data.i[0] != want) {
+            fprintf(stderr, "%s: attribute %u is wrong\n", what,
+                    (unsigned)i);
+            failed = 1;
+            return;
+        }
+    }
+}
+
+int main(void)
+{
+    SDSAttInfo *gatts = NULL;
+    for (int32_t i = 0; i < NATTS; i++) {
+        char name[32];
+        sprintf(name, "att%i", (int)i);
+        gatts = sds_create_att(gatts, name, SDS_I32, 1, &i);
+    }
+    check_atts("created", gatts, NATTS);
+
+    SDSDimInfo *dims = sds_create_dim(NULL, "x", 4, 0);
+    SDSVarInfo *vars = sds_create_varv(NULL, "v", SDS_FLOAT, 0,
+                                       sds_atts_generic_copy(gatts), 1,
+                                       dims);
+    check_atts("copied list", vars->atts, NATTS);
+    SDSInfo *sds = create_sds(gatts, dims, vars);
+
+    // a copy into an arena, and one member by member
+    SDSInfo *copy = sds_generic_copy(sds);
+    check_atts("arena copy", copy->gatts, NATTS);
+    check_atts("arena copy var", copy->vars->atts, NATTS);
+    SDSAttInfo *heap = sds_atts_generic_copy(copy->gatts);
+    check_atts("heap copy", heap, NATTS);
+
+    heap = (SDSAttInfo *)sds_list_reverse((SDSList *)heap);
+    if (heap->data.i[0] != 0) {
+        fputs("reverse: first attribute is wrong\n", stderr);
+        failed = 1;
+    }
+    sds_free_atts(heap);
+
+    // drop every attribute but one through the keep and delete functions
+    const char *names[] = { "att0" };
+    copy->gatts = sds_keep_atts(copy->gatts, names, 1);
+    check_atts("kept", copy->gatts, 1);
+    copy->vars->atts = sds_delete_atts(copy->vars->atts, names, 1);
+    if (sds_list_count((SDSList *)copy->vars->atts) != NATTS - 1) {
+        fputs("delete: wrong number of attributes left\n", stderr);
+        failed = 1;
+    }
+
+    sds_close(copy);
+    sds_close(sds);
+
+    if (failed)
+        return 1;
+    puts("stress_atts: ok");
+    return 0;
+}